@@ -0,0 +1,455 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* ADPT: per-page adaptive PCM1/PCM2/PCM3 encoder */
+
+/*
+ * XP のページ (16KiB) ごとに PCM1/PCM2/PCM3 を切り替える。
+ * ページの先頭 4 バイトがページヘッダで、最初のバイトがそのページの
+ * フォーマット (XP のフォーマットコード 1 = PCM1, 2 = PCM2, 3 = PCM3)、
+ * 次が 0、残り 2 バイトがそのページのサンプル数 (16bit LE) で、
+ * その後ろ 16380 バイトにサンプルが詰まっている
+ * (PCM1 16380, PCM2 8190, PCM3 4095 サンプルまで)。
+ * 最後のページは最後のサンプルで埋めるが、埋めた分はサンプル数に
+ * 入らない。XP のファームウェアは最初のバイトしか見ない。
+ * サンプル数が 0 のページ (古いファイル) はページ全体を数える。
+ *
+ * ページの途中で音量が飛ばないように、どのフォーマットも PCM3 の
+ * テーブルと同じ目標電圧 (u8 * PCM3_TABLE_gain + PCM3_TABLE_offset) に
+ * 合わせる。PCM3 のページは普通の PCM3 と同じ値になる。
+ *
+ * 次のページの候補を安い順 (1 ページに入るサンプルが多い順) に試し、
+ * そのページに入るサンプルの RMS 誤差 (u8 の 1 LSB 単位) がしきい値
+ * 以下なら採用する。PCM3 は常に採用する。
+ *
+ * 変換は u8 のまま通し、この writer がページにして次に渡す。
+ * -s/-t のときは adpt_read_init で u8 に戻してから数える。
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+
+#define ADPT_HDRSIZE	(4)
+#define ADPT_PAYLOAD	(XP_BUFSIZE - ADPT_HDRSIZE)
+// XP のフォーマットコード
+#define ADPT_PCM1		(1)
+#define ADPT_PCM2		(2)
+#define ADPT_PCM3		(3)
+
+struct adpt {
+	DESC *next;
+	uint8_t in[ADPT_PAYLOAD];	// ページにしていない u8 サンプル
+	int inlen;
+	BUFFER page;
+	double threshold;			// RMS 誤差の上限 (LSB)
+	int64_t npages[4];
+};
+
+// ADPT を u8 に戻す reader
+struct adptr {
+	DESC *inner;
+	BUFFER page;				// 読んだページ
+	uint8_t out[ADPT_PAYLOAD];	// 戻した u8 サンプル
+	int outlen;
+	int outpos;
+};
+
+// u8 ごとのコードと二乗誤差 (LSB^2)
+static uint8_t adpt_code1[256];
+static uint8_t adpt_code2[256][2];
+static uint8_t adpt_code3[256][3];
+static double adpt_err2[4][256];
+
+static int adpt_write(DESC *desc, BUFFER *buf);
+static int adpt_close(DESC *desc);
+static int adpt_read(DESC *desc, BUFFER *buf);
+static int adpt_read_close(DESC *desc);
+
+static
+void
+adpt_init_table_once()
+{
+	double lsb = PCM3_TABLE_gain / 255;
+
+	for (int x = 0; x < 256; x++) {
+		double t = x * lsb + PCM3_TABLE_offset;
+		double best;
+
+		best = HUGE_VAL;
+		for (int a = 0; a < 16; a++) {
+			double e = fabs(PSG_VT[a] - t);
+			if (e < best) {
+				best = e;
+				adpt_code1[x] = a;
+			}
+		}
+		adpt_err2[ADPT_PCM1][x] = (best / lsb) * (best / lsb);
+
+		best = HUGE_VAL;
+		for (int a = 0; a < 16; a++) {
+			for (int b = 0; b < 16; b++) {
+				double e = fabs(PSG_VT[a] + PSG_VT[b] - t);
+				if (e < best) {
+					best = e;
+					adpt_code2[x][0] = a;
+					adpt_code2[x][1] = b;
+				}
+			}
+		}
+		adpt_err2[ADPT_PCM2][x] = (best / lsb) * (best / lsb);
+
+		// PCM3 は既存のテーブルそのまま
+		uint32_t c = PCM3_TABLE[x];
+		adpt_code3[x][0] = (c >> 16) & 15;
+		adpt_code3[x][1] = (c >> 8) & 15;
+		adpt_code3[x][2] = c & 15;
+		double v = PSG_VT[adpt_code3[x][0]] + PSG_VT[adpt_code3[x][1]] +
+			PSG_VT[adpt_code3[x][2]];
+		adpt_err2[ADPT_PCM3][x] = ((v - t) / lsb) * ((v - t) / lsb);
+	}
+}
+
+// 複数スレッドから呼ばれても一度だけ作る
+static
+void
+adpt_init_table()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, adpt_init_table_once);
+}
+
+// フォーマット fmt のページに入るサンプル数
+static
+int
+adpt_capacity(int fmt)
+{
+	switch (fmt) {
+	 case ADPT_PCM1:
+		return ADPT_PAYLOAD;
+	 case ADPT_PCM2:
+		return ADPT_PAYLOAD / 2;
+	 default:
+		return ADPT_PAYLOAD / 4;
+	}
+}
+
+// in の先頭 n サンプルを fmt にしたときの RMS 誤差
+static
+double
+adpt_rms(const uint8_t *in, int n, int fmt)
+{
+	double sum = 0;
+	for (int i = 0; i < n; i++) {
+		sum += adpt_err2[fmt][in[i]];
+	}
+	return sqrt(sum / n);
+}
+
+// 溜まったサンプルから 1 ページ作って next に書く
+static
+int
+adpt_page(DESC *desc)
+{
+	struct adpt *a = desc->priv;
+	int fmt;
+	int n;
+
+	for (fmt = ADPT_PCM1; fmt < ADPT_PCM3; fmt++) {
+		n = adpt_capacity(fmt);
+		if (n > a->inlen) {
+			n = a->inlen;
+		}
+		if (adpt_rms(a->in, n, fmt) <= a->threshold) {
+			break;
+		}
+	}
+	n = adpt_capacity(fmt);
+	if (n > a->inlen) {
+		n = a->inlen;
+	}
+
+	uint8_t *d = a->page.ptr;
+	d[0] = fmt;
+	d[1] = 0;
+	le16enc(d + 2, n);
+	d += ADPT_HDRSIZE;
+	for (int i = 0; i < n; i++) {
+		int x = a->in[i];
+		switch (fmt) {
+		 case ADPT_PCM1:
+			*d++ = adpt_code1[x];
+			break;
+		 case ADPT_PCM2:
+			*d++ = adpt_code2[x][0];
+			*d++ = adpt_code2[x][1];
+			break;
+		 default:
+			*d++ = 0;
+			*d++ = adpt_code3[x][0];
+			*d++ = adpt_code3[x][1];
+			*d++ = adpt_code3[x][2];
+			break;
+		}
+	}
+	a->page.length = d - a->page.ptr;
+	if (a->page.length < a->page.bufsize) {
+		// 最後のページは最後のサンプルで埋める
+		filltail(&a->page, fmt == ADPT_PCM3 ? 4 : fmt);
+	}
+	a->npages[fmt]++;
+
+	memmove(a->in, a->in + n, a->inlen - n);
+	a->inlen -= n;
+	return a->next->writer(a->next, &a->page);
+}
+
+/*
+ u8 を受け取り、ADPT のページにして next に書く writer を desc に作ります。
+ next は enc が ENC_ADPT で初期化済みであること。
+ desc の enc は ENC_U8 になります。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+adpt_init(DESC *desc, DESC *next, double threshold)
+{
+	struct adpt *a = calloc(1, sizeof(struct adpt));
+	if (a == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	a->next = next;
+	a->threshold = threshold;
+	a->page.bufsize = XP_BUFSIZE;
+	a->page.ptr = malloc(a->page.bufsize);
+	a->page.isfree = true;
+	if (a->page.ptr == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		free(a);
+		return -1;
+	}
+	rt_prefault(a->page.ptr, a->page.bufsize);
+	rt_prefault(a->in, sizeof(a->in));
+	adpt_init_table();
+
+	*desc = *next;
+	desc->enc = ENC_U8;
+	desc->priv = a;
+	desc->writer = adpt_write;
+	desc->closer = adpt_close;
+	return 0;
+}
+
+static
+int
+adpt_write(DESC *desc, BUFFER *buf)
+{
+	struct adpt *a = desc->priv;
+	size_t n = buf->length;
+
+	for (size_t off = 0; off < buf->length; ) {
+		size_t len = sizeof(a->in) - a->inlen;
+		if (len > buf->length - off) {
+			len = buf->length - off;
+		}
+		memcpy(a->in + a->inlen, buf->ptr + off, len);
+		a->inlen += len;
+		off += len;
+		// PCM1 の 1 ページ分溜まったら、どれかで 1 ページ作れる
+		if (a->inlen == sizeof(a->in) && adpt_page(desc) < 0) {
+			return -1;
+		}
+	}
+	buf->length = 0;
+	return n;
+}
+
+static
+int
+adpt_close(DESC *desc)
+{
+	struct adpt *a = desc->priv;
+	int rv = 0;
+
+	while (a->inlen > 0) {
+		if (adpt_page(desc) < 0) {
+			fprintf(stderr, "write error %s\n", strerror(errno));
+			rv = -1;
+			break;
+		}
+	}
+	if (opt_v) {
+		printf("ADPT pages: PCM1 %jd, PCM2 %jd, PCM3 %jd\n",
+			(intmax_t)a->npages[ADPT_PCM1], (intmax_t)a->npages[ADPT_PCM2],
+			(intmax_t)a->npages[ADPT_PCM3]);
+	}
+	if (a->next->closer(a->next) < 0) {
+		rv = -1;
+	}
+	buffer_free(&a->page);
+	free(a);
+	return rv;
+}
+
+// len バイトの ADPT のページ hdr のフォーマットのサンプル幅と
+// サンプル数を返す
+static
+int
+adpt_pageframes(const uint8_t *hdr, size_t len, int *stride)
+{
+	int fmt = hdr[0];
+	*stride = fmt == ADPT_PCM3 ? 4 : fmt == ADPT_PCM2 ? 2 : 1;
+	int n = (len - ADPT_HDRSIZE) / *stride;
+	int count = le16dec(hdr + 2);
+	if (count > 0 && count < n) {
+		n = count;
+	}
+	return n;
+}
+
+/*
+ ADPT のページの並び buf に入っているサンプル数を返します。
+ */
+int64_t
+adpt_frames(const BUFFER *buf)
+{
+	int64_t n = 0;
+	int stride;
+
+	for (size_t off = 0; off + ADPT_HDRSIZE <= buf->length; off += XP_BUFSIZE) {
+		size_t len = buf->length - off;
+		if (len > XP_BUFSIZE) {
+			len = XP_BUFSIZE;
+		}
+		n += adpt_pageframes(buf->ptr + off, len, &stride);
+	}
+	return n;
+}
+
+/*
+ ADPT のページを u8 に戻します。src はページ単位であること。
+ 最後のページの埋め草は戻しません。
+ */
+void
+conv_adpt_u8(BUFFER *dst, BUFFER *src)
+{
+	double lsb = PCM3_TABLE_gain / 255;
+	uint8_t *d = dst->ptr;
+	int stride;
+
+	for (size_t off = 0; off + ADPT_HDRSIZE <= src->length; off += XP_BUFSIZE) {
+		const uint8_t *s = src->ptr + off;
+		size_t len = src->length - off;
+		if (len > XP_BUFSIZE) {
+			len = XP_BUFSIZE;
+		}
+		int n = adpt_pageframes(s, len, &stride);
+		s += ADPT_HDRSIZE;
+		for (int i = 0; i < n; i++, s += stride) {
+			double v = 0;
+			for (int k = stride == 4 ? 1 : 0; k < stride; k++) {
+				v += PSG_VT[s[k] & 15];
+			}
+			v = (v - PCM3_TABLE_offset) / lsb;
+			if (v < 0) v = 0;
+			if (v > 255) v = 255;
+			*d++ = (uint8_t)v;
+		}
+	}
+	dst->length = d - dst->ptr;
+}
+
+/*
+ ADPT の inner を u8 に戻して読む reader を desc に作ります。
+ ページごとにサンプル数が違うので、-s/-t はこれを通してから数えます。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+adpt_read_init(DESC *desc, DESC *inner)
+{
+	struct adptr *r = calloc(1, sizeof(struct adptr));
+	if (r == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	r->inner = inner;
+	r->page.bufsize = XP_BUFSIZE;
+	r->page.ptr = malloc(r->page.bufsize);
+	r->page.isfree = true;
+	if (r->page.ptr == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		free(r);
+		return -1;
+	}
+
+	*desc = *inner;
+	desc->enc = ENC_U8;
+	desc->framesize = 1;
+	desc->remain = -1;
+	desc->priv = r;
+	desc->splittable = false;
+	desc->reader = adpt_read;
+	desc->closer = adpt_read_close;
+	desc->seeker = NULL;
+	return 0;
+}
+
+static
+int
+adpt_read(DESC *desc, BUFFER *buf)
+{
+	struct adptr *r = desc->priv;
+
+	while (buf->length < buf->bufsize) {
+		if (r->outpos == r->outlen) {
+			// 次のページを読んで戻す
+			r->page.length = 0;
+			while (r->page.length < r->page.bufsize) {
+				size_t before = r->page.length;
+				if (r->inner->reader(r->inner, &r->page) < 0) {
+					return -1;
+				}
+				if (r->page.length == before) {
+					break;
+				}
+			}
+			if (r->page.length == 0) {
+				break;
+			}
+			BUFFER out;
+			memset(&out, 0, sizeof(out));
+			out.ptr = r->out;
+			out.bufsize = sizeof(r->out);
+			conv_adpt_u8(&out, &r->page);
+			r->outlen = out.length;
+			r->outpos = 0;
+			continue;
+		}
+		size_t n = r->outlen - r->outpos;
+		if (n > buf->bufsize - buf->length) {
+			n = buf->bufsize - buf->length;
+		}
+		memcpy(buf->ptr + buf->length, r->out + r->outpos, n);
+		buf->length += n;
+		r->outpos += n;
+	}
+	return buf->length;
+}
+
+static
+int
+adpt_read_close(DESC *desc)
+{
+	struct adptr *r = desc->priv;
+	int rv = r->inner->closer(r->inner);
+	buffer_free(&r->page);
+	free(r);
+	return rv;
+}
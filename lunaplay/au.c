@@ -0,0 +1,460 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* Sun AU format reader writer */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lunaplay.h"
+#include "filehelper.h"
+
+#define AU_HEADERSIZE	24
+#define AU_UNKNOWNSIZE	0xffffffff
+
+#define AU_ENC_ULAW8	1
+#define AU_ENC_LINEAR8	2
+#define AU_ENC_LINEAR16	3
+#define AU_ENC_ALAW8	27
+
+// N ch ダウンミックスの上限
+#define AU_MAXCHANNEL	8
+
+static int au_read_1t8(DESC *desc, BUFFER *buf);
+static int au_read_2t8(DESC *desc, BUFFER *buf);
+static int au_read_Nt8(DESC *desc, BUFFER *buf);
+static int au_read_1s16be(DESC *desc, BUFFER *buf);
+static int au_read_2s16be(DESC *desc, BUFFER *buf);
+static int au_read_Ns16be(DESC *desc, BUFFER *buf);
+
+static int au_write_1s8(DESC *desc, BUFFER *buf);
+
+static int au_read_close(DESC *desc);
+static int au_write_close(DESC *desc);
+
+/* ***** table ***** */
+
+/*
+ * 8bit のエンコーディングは全て 256 エントリのテーブルで
+ * 直接 u8 に変換する。
+ */
+static uint8_t au_ulaw_u8[256];
+static uint8_t au_alaw_u8[256];
+static uint8_t au_s8_u8[256];
+
+// G.711 u-law -> s16
+static
+int
+ulaw_s16(uint8_t u)
+{
+	u = ~u;
+	int exponent = (u >> 4) & 7;
+	int mantissa = u & 0x0f;
+	int v = (((mantissa << 3) + 0x84) << exponent) - 0x84;
+	return (u & 0x80) ? -v : v;
+}
+
+// G.711 A-law -> s16
+static
+int
+alaw_s16(uint8_t a)
+{
+	a ^= 0x55;
+	int seg = (a >> 4) & 7;
+	int v = (a & 0x0f) << 4;
+	if (seg == 0) {
+		v += 8;
+	} else {
+		v = (v + 0x108) << (seg - 1);
+	}
+	return (a & 0x80) ? v : -v;
+}
+
+static
+uint8_t
+s16_u8(int v)
+{
+	v = (v + 0x8080) >> 8;
+	if (v < 0) v = 0;
+	if (v > 255) v = 255;
+	return v;
+}
+
+static
+void
+au_init_table_once()
+{
+	for (int i = 0; i < 256; i++) {
+		au_ulaw_u8[i] = s16_u8(ulaw_s16(i));
+		au_alaw_u8[i] = s16_u8(alaw_s16(i));
+		au_s8_u8[i] = i ^ 0x80;
+	}
+}
+
+// 複数スレッドから呼ばれても一度だけ作る
+static
+void
+au_init_table()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, au_init_table_once);
+}
+
+/* ***** initializer ***** */
+
+int
+au_read_init(DESC *desc, int fd)
+{
+	int r;
+
+	uint32_t tag = 0;
+	uint32_t offset;
+	uint32_t datasize;
+	uint32_t auenc;
+	uint32_t freq;
+	uint32_t channelcount;
+
+	r =
+	readtag(fd, &tag) &&
+	cmptag(tag, ".snd") &&
+	read32be(fd, &offset) &&
+	read32be(fd, &datasize) &&
+	read32be(fd, &auenc) &&
+	read32be(fd, &freq) &&
+	read32be(fd, &channelcount)
+	;
+	if (!r) {
+		fprintf(stderr, "AU header read error\n");
+		return -1;
+	}
+
+	if (opt_v) {
+		fprintf(stderr, "offset : %u\n", offset);
+		fprintf(stderr, "size   : %u\n", datasize);
+		fprintf(stderr, "enc    : %u\n", auenc);
+		fprintf(stderr, "channel: %u\n", channelcount);
+		fprintf(stderr, "freq   : %u\n", freq);
+	}
+
+	if (offset < AU_HEADERSIZE) {
+		fprintf(stderr, "AU offset error\n");
+		return -1;
+	}
+	// annotation
+	if (!readskip(fd, offset - AU_HEADERSIZE)) {
+		fprintf(stderr, "AU annotation skip error\n");
+		return -1;
+	}
+
+	READER readers[] = {
+		au_read_1t8,    au_read_2t8,    au_read_Nt8,
+		au_read_1s16be, au_read_2s16be, au_read_Ns16be,
+	};
+	const char *readers_name[] = {
+		"1t8",    "2t8",    "Nt8",
+		"1s16be", "2s16be", "Ns16be",
+	};
+
+	int rdid = 0;
+	if (channelcount == 1) {
+	} else if (channelcount == 2) {
+		rdid += 1;
+	} else if (channelcount > 2 && channelcount <= AU_MAXCHANNEL) {
+		rdid += 2;
+	} else {
+		fprintf(stderr, "AU unsupported channel count %u\n", channelcount);
+		return -1;
+	}
+
+	au_init_table();
+	desc->samplesize = 1;
+	switch (auenc) {
+	 case AU_ENC_ULAW8:
+		desc->priv = au_ulaw_u8;
+		break;
+	 case AU_ENC_ALAW8:
+		desc->priv = au_alaw_u8;
+		break;
+	 case AU_ENC_LINEAR8:
+		desc->priv = au_s8_u8;
+		break;
+	 case AU_ENC_LINEAR16:
+		desc->samplesize = 2;
+		rdid += 3;
+		break;
+	 default:
+		fprintf(stderr, "AU encoding %u is not supported\n", auenc);
+		return -1;
+	}
+	desc->reader = readers[rdid];
+
+	if (opt_v) {
+		fprintf(stderr, "AU format: %s\n", readers_name[rdid]);
+	}
+
+	desc->channels = channelcount;
+	desc->framesize = desc->samplesize * channelcount;
+	desc->mixmul = (65536 + channelcount - 1) / channelcount;
+	desc->tmp = malloc(XP_BUFSIZE * desc->framesize);
+	if (desc->tmp == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	desc->remain = (datasize == AU_UNKNOWNSIZE) ? -1 : datasize;
+	desc->splittable = true;
+	desc->seeker = desc_seekframes;
+
+	desc->closer = au_read_close;
+
+	// reader が u8 に変換する
+	desc->enc = ENC_U8;
+	desc->fd = fd;
+	desc->freq = freq;
+	return 0;
+}
+
+int
+au_write_init(DESC *desc, int fd)
+{
+	/*
+	 * AU はデータ長不明を許すので、とりあえず不明で書いておき、
+	 * シーク可能ならクローズ時に埋める。
+	 */
+	int r =
+	writetag(fd, ".snd") &&
+	write32be(fd, AU_HEADERSIZE) &&
+	write32be(fd, AU_UNKNOWNSIZE) &&
+	write32be(fd, AU_ENC_LINEAR8) &&
+	write32be(fd, desc->freq) &&
+	write32be(fd, 1)
+	;
+	if (!r) {
+		fprintf(stderr, "write: %s\n", strerror(errno));
+		return -1;
+	}
+
+	desc->tmp = malloc(XP_BUFSIZE);
+	if (desc->tmp == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+
+	desc->writer = au_write_1s8;
+	desc->closer = au_write_close;
+
+	desc->fd = fd;
+	// 書き込み側では書いたバイト数を数える
+	desc->remain = 0;
+	return 0;
+}
+
+/* ***** reader ***** */
+
+static
+int
+au_read_1t8(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	const uint8_t *table = desc->priv;
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		*d++ = table[*s++];
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+au_read_2t8(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	const uint8_t *table = desc->priv;
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint16_t a, b;
+		a = table[*s++];
+		b = table[*s++];
+		*d++ = (a + b) >> 1;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+au_read_Nt8(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	const uint8_t *table = desc->priv;
+	int ch = desc->channels;
+	uint32_t mixmul = desc->mixmul;
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint32_t sum = 0;
+		for (int c = 0; c < ch; c++) {
+			sum += table[*s++];
+		}
+		*d++ = (sum * mixmul) >> 16;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+au_read_1s16be(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		*d++ = (*s) ^ 0x80;
+		s += 2;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+au_read_2s16be(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint16_t a, b;
+		a = (*s) ^ 0x80;
+		s += 2;
+		b = (*s) ^ 0x80;
+		s += 2;
+		*d++ = (a + b) >> 1;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+au_read_Ns16be(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	int ch = desc->channels;
+	uint32_t mixmul = desc->mixmul;
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint32_t sum = 0;
+		for (int c = 0; c < ch; c++) {
+			sum += (*s) ^ 0x80;
+			s += 2;
+		}
+		*d++ = (sum * mixmul) >> 16;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+/* ***** writer ***** */
+/* support only 1u8 (as linear8) */
+
+static
+int
+au_write_1s8(DESC *desc, BUFFER *buf)
+{
+	uint8_t *s = buf->ptr;
+	size_t total = buf->length;
+
+	while (total > 0) {
+		size_t len = total < XP_BUFSIZE ? total : XP_BUFSIZE;
+		uint8_t *d = desc->tmp;
+		for (int i = 0; i < len; i++) {
+			*d++ = (*s++) ^ 0x80;
+		}
+		ssize_t n = writebuf(desc->fd, desc->tmp, len);
+		if (n < 0) {
+			return n;
+		}
+		desc->remain += n;
+		total -= len;
+	}
+	int rv = buf->length;
+	buf->length = 0;
+	return rv;
+}
+
+/* ***** closer ***** */
+
+static
+int
+au_read_close(DESC *desc)
+{
+	free(desc->tmp);
+	close(desc->fd);
+	return 0;
+}
+
+static
+int
+au_write_close(DESC *desc)
+{
+	int rv = 0;
+
+	// パイプならデータ長は不明のまま
+	if (desc->remain < AU_UNKNOWNSIZE && lseek(desc->fd, 8, SEEK_SET) == 8) {
+		if (!write32be(desc->fd, desc->remain)) {
+			fprintf(stderr, "write: %s\n", strerror(errno));
+			rv = -1;
+		}
+	}
+	free(desc->tmp);
+	close(desc->fd);
+	return rv;
+}
@@ -0,0 +1,555 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* batch conversion on a work-stealing thread pool */
+
+/*
+ * 入力はリストファイル (1 行に "入力 [出力]") かディレクトリ。
+ * ジョブは入力の大きい順に各ワーカーの両端キューへ配り、
+ * ワーカーは自分のキューの先頭 (大きいもの) から取り、
+ * 空になったら他のワーカーのキューの末尾 (小さいもの) から盗む。
+ * ジョブは実行中に増えないので、全キューが空になれば終わり。
+ *
+ * PSG テーブルは静的な読み出し専用データなので共有する。
+ * 失敗したファイルは記録して、バッチは続ける。
+ * 出力が入力そのものになるものと、前のものと出力が重なるものは
+ * 変換せずに失敗にする (出力は O_TRUNC で開くので入力や他の出力を壊す)。
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lunaplay.h"
+
+struct item {
+	JOB job;
+	char *in_path;
+	char *out_path;
+	char *out_real;		// 重なりを調べる出力の絶対パス
+	off_t size;			// スケジューリング用の入力サイズ
+	bool skip;			// 変換しないで失敗にする
+	int rv;
+	double sec;
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	int *idx;			// items[] の添字
+	int head;
+	int tail;
+};
+
+struct batch {
+	struct item *items;
+	int nitems;
+	struct deque *dq;
+	int nthreads;
+};
+
+struct worker {
+	struct batch *b;
+	int id;
+	int steals;
+};
+
+static
+double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ***** job list ***** */
+
+// 出力 path の絶対パスを作る。まだ無ければディレクトリだけ解決する
+static
+char *
+out_realpath(const char *path)
+{
+	char buf[PATH_MAX];
+
+	if (realpath(path, buf) != NULL) {
+		return strdup(buf);
+	}
+	const char *base = strrchr(path, '/');
+	if (base == NULL) {
+		if (realpath(".", buf) == NULL) {
+			return NULL;
+		}
+		base = path;
+	} else {
+		char dir[PATH_MAX];
+		int n = snprintf(dir, sizeof(dir), "%.*s",
+			(int)(base - path), path);
+		if (n < 0 || n >= sizeof(dir) ||
+		    realpath(n > 0 ? dir : "/", buf) == NULL) {
+			return NULL;
+		}
+		base++;
+	}
+	size_t len = strlen(buf) + strlen(base) + 2;
+	char *p = malloc(len);
+	if (p != NULL) {
+		snprintf(p, len, "%s/%s", strcmp(buf, "/") == 0 ? "" : buf, base);
+	}
+	return p;
+}
+
+static
+int
+add_item(struct batch *b, int *cap, const char *in, const char *out)
+{
+	if (b->nitems == *cap) {
+		int n = *cap ? *cap * 2 : 64;
+		struct item *p = realloc(b->items, n * sizeof(struct item));
+		if (p == NULL) {
+			return -1;
+		}
+		b->items = p;
+		*cap = n;
+	}
+	struct item *it = &b->items[b->nitems];
+	memset(it, 0, sizeof(*it));
+	it->in_path = strdup(in);
+	it->out_path = strdup(out);
+	if (it->in_path == NULL || it->out_path == NULL) {
+		free(it->in_path);
+		free(it->out_path);
+		return -1;
+	}
+	struct stat st;
+	struct stat ost;
+	if (stat(in, &st) == 0) {
+		it->size = st.st_size;
+		if (stat(out, &ost) == 0 &&
+		    st.st_dev == ost.st_dev && st.st_ino == ost.st_ino) {
+			fprintf(stderr, "%s: output is the input file\n", in);
+			it->skip = true;
+		}
+	}
+	// 出力のディレクトリが無いなどで解決できなければ名前のまま比べる
+	it->out_real = out_realpath(out);
+	if (it->out_real == NULL) {
+		it->out_real = strdup(out);
+		if (it->out_real == NULL) {
+			free(it->in_path);
+			free(it->out_path);
+			return -1;
+		}
+	}
+	b->nitems++;
+	return 0;
+}
+
+// 出力の名前順。同じなら元の順。
+static
+int
+cmp_outpath(const void *a, const void *b)
+{
+	const struct item *ia = *(const struct item * const *)a;
+	const struct item *ib = *(const struct item * const *)b;
+	int r = strcmp(ia->out_real, ib->out_real);
+	if (r != 0) {
+		return r;
+	}
+	return ia < ib ? -1 : ia > ib;
+}
+
+// 出力が前のものと同じになるものを失敗にする
+static
+int
+check_outpaths(struct batch *b)
+{
+	struct item **sorted = malloc(b->nitems * sizeof(struct item *));
+	if (sorted == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < b->nitems; i++) {
+		sorted[i] = &b->items[i];
+	}
+	qsort(sorted, b->nitems, sizeof(struct item *), cmp_outpath);
+	struct item *first = NULL;
+	for (int i = 0; i < b->nitems; i++) {
+		struct item *it = sorted[i];
+		if (first == NULL || strcmp(first->out_real, it->out_real) != 0) {
+			first = it;
+		} else {
+			fprintf(stderr, "%s: output %s is also the output of %s\n",
+				it->in_path, it->out_path, first->in_path);
+			it->skip = true;
+		}
+	}
+	free(sorted);
+	return 0;
+}
+
+// 入力ファイル名から出力ファイル名を作る
+static
+int
+make_outpath(char *dst, size_t len, const char *in, const char *outdir,
+	int out_format)
+{
+	const char *base = in;
+	if (outdir != NULL) {
+		const char *p = strrchr(in, '/');
+		if (p != NULL) {
+			base = p + 1;
+		}
+	}
+	const char *ext = strrchr(base, '.');
+	int baselen = ext != NULL && ext != base && strchr(ext, '/') == NULL
+		? ext - base : strlen(base);
+	int n = snprintf(dst, len, "%s%s%.*s%s",
+		outdir != NULL ? outdir : "",
+		outdir != NULL ? "/" : "",
+		baselen, base, format_toext(out_format));
+	if (n < 0 || n >= len) {
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+read_list(struct batch *b, const char *list, const char *outdir,
+	int out_format)
+{
+	int cap = 0;
+	FILE *fp = fopen(list, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "open: %s: %s\n", list, strerror(errno));
+		return -1;
+	}
+
+	char line[PATH_MAX * 2 + 16];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char outbuf[PATH_MAX];
+		char *last;
+		lineno++;
+		char *in = strtok_r(line, " \t\r\n", &last);
+		if (in == NULL || in[0] == '#') {
+			continue;
+		}
+		char *out = strtok_r(NULL, " \t\r\n", &last);
+		if (out == NULL) {
+			if (make_outpath(outbuf, sizeof(outbuf), in, outdir,
+			        out_format) < 0) {
+				fprintf(stderr, "%s:%d: path too long\n", list, lineno);
+				continue;
+			}
+			out = outbuf;
+		}
+		if (add_item(b, &cap, in, out) < 0) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static
+int
+cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static
+int
+read_dir(struct batch *b, const char *dir, const char *outdir,
+	int out_format)
+{
+	int cap = 0;
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		fprintf(stderr, "opendir: %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	// 出力順を安定させるため名前順にする
+	char **names = NULL;
+	int nnames = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		int fmt = format_fromext(de->d_name);
+		if (de->d_name[0] == '.' || fmt == FMT_UNKNOWN || fmt == out_format) {
+			continue;
+		}
+		char **p = realloc(names, (nnames + 1) * sizeof(char *));
+		if (p == NULL || (p[nnames] = strdup(de->d_name)) == NULL) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			closedir(dp);
+			return -1;
+		}
+		names = p;
+		nnames++;
+	}
+	closedir(dp);
+	qsort(names, nnames, sizeof(char *), cmp_name);
+
+	int rv = 0;
+	for (int i = 0; i < nnames; i++) {
+		char in[PATH_MAX];
+		char out[PATH_MAX];
+		snprintf(in, sizeof(in), "%s/%s", dir, names[i]);
+		if (make_outpath(out, sizeof(out), in,
+		        outdir != NULL ? outdir : dir, out_format) < 0) {
+			fprintf(stderr, "%s: path too long\n", in);
+		} else if (add_item(b, &cap, in, out) < 0) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			rv = -1;
+			break;
+		}
+	}
+	for (int i = 0; i < nnames; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return rv;
+}
+
+/* ***** work-stealing ***** */
+
+static
+int
+take(struct deque *q, bool steal)
+{
+	int i = -1;
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		if (steal) {
+			i = q->idx[--q->tail];
+		} else {
+			i = q->idx[q->head++];
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+	return i;
+}
+
+static
+void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct batch *b = w->b;
+
+	for (;;) {
+		int i = take(&b->dq[w->id], false);
+		for (int k = 1; i < 0 && k < b->nthreads; k++) {
+			i = take(&b->dq[(w->id + k) % b->nthreads], true);
+			if (i >= 0) {
+				w->steals++;
+			}
+		}
+		if (i < 0) {
+			break;
+		}
+
+		struct item *it = &b->items[i];
+		double t0 = now();
+		it->rv = convert_file(&it->job);
+		it->sec = now() - t0;
+		if (opt_v) {
+			printf("%s %s -> %s (%.2f sec)\n", it->rv == 0 ? "ok  " : "FAIL",
+				it->in_path, it->out_path, it->sec);
+		}
+	}
+	return NULL;
+}
+
+struct order {
+	off_t size;
+	int idx;
+};
+
+// 大きい順。同じなら元の順。
+static
+int
+cmp_size(const void *a, const void *b)
+{
+	const struct order *oa = a;
+	const struct order *ob = b;
+	if (oa->size != ob->size) {
+		return oa->size < ob->size ? 1 : -1;
+	}
+	return oa->idx - ob->idx;
+}
+
+/* ***** public ***** */
+
+/*
+ list (リストファイルかディレクトリ) のファイルをすべて変換します。
+ 各ジョブは proto の指定を元に、入出力ファイル名を差し替えて実行します。
+ すべて成功すれば 0、1 つでも失敗すれば -1 を返します。
+ */
+int
+batch_run(const char *list, const char *outdir, const JOB *proto,
+	int nthreads)
+{
+	struct batch b0, *b = &b0;
+	struct stat st;
+	int rv = -1;
+
+	memset(b, 0, sizeof(*b));
+	int out_format = proto->out_format;
+	if (out_format == FMT_UNKNOWN) {
+		out_format = FMT_PSGPCM;
+	}
+
+	if (stat(list, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", list, strerror(errno));
+		return -1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		rv = read_dir(b, list, outdir, out_format);
+	} else {
+		rv = read_list(b, list, outdir, out_format);
+	}
+	if (rv < 0) {
+		goto done;
+	}
+	if (b->nitems == 0) {
+		fprintf(stderr, "%s: no input files\n", list);
+		rv = -1;
+		goto done;
+	}
+	if (check_outpaths(b) < 0) {
+		rv = -1;
+		goto done;
+	}
+
+	for (int i = 0; i < b->nitems; i++) {
+		struct item *it = &b->items[i];
+		it->job = *proto;
+		it->job.in_file = it->in_path;
+		it->job.out_file = it->out_path;
+		it->rv = -1;
+	}
+
+	// 変換するものだけ配る
+	int nrun = 0;
+	for (int i = 0; i < b->nitems; i++) {
+		if (!b->items[i].skip) {
+			nrun++;
+		}
+	}
+	if (nthreads > nrun) {
+		nthreads = nrun > 0 ? nrun : 1;
+	}
+	b->nthreads = nthreads;
+
+	// 大きい順に配る
+	struct order *order = malloc(b->nitems * sizeof(struct order));
+	b->dq = calloc(nthreads, sizeof(struct deque));
+	struct worker *w = calloc(nthreads, sizeof(struct worker));
+	pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+	if (order == NULL || b->dq == NULL || w == NULL || th == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		rv = -1;
+		goto done_pool;
+	}
+	for (int i = 0; i < b->nitems; i++) {
+		order[i].size = b->items[i].size;
+		order[i].idx = i;
+	}
+	qsort(order, b->nitems, sizeof(struct order), cmp_size);
+	for (int t = 0; t < nthreads; t++) {
+		pthread_mutex_init(&b->dq[t].lock, NULL);
+		b->dq[t].idx = malloc(b->nitems * sizeof(int));
+		if (b->dq[t].idx == NULL) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			rv = -1;
+			goto done_pool;
+		}
+	}
+	for (int i = 0, k = 0; i < b->nitems; i++) {
+		if (b->items[order[i].idx].skip) {
+			continue;
+		}
+		struct deque *q = &b->dq[k++ % nthreads];
+		q->idx[q->tail++] = order[i].idx;
+	}
+
+	double t0 = now();
+	int nstarted = 0;
+	for (int t = 0; t < nthreads; t++) {
+		w[t].b = b;
+		w[t].id = t;
+		if (pthread_create(&th[t], NULL, worker_main, &w[t]) != 0) {
+			// 起動できた分だけで続ける (残りは盗まれる)
+			fprintf(stderr, "pthread_create failed\n");
+			break;
+		}
+		nstarted++;
+	}
+	if (nstarted == 0) {
+		// このスレッドで全部やる
+		w[0].b = b;
+		w[0].id = 0;
+		worker_main(&w[0]);
+	}
+	int steals = 0;
+	for (int t = 0; t < nstarted; t++) {
+		pthread_join(th[t], NULL);
+		steals += w[t].steals;
+	}
+	double sec = now() - t0;
+
+	// 集計
+	int nfail = 0;
+	off_t bytes = 0;
+	for (int i = 0; i < b->nitems; i++) {
+		struct item *it = &b->items[i];
+		if (it->rv < 0) {
+			nfail++;
+		} else {
+			bytes += it->job.inbytes;
+		}
+	}
+	for (int i = 0; i < b->nitems; i++) {
+		struct item *it = &b->items[i];
+		if (it->rv < 0) {
+			fprintf(stderr, "failed: %s -> %s\n", it->in_path, it->out_path);
+		}
+	}
+	printf("%d files, %d ok, %d failed, %d threads, %d steals\n",
+		b->nitems, b->nitems - nfail, nfail, nthreads, steals);
+	printf("%.1f MB in %.2f sec, %.1f MB/s, %.1f files/s\n",
+		bytes / 1e6, sec, sec > 0 ? bytes / sec / 1e6 : 0.0,
+		sec > 0 ? b->nitems / sec : 0.0);
+	rv = nfail == 0 ? 0 : -1;
+
+ done_pool:
+	if (b->dq != NULL) {
+		for (int t = 0; t < nthreads; t++) {
+			pthread_mutex_destroy(&b->dq[t].lock);
+			free(b->dq[t].idx);
+		}
+	}
+	free(b->dq);
+	free(order);
+	free(w);
+	free(th);
+ done:
+	for (int i = 0; i < b->nitems; i++) {
+		free(b->items[i].in_path);
+		free(b->items[i].out_path);
+		free(b->items[i].out_real);
+	}
+	free(b->items);
+	return rv;
+}
@@ -0,0 +1,66 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* BUFFER helper */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lunaplay.h"
+
+void
+buffer_free(BUFFER *buf)
+{
+	if (buf->isfree) {
+		free(buf->ptr);
+	}
+}
+
+static
+void
+memset8(void *buf, uint8_t val, int len)
+{
+	memset(buf, val, len);
+}
+
+static
+void
+memset16(void *buf, uint16_t val, int len)
+{
+	uint16_t *p = (uint16_t *)buf;
+	for (int i = 0; i < len; i += 2) {
+		*p++ = val;
+	}
+}
+
+static
+void
+memset32(void *buf, uint32_t val, int len)
+{
+	uint32_t *p = (uint32_t *)buf;
+	for (int i = 0; i < len; i += 4) {
+		*p++ = val;
+	}
+}
+
+// バッファの残りを最後のサンプルで埋める。
+void
+filltail(BUFFER *buf, int stride)
+{
+	uint8_t *p = buf->ptr + buf->length;
+	int len = buf->bufsize - buf->length;
+	if (buf->length < stride) {
+		// 最後のサンプルが無い
+		memset8(buf->ptr, 0, buf->bufsize);
+	} else if (stride == 1) {
+		memset8(p, *(p - 1), len);
+	} else if (stride == 2) {
+		memset16(p, *(uint16_t *)(p - 2), len);
+	} else if (stride == 4) {
+		memset32(p, *(uint32_t *)(p - 4), len);
+	} else {
+		errx(EXIT_FAILURE, "invalid stride");
+	}
+	buf->length = buf->bufsize;
+}
@@ -0,0 +1,322 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* on-disk cache of converted PSGPCM */
+
+/*
+ * キーは入力ファイルの内容と変換パラメータ (エンコーディング、周波数、
+ * 変換テーブルとその gain/offset) の FNV-1a 64bit ハッシュ。
+ * キャッシュファイルは <dir>/<key>.psgpcm の普通の PSGPCM ファイル
+ * (ページ境界に並べた形式)。
+ *
+ * ミスしたときは、変換結果を XP に書きながら同じディレクトリの
+ * テンポラリファイルにも書き (tee)、最後まで成功したら rename する。
+ * rename はアトミックなので、同時に動く他のプレイヤーからは
+ * 完全なファイルか、ファイルが無いかのどちらかにしか見えない。
+ * 同じキーを同時に作っても中身は同じなので、どちらが残っても良い。
+ *
+ * ヒットしたら mtime を更新する。容量を越えたら mtime の古い順に消す (LRU)。
+ * 再生中のファイルが消されても、開いている fd はそのまま読める。
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+#include "filehelper.h"
+
+// キーの作り方を変えたら上げる
+#define CACHE_VERSION	1
+#define CACHE_EXT		".psgpcm"
+#define CACHE_TMPPREFIX	".tmp."
+// これより古いテンポラリは異常終了の残骸とみなして消す
+#define CACHE_TMPEXPIRE	(60 * 60)
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+struct tee {
+	DESC *next;			// 本来の出力
+	DESC cache;			// キャッシュのテンポラリファイル (PSGPCM)
+	bool error;
+	char tmppath[PATH_MAX];
+	char path[PATH_MAX];
+	const char *dir;
+	off_t maxsize;
+};
+
+static int cache_tee_write(DESC *desc, BUFFER *buf);
+static int cache_tee_close(DESC *desc);
+
+static
+uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+/*
+ fd の内容全体と変換パラメータからキーを作り、path にキャッシュファイル名を
+ 入れます。fd は先頭に戻します。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+cache_path(const char *dir, int fd, int enc, int freq, char *path, size_t len)
+{
+	const void *table;
+	size_t tablesize;
+	double gain;
+	double offset;
+
+	if (conv_params(enc, &table, &tablesize, &gain, &offset) < 0) {
+		return -1;
+	}
+
+	uint64_t h = FNV_OFFSET;
+	int32_t param[3] = { CACHE_VERSION, enc, freq };
+	h = fnv1a(h, param, sizeof(param));
+	h = fnv1a(h, &gain, sizeof(gain));
+	h = fnv1a(h, &offset, sizeof(offset));
+	h = fnv1a(h, table, tablesize);
+
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		return -1;
+	}
+	for (;;) {
+		uint8_t buf[65536];
+		ssize_t n = readbuf(fd, buf, sizeof(buf));
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		h = fnv1a(h, buf, n);
+	}
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		return -1;
+	}
+
+	int n = snprintf(path, len, "%s/%016llx" CACHE_EXT,
+		dir, (unsigned long long)h);
+	if (n < 0 || n >= len) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ path のキャッシュを開きます。ヒットすれば fd を、無ければ -1 を返します。
+ */
+int
+cache_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	// LRU のために使った時刻にする
+	utimes(path, NULL);
+	return fd;
+}
+
+struct entry {
+	char name[NAME_MAX + 1];
+	off_t size;
+	time_t mtime;
+};
+
+static
+int
+cmp_mtime(const void *a, const void *b)
+{
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+	if (ea->mtime != eb->mtime) {
+		return ea->mtime < eb->mtime ? -1 : 1;
+	}
+	return strcmp(ea->name, eb->name);
+}
+
+/*
+ dir のキャッシュを maxsize バイト以下になるまで古い順に消します。
+ */
+void
+cache_evict(const char *dir, off_t maxsize)
+{
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		return;
+	}
+
+	struct entry *ent = NULL;
+	int nent = 0;
+	int cap = 0;
+	off_t total = 0;
+	time_t now = time(NULL);
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		char path[PATH_MAX];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+
+		if (strncmp(de->d_name, CACHE_TMPPREFIX, strlen(CACHE_TMPPREFIX)) == 0) {
+			if (stat(path, &st) == 0 && now - st.st_mtime > CACHE_TMPEXPIRE) {
+				unlink(path);
+			}
+			continue;
+		}
+		size_t len = strlen(de->d_name);
+		if (len <= strlen(CACHE_EXT) ||
+		    strcmp(de->d_name + len - strlen(CACHE_EXT), CACHE_EXT) != 0) {
+			continue;
+		}
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		if (nent == cap) {
+			cap = cap ? cap * 2 : 64;
+			struct entry *p = realloc(ent, cap * sizeof(struct entry));
+			if (p == NULL) {
+				break;
+			}
+			ent = p;
+		}
+		strlcpy(ent[nent].name, de->d_name, sizeof(ent[nent].name));
+		ent[nent].size = st.st_size;
+		ent[nent].mtime = st.st_mtime;
+		total += st.st_size;
+		nent++;
+	}
+	closedir(dp);
+
+	if (total > maxsize) {
+		qsort(ent, nent, sizeof(struct entry), cmp_mtime);
+		for (int i = 0; i < nent && total > maxsize; i++) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", dir, ent[i].name);
+			if (unlink(path) == 0 || errno == ENOENT) {
+				if (opt_v) {
+					printf("cache evict %s\n", ent[i].name);
+				}
+				total -= ent[i].size;
+			}
+		}
+	}
+	free(ent);
+}
+
+/*
+ next への出力を path のキャッシュにも書く tee を desc に作ります。
+ next は enc, freq が決まっていること。
+ キャッシュは最善努力なので、失敗したら -1 を返し、呼び出し側は
+ next をそのまま使えば良いです。
+ */
+int
+cache_tee_init(DESC *desc, DESC *next, const char *dir, const char *path,
+	off_t maxsize)
+{
+	struct tee *t = calloc(1, sizeof(struct tee));
+	if (t == NULL) {
+		return -1;
+	}
+	t->next = next;
+	t->dir = dir;
+	t->maxsize = maxsize;
+	strlcpy(t->path, path, sizeof(t->path));
+	snprintf(t->tmppath, sizeof(t->tmppath), "%s/" CACHE_TMPPREFIX "XXXXXX",
+		dir);
+	int fd = mkstemp(t->tmppath);
+	if (fd == -1) {
+		fprintf(stderr, "cache: %s: %s\n", dir, strerror(errno));
+		free(t);
+		return -1;
+	}
+	// 他のユーザのプレイヤーからも読めるように
+	fchmod(fd, 0644);
+
+	// 中身は PSGPCM の書き込みと同じ
+	// ヒットしたときに mmap してそのまま XP に送れるように
+	t->cache.enc = next->enc;
+	t->cache.freq = next->freq;
+	t->cache.opts = PSGPCM_OPT_ALIGN;
+	if (psgpcm_write_init(&t->cache, fd) < 0) {
+		unlink(t->tmppath);
+		close(fd);
+		free(t);
+		return -1;
+	}
+
+	*desc = *next;
+	desc->priv = t;
+	desc->writer = cache_tee_write;
+	desc->closer = cache_tee_close;
+	return 0;
+}
+
+/*
+ tee の出力を途中で止めたとき (変換エラー) に呼びます。
+ キャッシュには登録しません。
+ */
+void
+cache_tee_abort(DESC *desc)
+{
+	struct tee *t = desc->priv;
+	t->error = true;
+}
+
+static
+int
+cache_tee_write(DESC *desc, BUFFER *buf)
+{
+	struct tee *t = desc->priv;
+
+	// writer は buf->length を 0 にするので戻してから次に渡す
+	size_t length = buf->length;
+	if (!t->error && t->cache.writer(&t->cache, buf) < 0) {
+		fprintf(stderr, "cache: write: %s\n", strerror(errno));
+		t->error = true;
+	}
+	buf->length = length;
+	return t->next->writer(t->next, buf);
+}
+
+static
+int
+cache_tee_close(DESC *desc)
+{
+	struct tee *t = desc->priv;
+	int rv = t->next->closer(t->next);
+
+	// 索引とサンプル数もここで書かれる
+	if (t->cache.closer(&t->cache) < 0) {
+		t->error = true;
+	}
+	if (t->error || rv < 0) {
+		unlink(t->tmppath);
+	} else if (rename(t->tmppath, t->path) < 0) {
+		fprintf(stderr, "cache: rename: %s\n", strerror(errno));
+		unlink(t->tmppath);
+	} else {
+		if (opt_v) {
+			printf("cache insert %s\n", t->path);
+		}
+		cache_evict(t->dir, t->maxsize);
+	}
+	free(t);
+	return rv;
+}
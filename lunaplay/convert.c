@@ -0,0 +1,453 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* convert one file (reader -> converter -> writer) */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+
+static
+CONVERTER
+get_conv_u8_to(int enc)
+{
+	switch (enc) {
+	 case ENC_U8:
+		return conv_pass;
+	 case ENC_PCM1:
+		return conv_u8_pcm1;
+	 case ENC_PCM2:
+		return conv_u8_pcm2;
+	 case ENC_PCM3:
+		return conv_u8_pcm3;
+	 case ENC_PAM2:
+		return conv_u8_pam2;
+	 case ENC_PAM3:
+		return conv_u8_pam3;
+	 default:
+		errx(EXIT_FAILURE, "unknown encoding");
+	}
+}
+
+static
+CONVERTER
+get_conv_from_u8(int enc)
+{
+	switch (enc) {
+	 case ENC_U8:
+		return conv_pass;
+	 case ENC_PCM1:
+		return conv_pcm1_u8;
+	 case ENC_PCM2:
+		return conv_pcm2_u8;
+	 case ENC_PCM3:
+		return conv_pcm3_u8;
+	 case ENC_PAM2:
+		return conv_pam2_u8;
+	 case ENC_PAM3:
+		return conv_pam3_u8;
+	 case ENC_ADPT:
+		return conv_adpt_u8;
+	 default:
+		errx(EXIT_FAILURE, "unknown encoding");
+	}
+}
+
+/*
+ job の指定で 1 ファイルを変換します。
+ エラーは stderr に表示し、-1 を返します (exit はしません)。
+ 成功すれば 0 を返します。
+ */
+int
+convert_file(JOB *job)
+{
+	const char *in_file = job->in_file;
+	const char *out_file = job->out_file;
+	int in_format = job->in_format;
+	int out_format = job->out_format;
+	int out_enc = job->out_enc;
+	int in_fd = -1;
+	int out_fd = -1;
+	int rv = -1;
+
+	DESC in0, *in = &in0;
+	DESC out0, *out = &out0;
+	DESC tee0;
+	DESC range0;
+	DESC adpt0;
+	DESC adptr0;
+	DESC bench0;
+	DESC benchw0;
+	bool tee = false;
+	BUFFER src0, *src = &src0;
+	BUFFER dst0, *dst = &dst0;
+	CONVERTER conv = NULL;
+
+	memset(in, 0, sizeof(DESC));
+	memset(out, 0, sizeof(DESC));
+	memset(src, 0, sizeof(BUFFER));
+	memset(dst, 0, sizeof(BUFFER));
+	job->inbytes = 0;
+
+	// XP デバイス宛? (null sink も XP デバイスと同じに扱う)
+	bool isdevxp = out_file == NULL;
+	bool isnull = job->nullsink != NULLSINK_OFF;
+
+	if (in_format == FMT_UNKNOWN) {
+		in_format = format_fromext(in_file);
+		if (in_format == FMT_UNKNOWN) {
+			fprintf(stderr, "%s: input format undeterminate\n", in_file);
+			return -1;
+		}
+		if (opt_v >= 1) {
+			printf("input format change to %s\n", format_tostr(in_format));
+		}
+	}
+
+	if (isdevxp) {
+		// XP デバイスは PSG 用のエンコーディングだけ。
+		// PSGPCM はそのままのエンコーディングで鳴らす (out->enc = in->enc)
+		if (out_enc == ENC_U8 ||
+		    (out_enc == ENC_UNKNOWN && in_format != FMT_PSGPCM)) {
+			out_enc = ENC_PAM3;
+		}
+	} else if (out_format == FMT_UNKNOWN) {
+		out_format = format_fromext(out_file);
+		if (out_format == FMT_UNKNOWN || out_format == FMT_FLAC) {
+			fprintf(stderr, "%s: output format undeterminate\n", out_file);
+			return -1;
+		}
+		if (opt_v >= 1) {
+			printf("output format change to %s\n", format_tostr(out_format));
+		}
+		if (out_enc == ENC_UNKNOWN) {
+			if (out_format == FMT_WAV) out_enc = ENC_U8;
+			if (out_format == FMT_AU) out_enc = ENC_U8;
+			if (out_format == FMT_PSGPCM) out_enc = ENC_PAM3;
+		}
+	}
+
+	if (strcmp(in_file, "-") == 0) {
+		if (opt_v) printf("opening stdin\n");
+		in_fd = STDIN_FILENO;
+	} else {
+		if (opt_v) printf("opening %s\n", in_file);
+		in_fd = open(in_file, O_RDONLY);
+		if (in_fd == -1) {
+			fprintf(stderr, "open: %s: %s\n", in_file, strerror(errno));
+			return -1;
+		}
+	}
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		job->inbytes = st.st_size;
+	}
+
+	// 変換済みのキャッシュがあればそれを再生する
+	char cachepath[PATH_MAX];
+	bool cache_miss = false;
+	// ループポイントや範囲、ADPT のしきい値、trellis はキーに入らないので、
+	// そのときは使わない
+	if (job->cachedir != NULL && isdevxp && !isnull && S_ISREG(st.st_mode) &&
+	    in_format != FMT_PSGPCM && job->loop == 1 && out_enc != ENC_ADPT &&
+	    job->trellis < 0 &&
+	    job->start == 0 && job->duration < 0) {
+		if (cache_path(job->cachedir, in_fd, out_enc, job->freq,
+		        cachepath, sizeof(cachepath)) < 0) {
+			fprintf(stderr, "cache: %s: %s\n", in_file, strerror(errno));
+		} else {
+			int fd = cache_open(cachepath);
+			if (fd != -1) {
+				if (opt_v) printf("cache hit %s\n", cachepath);
+				close(in_fd);
+				in_fd = fd;
+				in_format = FMT_PSGPCM;
+			} else {
+				if (opt_v) printf("cache miss %s\n", cachepath);
+				cache_miss = true;
+			}
+		}
+	}
+
+	if (opt_v) printf("reading %s\n", format_tostr(in_format));
+	int r;
+	if (in_format == FMT_WAV) {
+		r = wav_read_init(in, in_fd);
+	} else if (in_format == FMT_AU) {
+		r = au_read_init(in, in_fd);
+	} else if (in_format == FMT_FLAC) {
+		r = flac_read_init(in, in_fd);
+	} else {
+		r = psgpcm_read_init(in, in_fd);
+	}
+	if (r < 0) {
+		fprintf(stderr, "%s: %s read init error\n",
+			in_file, format_tostr(in_format));
+		close(in_fd);
+		return -1;
+	}
+
+	// 再生範囲
+	if (in->enc == ENC_ADPT && (job->start > 0 || job->duration >= 0)) {
+		// ページごとにサンプル数が違うので、u8 に戻してから数える
+		if (adpt_read_init(&adptr0, in) < 0) {
+			goto close_in;
+		}
+		in = &adptr0;
+		// 出力の指定が無ければ ADPT に戻す
+		if (out_enc == ENC_UNKNOWN) {
+			out_enc = ENC_ADPT;
+		}
+	}
+	if (job->start > 0) {
+		if (range_seek(in, (int64_t)(job->start * in->freq + 0.5)) < 0) {
+			goto close_in;
+		}
+	}
+	if (job->duration >= 0) {
+		r = range_init(&range0, in,
+			(int64_t)(job->duration * in->freq + 0.5));
+		if (r < 0) {
+			goto close_in;
+		}
+		if (r == 0) {
+			in = &range0;
+		}
+	}
+
+	if (opt_v) {
+		printf("freq=%d, in->freq=%d\n", job->freq, in->freq);
+	}
+	if (job->freq == 0) {
+		if (opt_v) printf("set out->freq = in->freq = %d\n", in->freq);
+		out->freq = in->freq;
+	} else {
+		if (opt_v) printf("set out->freq = freq = %d\n", job->freq);
+		out->freq = job->freq;
+	}
+
+	if (out_enc == ENC_UNKNOWN) {
+		out->enc = in->enc;
+	} else {
+		out->enc = out_enc;
+	}
+
+	// ADPT へは u8 まで変換し、ページにするのは adpt.c の writer
+	int conv_enc = out->enc;
+	if (out->enc == ENC_ADPT && in->enc != ENC_ADPT) {
+		conv_enc = ENC_U8;
+	}
+
+	dst->bufsize = XP_BUFSIZE;
+	dst->ptr = malloc(dst->bufsize);
+	dst->isfree = true;
+	if (in->enc == conv_enc) {
+		src->bufsize = dst->bufsize;
+		src->ptr = dst->ptr;
+		src->isfree = false;
+		conv = conv_pass;
+	} else {
+		if (in->enc == ENC_U8 && job->trellis >= 0 &&
+		    (conv_enc == ENC_PCM2 || conv_enc == ENC_PCM3)) {
+			// 前後のサンプルを見て組み合わせを選ぶ (trellis.c)
+			conv = conv_enc == ENC_PCM2 ?
+				conv_u8_pcm2_trellis : conv_u8_pcm3_trellis;
+		} else if (in->enc == ENC_U8) {
+			conv = get_conv_u8_to(conv_enc);
+		} else if (conv_enc == ENC_U8) {
+			conv = get_conv_from_u8(in->enc);
+		} else {
+			fprintf(stderr, "%s: unsupported encoding pair\n", in_file);
+			goto close_in;
+		}
+		src->bufsize = dst->bufsize * enc_stride(in->enc) / enc_stride(conv_enc);
+		src->ptr = malloc(src->bufsize);
+		src->isfree = true;
+	}
+	if (dst->ptr == NULL || src->ptr == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		goto close_in;
+	}
+	rt_prefault(dst->ptr, dst->bufsize);
+	if (src->isfree) {
+		rt_prefault(src->ptr, src->bufsize);
+	}
+
+	if (isnull) {
+		if (opt_v) printf("null sink initializing\n");
+		if (null_write_init(out, job->nullsink == NULLSINK_PACED) < 0) {
+			goto close_in;
+		}
+	} else if (isdevxp) {
+		if (opt_v) printf("xp write initializing\n");
+		if (xp_write_init(out) < 0) {
+			fprintf(stderr, "xp write init error\n");
+			goto close_in;
+		}
+		// 変換しながらキャッシュにも書く
+		if (cache_miss &&
+		    cache_tee_init(&tee0, out, job->cachedir, cachepath,
+		        job->cachemax) == 0) {
+			out = &tee0;
+			tee = true;
+		}
+	} else {
+		if (strcmp(out_file, "-") == 0) {
+			out_fd = STDOUT_FILENO;
+		} else {
+			// -P で書いたデータは psgpcm_write_sync が読み直す
+			out_fd = open(out_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+			if (out_fd == -1) {
+				fprintf(stderr, "open: %s: %s\n", out_file, strerror(errno));
+				goto close_in;
+			}
+		}
+		if (opt_v) printf("%s write initializing\n", format_tostr(out_format));
+		if (out_format == FMT_WAV) {
+			r = wav_write_init(out, out_fd);
+		} else if (out_format == FMT_AU) {
+			r = au_write_init(out, out_fd);
+		} else {
+			out->opts = job->psgopts;
+			r = psgpcm_write_init(out, out_fd);
+		}
+		if (r < 0) {
+			fprintf(stderr, "%s: %s write init error\n",
+				out_file, format_tostr(out_format));
+			close(out_fd);
+			goto close_in;
+		}
+	}
+
+	if (conv_enc != out->enc) {
+		if (adpt_init(&adpt0, out, job->adpt_threshold) < 0) {
+			out->closer(out);
+			goto close_in;
+		}
+		out = &adpt0;
+	}
+
+	if (opt_v >= 1) {
+		printf("running...\n");
+		printf("input format   :%s\n", format_tostr(in_format));
+		printf("input encoding :%s\n", enc_tostr(in->enc));
+		printf("input file     :%s\n", in_file);
+		printf("output format  :%s\n", format_tostr(out_format));
+		printf("output encoding:%s\n", enc_tostr(out->enc));
+		printf("output file    :%s\n",
+			isnull ? "null sink" : isdevxp ? "XP device" : out_file);
+		printf("output freq    :%d\n", out->freq);
+		printf("input bufsize  :%zu\n", src->bufsize);
+		printf("output bufsize :%zu\n", dst->bufsize);
+		printf("pipeline depth :%d\n", job->depth);
+		printf("parallel       :%d\n", job->parallel);
+		printf("loop           :%d\n", job->loop);
+		printf("cache          :%s\n", tee ? "insert" : "off");
+	}
+
+	bool parallel = false;
+	if (job->parallel > 0 && job->loop == 1) {
+		// 出力位置が計算できるときだけ分割できる
+		struct stat ost;
+		parallel = !isdevxp && S_ISREG(st.st_mode) &&
+			in->splittable && in->enc == ENC_U8 && out == &out0 &&
+			out_format == FMT_PSGPCM && (job->psgopts & PSGPCM_OPT_Z) == 0 &&
+			fstat(out->fd, &ost) == 0 && S_ISREG(ost.st_mode);
+		if (!parallel) {
+			fprintf(stderr, "%s: cannot split this input/output, "
+				"converting serially\n", in_file);
+		}
+	}
+
+	// XP デバイス宛なら最後のページを埋める
+	// ADPT の writer は自分で埋めるので、その手前では埋めない
+	bool fill = isdevxp && out != &adpt0;
+
+	// null sink なら各段の時間を計る
+	if (isnull) {
+		bench_wrap_writer(&benchw0, out);
+		out = &benchw0;
+	}
+
+	// ページ単位に並べた PSGPCM はそのまま XP に渡せる
+	int mapped = 1;
+	if (isdevxp && conv == conv_pass && job->loop == 1) {
+		mapped = psgpcm_xp_run(in, out);
+	}
+	if (isnull && mapped > 0) {
+		bench_wrap_reader(&bench0, in, &conv);
+		in = &bench0;
+	}
+
+	if (mapped <= 0) {
+		rv = mapped;
+	} else if (job->loop != 1) {
+		rv = loop_run(in, out, conv, src->bufsize, job->loop,
+			fill ? enc_stride(out->enc) : 0);
+	} else if (parallel) {
+		rv = parallel_run(in, out, conv, in_file, job->parallel);
+		if (rv == 0) {
+			// writer を通っていないので索引を作り直す
+			rv = psgpcm_write_sync(out);
+		}
+	} else if (job->depth > 0) {
+		// XP デバイス宛ならスロットを貯めてから書き始める
+		rv = pipeline_run(in, out, conv, src->bufsize, dst->bufsize,
+			job->depth, fill ? enc_stride(in->enc) : 0, isdevxp);
+	} else {
+		for (;;) {
+			src->length = 0;
+			dst->length = 0;
+			uint64_t t = trace_begin();
+			r = in->reader(in, src);
+			trace_end(TRACE_READ, t);
+			if (r < 0) {
+				fprintf(stderr, "read error %s\n", strerror(errno));
+				break;
+			}
+			if (r == 0) {
+				rv = 0;
+				break;
+			}
+			if (fill && src->length < src->bufsize) {
+				// XP デバイス宛の書き込みはブロック単位なのでフィル
+				// ファイル終端でしか成立はしない
+				filltail(src, enc_stride(in->enc));
+			}
+			t = trace_begin();
+			conv(dst, src);
+			trace_end(TRACE_CONV, t);
+			t = trace_begin();
+			r = out->writer(out, dst);
+			trace_end(TRACE_WRITE, t);
+			if (r < 0) {
+				fprintf(stderr, "write error %s\n", strerror(errno));
+				break;
+			}
+		}
+	}
+
+	if (rv < 0 && tee) {
+		cache_tee_abort(&tee0);
+	}
+	if (out->closer(out) < 0) {
+		rv = -1;
+	}
+	if (isnull) {
+		bench_report(&out0);
+	}
+ close_in:
+	in->closer(in);
+	buffer_free(src);
+	buffer_free(dst);
+	return rv;
+}
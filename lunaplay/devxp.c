@@ -1,200 +1,130 @@
 /* vi: set ts=4: */
 
+/* XP device writer (DESC over xp.c) */
+
 #include <err.h>
-#include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-
-// XXX: local test now
-// TODO: "" to <>
-#include "machine/xpio.h"
-
 #include "lunaplay.h"
 
-#define XP_DEV	"/dev/xp"
-
-#define XP_VAR_BASE		0x0100
-#define XP_MAGIC		(XP_VAR_BASE + 0)
-#define XP_CMD_START	(XP_VAR_BASE + 8)
-#define XP_TIMER		(XP_VAR_BASE + 9)
-#define XP_ENC			(XP_VAR_BASE + 10)
-#define XP_STAT_READY	(XP_VAR_BASE + 11)
-#define XP_STAT_ERROR	(XP_VAR_BASE + 12)
-#define XP_PAGEENDL		(XP_VAR_BASE + 13)
-#define XP_PAGEENDH		(XP_VAR_BASE + 14)
-
-#define XP_FIRMSIZE_MIN	0x0200
-#define XP_FIRMSIZE_MAX	0x0fe00
-
-#define XP_MAX_SIZE 0xfe00
-
-volatile uint8_t *xp_ptr;
-
-int xp_curpage;
-int xp_isstart;
-
-uint8_t xp_builtin_firmware[] = {
-#include "firmware.inc"
+struct devxp {
+	struct xp *xp;
+	double rate;
+	bool started;
+	double lastwake;		// 前にページの切り替えに気づいた時刻 (0 なら待たなかった)
+	int64_t pageframes[2];	// 2 つ前と 1 つ前に書いたページのサンプル数
 };
-ssize_t xp_firmware_len = sizeof(xp_builtin_firmware);
-uint8_t *xp_firmware = xp_builtin_firmware;
 
-int xp_write(DESC *desc, BUFFER *buf);
-int xp_close(DESC *desc);
+static int devxp_write(DESC *desc, BUFFER *buf);
+static int devxp_close(DESC *desc);
 
 int
-xp_readmem8(int offset)
-{
-	return xp_ptr[offset];
-}
-
-void
-xp_writemem8(int offset, int v)
-{
-	xp_ptr[offset] = v;
-}
-
-void
-xp_load_firmware(const char *fname)
+xp_write_init(DESC *desc)
 {
-	int fd = open(fname, O_RDONLY);
-	if (fd == -1) {
-		err(EXIT_FAILURE, "open %s", fname);
-	}
-	struct stat sb;
-	if (fstat(fd, &sb) == -1) {
-		err(EXIT_FAILURE, "stat %s", fname);
-	}
-	if (sb.st_size < XP_FIRMSIZE_MIN || sb.st_size > XP_FIRMSIZE_MAX) {
-		errx(EXIT_FAILURE, "invalid firmware size");
-	}
-
-	xp_firmware_len = sb.st_size;
-	xp_firmware = malloc(xp_firmware_len);
-	if (xp_firmware == NULL) {
+	struct devxp *dx = calloc(1, sizeof(struct devxp));
+	if (dx == NULL) {
 		err(EXIT_FAILURE, "malloc");
 	}
-	if (read(fd, xp_firmware, xp_firmware_len) != xp_firmware_len) {
-		errx(EXIT_FAILURE, "read error firmware %s", fname);
-	}
-	if (memcmp(&xp_firmware[XP_MAGIC], "LUNAPSG", 8) != 0) {
-		errx(EXIT_FAILURE, "firmware MAGIC error");
-	}
-	close(fd);
-}
 
-int
-xp_write_init(DESC *desc)
-{
-	int r;
-	int xpfd;
-	struct xp_download xpdl;
-
-	xpfd = open(XP_DEV, O_RDWR);
-	if (xpfd == -1) {
+	// SCHED_FIFO で空回りすると他のスレッドが動けないので -R では寝て待つ
+	dx->xp = xp_open(opt_firmware, desc->enc, desc->freq,
+		opt_rt ? RT_POLL_USEC : 0);
+	if (dx->xp == NULL) {
+		if (errno == EINVAL && desc->freq > 51200) {
+			fprintf(stderr, "freq too high: %d\n", desc->freq);
+			free(dx);
+			return -1;
+		}
+		if (errno == ENOEXEC) {
+			// firmware.inc が xppcm.asm より古い
+			errx(EXIT_FAILURE, "XP firmware version mismatch "
+				"(rebuild firmware.inc from xppcm.asm)");
+		}
+		if (errno == EIO) {
+			errx(EXIT_FAILURE, "XP firmware error");
+		}
 		err(EXIT_FAILURE, "open XP device");
 	}
-
-	if (opt_firmware != NULL) {
-		xp_load_firmware(opt_firmware);
-	}
-
-	xpdl.size = xp_firmware_len;
-	xpdl.data = xp_firmware;
-
-	r = ioctl(xpfd, XPIOCDOWNLD, &xpdl);
-	if (r != 0) {
-		err(EXIT_FAILURE, "ioctl XPIOCDOWNLD");
-	}
-
-	xp_ptr = mmap(NULL, XP_MAX_SIZE, PROT_WRITE | PROT_READ,
-		MAP_SHARED, desc->fd, 0);
-	if (xp_ptr == MAP_FAILED) {
-		err(EXIT_FAILURE, "mmap");
-	}
-
-	// freq to timer
-#define XP_CPU_FREQ 6144000
-#define XP_TIMER_DIV 20
-#define XP_TIMER_BASEFREQ (XP_CPU_FREQ / XP_TIMER_DIV)
-	int divisor = XP_TIMER_BASEFREQ / desc->freq;
+	dx->rate = xp_rate(dx->xp);
 	if (opt_v) {
-		printf("xp freq: %d\n", divisor * XP_TIMER_BASEFREQ);
+		printf("xp freq: %g\n", dx->rate);
 	}
-	if (divisor < 6) {
-		// 51.2kHz
-		fprintf(stderr, "freq too high: %d\n", desc->freq);
-		return -1;
-	}
-	if (divisor > 77) {
-		// 3989Hz
+	if (dx->rate < 3989) {
+		// 遅すぎて 1 ページが長い
 		fprintf(stderr, "freq too low: %d\n", desc->freq);
 	}
-	int timer = divisor - 1;
-	xp_writemem8(XP_TIMER, timer);
-
-	xp_writemem8(XP_ENC, desc->enc);
-
-	xp_curpage = 0;
-	xp_isstart = 0;
+	size_t len;
+	volatile uint8_t *win = xp_window(dx->xp, &len);
+	rt_prefault_ro(win, len);
 
-	desc->fd = xpfd;
-	desc->writer = xp_write;
-	desc->closer = xp_close;
+	desc->fd = -1;
+	desc->priv = dx;
+	desc->writer = devxp_write;
+	desc->closer = devxp_close;
+	return 0;
 }
 
 static
-void
-xp_sleep()
-{
-}
-
 int
-xp_start()
+devxp_write(DESC *desc, BUFFER *buf)
 {
-	while (xp_readmem8(XP_STAT_READY) != 1) {
-		xp_sleep();
-	}
-	xp_writemem8(XP_CMD_START, 1);
-}
+	struct devxp *dx = desc->priv;
+	int waits;
 
-int
-xp_write(DESC *desc, BUFFER *buf)
-{
-	int curpagetop = xp_curpage == 0 ? 0x4000 : 0x8000;
-	int curpageendH = xp_curpage == 0 ? 0x80 : 0xc0;
+	uint64_t t = trace_begin();
+	uint8_t *page = xp_page(dx->xp, true, &waits);
+	if (page == NULL) {
+		fprintf(stderr, "XP: %s\n", strerror(errno));
+		return -1;
+	}
+	if (dx->started) {
+		if (waits == 0) {
+			// もう次のページを再生している。余裕が 1 ページを切った
+			trace_mark(TRACE_WAIT, "no slack");
+		}
+		trace_end(TRACE_WAIT, t);
 
-	if (xp_isstart) {
-		while (xp_readmem8(XP_PAGEENDH) == curpageendH) {
-			xp_sleep();
+		// 前に気づいてからの間に XP は 2 つ前に書いたページを再生した。
+		// 切り替わる時刻 (期限) からどれだけ遅れて気づいたか
+		double now = opt_rt ? rt_now() : 0;
+		if (waits > 0 && dx->lastwake > 0) {
+			rt_jitter(now - dx->lastwake - dx->pageframes[0] / dx->rate);
 		}
+		dx->lastwake = waits > 0 ? now : 0;
 	}
+	int64_t frames = desc->enc == ENC_ADPT ?
+		adpt_frames(buf) : buf->length / enc_stride(desc->enc);
+	dx->pageframes[0] = dx->pageframes[1];
+	dx->pageframes[1] = frames;
 
 	int n = buf->length;
-	memcpy((void*)&xp_ptr[curpagetop], buf->ptr, n);
+	t = trace_begin();
+	memcpy(page, buf->ptr, n);
+	trace_end(TRACE_COPY, t);
 
-	if (xp_isstart == 0) {
-		xp_start();
+	if (xp_commit(dx->xp, frames) < 0) {
+		fprintf(stderr, "XP: %s\n", strerror(errno));
+		return -1;
 	}
-	xp_curpage ^= 1;
+	dx->started = true;
 	buf->length = 0;
 	return n;
 }
 
+static
 int
-xp_close(DESC *desc)
+devxp_close(DESC *desc)
 {
-	munmap((void*)xp_ptr, XP_MAX_SIZE);
-	close(desc->fd);
-	return 0;
-}
+	struct devxp *dx = desc->priv;
 
-
-/* TODO:
- 割り込み制御
- カウンタ制御
-*/
+	// 最後のページまで鳴らしてから無音にする
+	int r = xp_drain(dx->xp);
+	if (r < 0) {
+		fprintf(stderr, "XP: %s\n", strerror(errno));
+	}
+	xp_close(dx->xp);
+	free(dx);
+	return r;
+}
@@ -2,18 +2,35 @@
 /* see LICENSE */ 
 
 #include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/endian.h>
+#include "lunaplay.h"
+#include "filehelper.h"
+
+// データの読み書きの syscall の回数 (null sink の表示用)
+static atomic_uint io_nread;
+static atomic_uint io_nwrite;
+
+// これまでの read/write の syscall の回数を返す。
+void
+io_counts(unsigned int *nread, unsigned int *nwrite)
+{
+	*nread = atomic_load_explicit(&io_nread, memory_order_relaxed);
+	*nwrite = atomic_load_explicit(&io_nwrite, memory_order_relaxed);
+}
 
 // 可能な限り length バイト読み込む。
 // EOF の場合はそれまでに読み込めたバイト数を返す。
 // エラーの場合は負数を返す。
-int
-readbuf(int fd, uint8_t *buf, int length)
+ssize_t
+readbuf(int fd, uint8_t *buf, size_t length)
 {
-	int r;
-	for (int m = 0; m < length; m += r) {
+	ssize_t r;
+	for (size_t m = 0; m < length; m += r) {
 		r = read(fd, buf + m, length - m);
+		atomic_fetch_add_explicit(&io_nread, 1, memory_order_relaxed);
 		if (r < 0) {
 			if (errno == EAGAIN) {
 				r = 0;
@@ -29,12 +46,13 @@ readbuf(int fd, uint8_t *buf, int length)
 }
 
 // 可能な限り length バイト書き込む。
-int
-writebuf(int fd, uint8_t *buf, int length)
+ssize_t
+writebuf(int fd, uint8_t *buf, size_t length)
 {
-	int r;
-	for (int m = 0; m < length; m += r) {
+	ssize_t r;
+	for (size_t m = 0; m < length; m += r) {
 		r = write(fd, buf + m, length - m);
+		atomic_fetch_add_explicit(&io_nwrite, 1, memory_order_relaxed);
 		if (r < 0) {
 			if (errno == EAGAIN) {
 				r = 0;
@@ -46,7 +64,85 @@ writebuf(int fd, uint8_t *buf, int length)
 	return length;
 }
 
+// offset の位置に書く。ファイル位置は変えないので複数スレッドから使える。
+ssize_t
+pwritebuf(int fd, const uint8_t *buf, size_t length, off_t offset)
+{
+	ssize_t r;
+	for (size_t m = 0; m < length; m += r) {
+		r = pwrite(fd, buf + m, length - m, offset + m);
+		atomic_fetch_add_explicit(&io_nwrite, 1, memory_order_relaxed);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			return r;
+		}
+	}
+	return length;
+}
+
+/* ***** reader helper ***** */
+
+// desc->remain を越えないように読み込む。
+ssize_t
+desc_readdata(DESC *desc, uint8_t *buf, size_t length)
+{
+	if (desc->remain >= 0 && length > desc->remain) {
+		length = desc->remain;
+	}
+	ssize_t n = readbuf(desc->fd, buf, length);
+	if (n > 0 && desc->remain >= 0) {
+		desc->remain -= n;
+	}
+	return n;
+}
+
+// buf の空きの分だけフレームを desc->tmp に読み込み、フレーム数を返す。
+// desc->tmp は XP_BUFSIZE フレーム分確保してあること。
+ssize_t
+desc_readframes(DESC *desc, BUFFER *buf)
+{
+	size_t count = buf->bufsize - buf->length;
+	if (count > XP_BUFSIZE) {
+		count = XP_BUFSIZE;
+	}
+	ssize_t n = desc_readdata(desc, desc->tmp, count * desc->framesize);
+	if (n < 0) {
+		return n;
+	}
+	return n / desc->framesize;
+}
+
+// frames フレーム読み飛ばし、飛ばしたフレーム数を返す。
+// フレームが固定長の reader 用の seeker。
+int64_t
+desc_seekframes(DESC *desc, int64_t frames)
+{
+	off_t bytes = frames * desc->framesize;
+	if (desc->remain >= 0 && bytes > desc->remain) {
+		bytes = desc->remain - desc->remain % desc->framesize;
+	}
+	if (!readskip(desc->fd, bytes)) {
+		return -1;
+	}
+	if (desc->remain >= 0) {
+		desc->remain -= bytes;
+	}
+	return bytes / desc->framesize;
+}
+
 /* ***** read helper ***** */
+int
+read64le(int fd, int64_t *rv)
+{
+	int n = read(fd, rv, 8);
+	if (n != 8) return 0;
+	*rv = le64toh(*rv);
+	return n;
+}
+
 int
 read32le(int fd, int32_t *rv)
 {
@@ -56,6 +152,15 @@ read32le(int fd, int32_t *rv)
 	return n;
 }
 
+int
+read32be(int fd, int32_t *rv)
+{
+	int n = read(fd, rv, 4);
+	if (n != 4) return 0;
+	*rv = be32toh(*rv);
+	return n;
+}
+
 int
 read16le(int fd, int16_t *rv)
 {
@@ -73,19 +178,39 @@ read8(int fd, int8_t *rv)
 	return n;
 }
 
+// bytes バイト読み飛ばす。
+// シーク可能なら lseek、パイプならまとめて読み捨てる。
 int
-readskip(int fd, int bytes)
+readskip(int fd, off_t bytes)
 {
-	int b;
-	for (int i = 0; i < bytes; i++) {
-		if (read(fd, &b, 1) != 1) {
+	uint8_t b[65536];
+
+	if (bytes == 0) {
+		return 1;
+	}
+	if (lseek(fd, bytes, SEEK_CUR) != -1) {
+		return 1;
+	}
+	while (bytes > 0) {
+		size_t len = bytes < sizeof(b) ? bytes : sizeof(b);
+		if (readbuf(fd, b, len) != len) {
 			return 0;
 		}
+		bytes -= len;
 	}
-	return bytes;
+	return 1;
 }
 
 /* ***** write helper ***** */
+int
+write64le(int fd, int64_t v)
+{
+	v = htole64(v);
+	int n = write(fd, &v, 8);
+	if (n != 8) return 0;
+	return n;
+}
+
 int
 write32le(int fd, int32_t v)
 {
@@ -95,6 +220,15 @@ write32le(int fd, int32_t v)
 	return n;
 }
 
+int
+write32be(int fd, int32_t v)
+{
+	v = htobe32(v);
+	int n = write(fd, &v, 4);
+	if (n != 4) return 0;
+	return n;
+}
+
 int
 write16le(int fd, int16_t v)
 {
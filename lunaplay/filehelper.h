@@ -1,16 +1,29 @@
 
 #pragma once
 
-int readbuf(int fd, uint8_t *buf, int length);
-int writebuf(int fd, uint8_t *buf, int length);
+#include <sys/types.h>
+#include "lunaplay.h"
+
+ssize_t readbuf(int fd, uint8_t *buf, size_t length);
+ssize_t writebuf(int fd, uint8_t *buf, size_t length);
+ssize_t pwritebuf(int fd, const uint8_t *buf, size_t length, off_t offset);
+void io_counts(unsigned int *nread, unsigned int *nwrite);
+
+ssize_t desc_readdata(DESC *desc, uint8_t *buf, size_t length);
+ssize_t desc_readframes(DESC *desc, BUFFER *buf);
+int64_t desc_seekframes(DESC *desc, int64_t frames);
 
 // 成功すると!=0 を返します。
 // 失敗すると 0 を返します。
+int read64le(int fd, int64_t *rv);
 int read32le(int fd, int32_t *rv);
+int read32be(int fd, int32_t *rv);
 int read16le(int fd, int16_t *rv);
 int read8(int fd, int8_t *rv);
-int readskip(int fd, int bytes);
+int readskip(int fd, off_t bytes);
+int write64le(int fd, int64_t v);
 int write32le(int fd, int32_t v);
+int write32be(int fd, int32_t v);
 int write16le(int fd, int16_t v);
 int write8(int fd, int8_t v);
 
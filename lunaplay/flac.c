@@ -0,0 +1,707 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* FLAC format reader */
+
+/*
+ * 外部ライブラリを使わないストリーミングデコーダ。
+ * 1 フレームずつデコードし、メモリは最大ブロックサイズ分だけ使う。
+ * フレームヘッダの CRC-8 とフレームの CRC-16 は検証する。MD5 は検証しない。
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lunaplay.h"
+#include "filehelper.h"
+
+#define FLAC_MAXCHANNEL	8
+#define FLAC_MAXORDER	32
+#define FLAC_IOSIZE		65536
+
+struct flac {
+	int fd;
+
+	// bit reader
+	uint8_t *io;		// read buffer
+	int iopos;
+	int iolen;
+	uint64_t cache;		// 右詰めのビットキャッシュ
+	int cachebits;
+	bool error;			// EOF or broken stream
+	// キャッシュに入れたバイトまでの CRC。直近 16 バイト分を
+	// nloaded & 15 で持ち、読んだ位置のものを引く
+	uint32_t nloaded;
+	uint8_t crc8[16];
+	uint16_t crc16[16];
+
+	// STREAMINFO
+	int maxblock;
+	int channels;
+	int bps;
+
+	// decoded frame
+	int pos;			// next frame
+	int count;			// valid frames
+	int32_t *pcm[FLAC_MAXCHANNEL];
+};
+
+static int flac_read(DESC *desc, BUFFER *buf);
+static int flac_close(DESC *desc);
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+static
+void
+flac_crc_init_once()
+{
+	for (int i = 0; i < 256; i++) {
+		uint8_t c8 = i;
+		uint16_t c16 = i << 8;
+		for (int k = 0; k < 8; k++) {
+			c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+			c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+		}
+		crc8_table[i] = c8;
+		crc16_table[i] = c16;
+	}
+}
+
+// 複数スレッドから呼ばれても一度だけ作る
+static
+void
+flac_crc_init()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, flac_crc_init_once);
+}
+
+// CRC を 1 バイト進める (FLAC の CRC-8 は x^8+x^2+x+1, CRC-16 は
+// x^16+x^15+x^2+1。どちらも 0 から始めて MSB から)
+static inline
+void
+flac_crc_byte(uint8_t *c8, uint16_t *c16, uint8_t x)
+{
+	*c8 = crc8_table[*c8 ^ x];
+	*c16 = (*c16 << 8) ^ crc16_table[(*c16 >> 8) ^ x];
+}
+
+/* ***** bit reader ***** */
+
+static
+void
+br_refill(struct flac *f)
+{
+	while (f->cachebits < 56) {
+		if (f->iopos >= f->iolen) {
+			ssize_t n = readbuf(f->fd, f->io, FLAC_IOSIZE);
+			if (n <= 0) {
+				return;
+			}
+			f->iopos = 0;
+			f->iolen = n;
+		}
+		uint8_t x = f->io[f->iopos++];
+		f->cache = (f->cache << 8) | x;
+		f->cachebits += 8;
+		int i = f->nloaded & 15;
+		int j = (i + 1) & 15;
+		f->crc8[j] = f->crc8[i];
+		f->crc16[j] = f->crc16[i];
+		flac_crc_byte(&f->crc8[j], &f->crc16[j], x);
+		f->nloaded++;
+	}
+}
+
+// n ビット (0..32) を符号なしで読む
+static inline
+uint32_t
+br_bits(struct flac *f, int n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	if (f->cachebits < n) {
+		br_refill(f);
+		if (f->cachebits < n) {
+			f->error = true;
+			return 0;
+		}
+	}
+	f->cachebits -= n;
+	return (f->cache >> f->cachebits) & (0xffffffffU >> (32 - n));
+}
+
+static inline
+int32_t
+br_sbits(struct flac *f, int n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	uint32_t v = br_bits(f, n);
+	return (int32_t)(v << (32 - n)) >> (32 - n);
+}
+
+// 1 が出るまでの 0 の数
+static inline
+uint32_t
+br_unary(struct flac *f)
+{
+	uint32_t q = 0;
+	for (;;) {
+		if (f->cachebits == 0) {
+			br_refill(f);
+			if (f->cachebits == 0) {
+				f->error = true;
+				return 0;
+			}
+		}
+		uint64_t v = f->cache & ((1ULL << f->cachebits) - 1);
+		if (v == 0) {
+			q += f->cachebits;
+			f->cachebits = 0;
+			continue;
+		}
+		int lz = __builtin_clzll(v) - (64 - f->cachebits);
+		q += lz;
+		f->cachebits -= lz + 1;
+		return q;
+	}
+}
+
+static
+void
+br_align(struct flac *f)
+{
+	f->cachebits &= ~7;
+}
+
+// 読んだ位置 (バイト境界) までの CRC の添字
+static inline
+int
+br_crcpos(struct flac *f)
+{
+	return (f->nloaded - f->cachebits / 8) & 15;
+}
+
+// 読んだ位置 (バイト境界) の CRC を c8, c16 にして、キャッシュに
+// 残っている先読みのバイトの分を数え直す
+static
+void
+br_crcreset(struct flac *f, uint8_t c8, uint16_t c16)
+{
+	int i = br_crcpos(f);
+	f->crc8[i] = c8;
+	f->crc16[i] = c16;
+	for (int k = f->cachebits / 8 - 1; k >= 0; k--) {
+		int j = (i + 1) & 15;
+		f->crc8[j] = f->crc8[i];
+		f->crc16[j] = f->crc16[i];
+		flac_crc_byte(&f->crc8[j], &f->crc16[j], f->cache >> (k * 8));
+		i = j;
+	}
+}
+
+/* ***** frame decoder ***** */
+
+static
+int
+flac_residual(struct flac *f, int32_t *res, int blocksize, int order)
+{
+	int method = br_bits(f, 2);
+	if (method > 1) {
+		fprintf(stderr, "FLAC reserved residual method\n");
+		return -1;
+	}
+	int parambits = method == 0 ? 4 : 5;
+	int escape = (1 << parambits) - 1;
+	int porder = br_bits(f, 4);
+	int parts = 1 << porder;
+	if ((blocksize >> porder) < order || (blocksize & (parts - 1))) {
+		fprintf(stderr, "FLAC invalid partition order\n");
+		return -1;
+	}
+
+	int i = 0;
+	for (int p = 0; p < parts; p++) {
+		int n = (blocksize >> porder) - (p == 0 ? order : 0);
+		int k = br_bits(f, parambits);
+		if (k == escape) {
+			int bits = br_bits(f, 5);
+			for (int j = 0; j < n; j++) {
+				res[i++] = br_sbits(f, bits);
+			}
+		} else {
+			for (int j = 0; j < n; j++) {
+				uint32_t u = (br_unary(f) << k) | br_bits(f, k);
+				res[i++] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+			}
+		}
+		if (f->error) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static
+int
+flac_subframe(struct flac *f, int32_t *out, int blocksize, int bps)
+{
+	if (br_bits(f, 1) != 0) {
+		fprintf(stderr, "FLAC subframe padding error\n");
+		return -1;
+	}
+	int type = br_bits(f, 6);
+	int wasted = 0;
+	if (br_bits(f, 1)) {
+		wasted = br_unary(f) + 1;
+		bps -= wasted;
+	}
+	if (bps <= 0 || bps > 32) {
+		fprintf(stderr, "FLAC invalid wasted bits\n");
+		return -1;
+	}
+
+	if (type == 0) {
+		// CONSTANT
+		int32_t v = br_sbits(f, bps);
+		for (int i = 0; i < blocksize; i++) {
+			out[i] = v;
+		}
+	} else if (type == 1) {
+		// VERBATIM
+		for (int i = 0; i < blocksize; i++) {
+			out[i] = br_sbits(f, bps);
+		}
+	} else if (type >= 8 && type <= 12) {
+		// FIXED
+		int order = type - 8;
+		if (order > blocksize) {
+			return -1;
+		}
+		for (int i = 0; i < order; i++) {
+			out[i] = br_sbits(f, bps);
+		}
+		if (flac_residual(f, out + order, blocksize, order) < 0) {
+			return -1;
+		}
+		switch (order) {
+		 case 1:
+			for (int i = 1; i < blocksize; i++) {
+				out[i] += out[i - 1];
+			}
+			break;
+		 case 2:
+			for (int i = 2; i < blocksize; i++) {
+				out[i] += 2 * out[i - 1] - out[i - 2];
+			}
+			break;
+		 case 3:
+			for (int i = 3; i < blocksize; i++) {
+				out[i] += 3 * out[i - 1] - 3 * out[i - 2] + out[i - 3];
+			}
+			break;
+		 case 4:
+			for (int i = 4; i < blocksize; i++) {
+				out[i] += 4 * out[i - 1] - 6 * out[i - 2]
+					+ 4 * out[i - 3] - out[i - 4];
+			}
+			break;
+		}
+	} else if (type >= 32) {
+		// LPC (固定小数点)
+		int order = type - 31;
+		int32_t coef[FLAC_MAXORDER];
+		if (order > blocksize) {
+			return -1;
+		}
+		for (int i = 0; i < order; i++) {
+			out[i] = br_sbits(f, bps);
+		}
+		int precision = br_bits(f, 4) + 1;
+		int shift = br_sbits(f, 5);
+		if (precision == 16 || shift < 0) {
+			fprintf(stderr, "FLAC invalid LPC header\n");
+			return -1;
+		}
+		for (int i = 0; i < order; i++) {
+			coef[i] = br_sbits(f, precision);
+		}
+		if (flac_residual(f, out + order, blocksize, order) < 0) {
+			return -1;
+		}
+		int orderbits = 0;
+		while ((1 << orderbits) < order) {
+			orderbits++;
+		}
+		if (bps + precision + orderbits <= 32) {
+			// 桁あふれしないなら 32bit 演算で済ませる
+			for (int i = order; i < blocksize; i++) {
+				int32_t sum = 0;
+				for (int j = 0; j < order; j++) {
+					sum += coef[j] * out[i - 1 - j];
+				}
+				out[i] += sum >> shift;
+			}
+		} else {
+			for (int i = order; i < blocksize; i++) {
+				int64_t sum = 0;
+				for (int j = 0; j < order; j++) {
+					sum += (int64_t)coef[j] * out[i - 1 - j];
+				}
+				out[i] += (int32_t)(sum >> shift);
+			}
+		}
+	} else {
+		fprintf(stderr, "FLAC reserved subframe type %d\n", type);
+		return -1;
+	}
+
+	if (wasted) {
+		for (int i = 0; i < blocksize; i++) {
+			out[i] <<= wasted;
+		}
+	}
+	return f->error ? -1 : 0;
+}
+
+// 1 フレームをデコードして、フレーム数を返す。EOF なら 0。
+static
+int
+flac_frame(struct flac *f)
+{
+	static const int blocksize_tab[16] = {
+		0, 192, 576, 1152, 2304, 4608, 0, 0,
+		256, 512, 1024, 2048, 4096, 8192, 16384, 32768,
+	};
+	static const int bps_tab[8] = {
+		0, 8, 12, 0, 16, 20, 24, 32,
+	};
+
+	// 同期コードを探す
+	br_align(f);
+	uint32_t v;
+	for (;;) {
+		v = br_bits(f, 8);
+		if (f->error) {
+			return 0;
+		}
+		if (v != 0xff) {
+			continue;
+		}
+		v = br_bits(f, 8);
+		if ((v & 0xfe) == 0xf8) {
+			break;
+		}
+		if (f->error) {
+			return 0;
+		}
+	}
+	// CRC は同期コードから数える
+	uint8_t c8 = 0;
+	uint16_t c16 = 0;
+	flac_crc_byte(&c8, &c16, 0xff);
+	flac_crc_byte(&c8, &c16, v);
+	br_crcreset(f, c8, c16);
+
+	int bscode = br_bits(f, 4);
+	int srcode = br_bits(f, 4);
+	int chassign = br_bits(f, 4);
+	int sscode = br_bits(f, 3);
+	br_bits(f, 1);
+
+	// UTF-8 風のフレーム/サンプル番号
+	uint32_t b = br_bits(f, 8);
+	int extra = 0;
+	while (b & 0x80 >> extra) {
+		extra++;
+	}
+	if (extra > 0) {
+		extra--;
+	}
+	for (int i = 0; i < extra; i++) {
+		br_bits(f, 8);
+	}
+
+	int blocksize;
+	if (bscode == 6) {
+		blocksize = br_bits(f, 8) + 1;
+	} else if (bscode == 7) {
+		blocksize = br_bits(f, 16) + 1;
+	} else {
+		blocksize = blocksize_tab[bscode];
+	}
+	if (srcode == 12) {
+		br_bits(f, 8);
+	} else if (srcode == 13 || srcode == 14) {
+		br_bits(f, 16);
+	}
+	uint8_t hcrc = f->crc8[br_crcpos(f)];
+	if (br_bits(f, 8) != hcrc && !f->error) {
+		fprintf(stderr, "FLAC frame header CRC error\n");
+		f->error = true;
+		errno = EIO;
+		return -1;
+	}
+
+	int bps = sscode == 0 ? f->bps : bps_tab[sscode];
+	int channels = chassign < 8 ? chassign + 1 : 2;
+	if (f->error) {
+		return 0;
+	}
+	if (blocksize == 0 || blocksize > f->maxblock || bps == 0
+	 || channels != f->channels || chassign > 10) {
+		fprintf(stderr, "FLAC invalid frame header\n");
+		f->error = true;
+		return -1;
+	}
+
+	for (int c = 0; c < channels; c++) {
+		// side チャンネルは 1 ビット多い
+		int sbps = bps;
+		if ((chassign == 8 && c == 1)
+		 || (chassign == 9 && c == 0)
+		 || (chassign == 10 && c == 1)) {
+			sbps++;
+		}
+		if (flac_subframe(f, f->pcm[c], blocksize, sbps) < 0) {
+			f->error = true;
+			return -1;
+		}
+	}
+	br_align(f);
+	uint16_t fcrc = f->crc16[br_crcpos(f)];
+	uint16_t crc = br_bits(f, 16);
+	if (f->error) {
+		return 0;
+	}
+	if (crc != fcrc) {
+		fprintf(stderr, "FLAC frame CRC error\n");
+		f->error = true;
+		errno = EIO;
+		return -1;
+	}
+
+	int32_t *l = f->pcm[0];
+	int32_t *r = f->pcm[1];
+	switch (chassign) {
+	 case 8:		// left/side
+		for (int i = 0; i < blocksize; i++) {
+			r[i] = l[i] - r[i];
+		}
+		break;
+	 case 9:		// side/right
+		for (int i = 0; i < blocksize; i++) {
+			l[i] += r[i];
+		}
+		break;
+	 case 10:		// mid/side
+		for (int i = 0; i < blocksize; i++) {
+			int32_t side = r[i];
+			int32_t mid = (l[i] << 1) | (side & 1);
+			l[i] = (mid + side) >> 1;
+			r[i] = (mid - side) >> 1;
+		}
+		break;
+	}
+	return blocksize;
+}
+
+/* ***** initializer ***** */
+
+int
+flac_read_init(DESC *desc, int fd)
+{
+	uint32_t tag;
+	uint32_t freq = 0;
+	bool hasinfo = false;
+	bool last = false;
+
+	if (!readtag(fd, &tag) || !cmptag(tag, "fLaC")) {
+		fprintf(stderr, "FLAC header read error\n");
+		return -1;
+	}
+
+	struct flac *f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	f->fd = fd;
+	flac_crc_init();
+
+	while (!last) {
+		uint32_t hdr;
+		if (!readtag(fd, &hdr)) {
+			fprintf(stderr, "FLAC metadata read error\n");
+			goto error;
+		}
+		last = hdr >> 31;
+		int type = (hdr >> 24) & 0x7f;
+		uint32_t len = hdr & 0xffffff;
+
+		if (type == 0) {
+			// STREAMINFO
+			uint8_t si[34];
+			if (len < sizeof(si) || readbuf(fd, si, sizeof(si)) != sizeof(si)) {
+				fprintf(stderr, "FLAC STREAMINFO read error\n");
+				goto error;
+			}
+			f->maxblock = si[2] << 8 | si[3];
+			freq = si[10] << 12 | si[11] << 4 | si[12] >> 4;
+			f->channels = ((si[12] >> 1) & 7) + 1;
+			f->bps = ((si[12] & 1) << 4 | si[13] >> 4) + 1;
+			len -= sizeof(si);
+			hasinfo = true;
+		}
+		if (!readskip(fd, len)) {
+			fprintf(stderr, "FLAC metadata skip error\n");
+			goto error;
+		}
+	}
+	if (!hasinfo) {
+		fprintf(stderr, "FLAC no STREAMINFO\n");
+		goto error;
+	}
+
+	if (opt_v) {
+		fprintf(stderr, "maxblock: %d\n", f->maxblock);
+		fprintf(stderr, "channel : %d\n", f->channels);
+		fprintf(stderr, "freq    : %u\n", freq);
+		fprintf(stderr, "bit     : %d\n", f->bps);
+	}
+
+	if (f->maxblock < 16 || f->bps < 4 || f->bps > 32) {
+		fprintf(stderr, "FLAC unsupported STREAMINFO\n");
+		goto error;
+	}
+
+	f->io = malloc(FLAC_IOSIZE);
+	if (f->io == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		goto error;
+	}
+	for (int c = 0; c < f->channels; c++) {
+		f->pcm[c] = malloc(f->maxblock * sizeof(int32_t));
+		if (f->pcm[c] == NULL) {
+			fprintf(stderr, "malloc: %s\n", strerror(errno));
+			goto error;
+		}
+	}
+
+	desc->priv = f;
+	desc->channels = f->channels;
+	desc->mixmul = (65536 + f->channels - 1) / f->channels;
+	desc->remain = -1;
+
+	desc->reader = flac_read;
+	desc->closer = flac_close;
+
+	// reader が u8 に変換する
+	desc->enc = ENC_U8;
+	desc->fd = fd;
+	desc->freq = freq;
+	return 0;
+
+ error:
+	free(f->io);
+	for (int c = 0; c < FLAC_MAXCHANNEL; c++) {
+		free(f->pcm[c]);
+	}
+	free(f);
+	return -1;
+}
+
+/* ***** reader ***** */
+
+static
+int
+flac_read(DESC *desc, BUFFER *buf)
+{
+	struct flac *f = desc->priv;
+	int ch = f->channels;
+	// 上位 8 ビットを取り出すシフト量
+	int shift = f->bps - 8;
+
+	while (buf->length < buf->bufsize) {
+		if (f->pos >= f->count) {
+			if (f->error) {
+				break;
+			}
+			int n = flac_frame(f);
+			if (n < 0) {
+				return n;
+			}
+			if (n == 0) {
+				break;
+			}
+			f->pos = 0;
+			f->count = n;
+		}
+
+		int count = f->count - f->pos;
+		if (count > buf->bufsize - buf->length) {
+			count = buf->bufsize - buf->length;
+		}
+		uint8_t *d = buf->ptr + buf->length;
+		const int32_t *l = f->pcm[0] + f->pos;
+		if (shift < 0) {
+			// 8bit 未満
+			for (int i = 0; i < count; i++) {
+				int32_t s = l[i];
+				for (int c = 1; c < ch; c++) {
+					s += f->pcm[c][f->pos + i];
+				}
+				*d++ = ((s << -shift) / ch) + 128;
+			}
+		} else if (ch == 1) {
+			for (int i = 0; i < count; i++) {
+				*d++ = (l[i] >> shift) + 128;
+			}
+		} else if (ch == 2) {
+			const int32_t *r = f->pcm[1] + f->pos;
+			for (int i = 0; i < count; i++) {
+				*d++ = ((l[i] >> shift) + (r[i] >> shift) + 256) >> 1;
+			}
+		} else {
+			uint32_t mixmul = desc->mixmul;
+			for (int i = 0; i < count; i++) {
+				uint32_t sum = 0;
+				for (int c = 0; c < ch; c++) {
+					sum += (f->pcm[c][f->pos + i] >> shift) + 128;
+				}
+				*d++ = (sum * mixmul) >> 16;
+			}
+		}
+		f->pos += count;
+		buf->length += count;
+	}
+	return buf->length;
+}
+
+/* ***** closer ***** */
+
+static
+int
+flac_close(DESC *desc)
+{
+	struct flac *f = desc->priv;
+
+	free(f->io);
+	for (int c = 0; c < FLAC_MAXCHANNEL; c++) {
+		free(f->pcm[c]);
+	}
+	free(f);
+	close(desc->fd);
+	return 0;
+}
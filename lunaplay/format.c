@@ -1,7 +1,10 @@
 /* vi: set ts=4: */
 /* TODO: LICENSE */
 
+#include <err.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "lunaplay.h"
 
 struct format_item {
@@ -13,17 +16,20 @@ struct format_item {
 static const struct format_item arg_list[] = {
 	{ STR_WAV,  FMT_WAV,    ENC_U8 },
 	{ STR_AU,   FMT_AU,     ENC_U8 },
+	{ STR_FLAC, FMT_FLAC,   ENC_U8 },
 	{ STR_PCM1, FMT_PSGPCM, ENC_PCM1 },
 	{ STR_PCM2, FMT_PSGPCM, ENC_PCM2 },
 	{ STR_PCM3, FMT_PSGPCM, ENC_PCM3 },
 	{ STR_PAM2, FMT_PSGPCM, ENC_PAM2 },
 	{ STR_PAM3, FMT_PSGPCM, ENC_PAM3 },
+	{ STR_ADPT, FMT_PSGPCM, ENC_ADPT },
 };
 
 static const struct format_item format_list[] = {
 	{ STR_WAV, FMT_WAV, 0 },
 	{ STR_AU,  FMT_AU, 0 },
 	{ STR_PSGPCM, FMT_PSGPCM, 0 },
+	{ STR_FLAC, FMT_FLAC, 0 },
 };
 
 static const struct format_item enc_list[] = {
@@ -33,6 +39,7 @@ static const struct format_item enc_list[] = {
 	{ STR_PCM3, 0, ENC_PCM3 },
 	{ STR_PAM2, 0, ENC_PAM2 },
 	{ STR_PAM3, 0, ENC_PAM3 },
+	{ STR_ADPT, 0, ENC_ADPT },
 };
 
 
@@ -76,3 +83,76 @@ enc_tostr(const int enc)
 	return STR_UNKNOWN;
 }
 
+// 拡張子全体が ext か (x.wave や y.sndbak は違う)
+static
+bool
+isextension(const char *fname, const char *ext)
+{
+	char *p = strrchr(fname, '.');
+	if (p == NULL) {
+		return false;
+	}
+	return strcasecmp(p, ext) == 0;
+}
+
+/*
+ ファイル名の拡張子からフォーマットコードを求めます。
+ 分からなければ FMT_UNKNOWN を返します。
+ */
+int
+format_fromext(const char *fname)
+{
+	if (fname == NULL) {
+		return FMT_UNKNOWN;
+	}
+	if (isextension(fname, "." STR_WAV)) {
+		return FMT_WAV;
+	} else if (isextension(fname, "." STR_AU) || isextension(fname, ".snd")) {
+		return FMT_AU;
+	} else if (isextension(fname, "." STR_FLAC)) {
+		return FMT_FLAC;
+	} else if (isextension(fname, "." STR_PSGPCM)) {
+		return FMT_PSGPCM;
+	}
+	return FMT_UNKNOWN;
+}
+
+// 出力ファイル名に付ける拡張子
+const char *
+format_toext(const int format)
+{
+	switch (format) {
+	 case FMT_WAV:
+		return ".wav";
+	 case FMT_AU:
+		return ".au";
+	 case FMT_FLAC:
+		return ".flac";
+	 case FMT_PSGPCM:
+		return ".psgpcm";
+	}
+	return "";
+}
+
+// エンコーディングの 1 サンプルあたりのバイト数
+int
+enc_stride(int enc)
+{
+	switch (enc) {
+	 case ENC_U8:
+		return 1;
+	 case ENC_PCM1:
+		return 1;
+	 case ENC_PCM2:
+	 case ENC_PAM2:
+		return 2;
+	 case ENC_PCM3:
+	 case ENC_PAM3:
+		return 4;
+	 case ENC_ADPT:
+		// ページ単位で、サンプルの大きさはページごとに違う
+		return 1;
+	 default:
+		errx(EXIT_FAILURE, "unknown encoding");
+	}
+}
@@ -1,9 +1,13 @@
 /* vi: set ts=4: */
 #include <err.h>
+#include <float.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include "lunaplay.h"
@@ -19,6 +23,10 @@ struct PTE PCM1[16];
 struct PTE PCM2[16*16];
 struct PTE PCM3[16*16*16];
 
+// PAM の各相の時間の比 (合計 1)。PCM なら pam_phases = 0
+double pam_duty[3];
+int pam_phases;
+
 struct PTO {
 	double original;
 	double gained;
@@ -39,7 +47,11 @@ pte_comp_v(const void *a, const void *b)
 
 	if (x->v < y->v) return -1;
 	if (x->v > y->v) return 1;
-	return 0;
+	// 同じ電圧なら (a,b,c) の順。qsort は安定ではないので、
+	// どの環境でも同じテーブルになるように決めておく
+	if (x->a != y->a) return x->a - y->a;
+	if (x->b != y->b) return x->b - y->b;
+	return x->c - y->c;
 }
 
 void
@@ -48,43 +60,6 @@ pte_sort(struct PTE *pt, int count)
 	qsort(pt, count, sizeof(struct PTE), pte_comp_v);
 }
 
-int
-pte_search(struct PTE *pt, int count, double v)
-{
-	int L, R, C;
-	L = 0;
-	R = count - 1;
-
-	while (L < R) {
-		C = (L + R) / 2;
-		double dv = pt[C].v - v;
-		if (dv < 0) {
-			L = C + 1;
-		} else if (dv > 0) {
-			R = C - 1;
-		} else {
-			break;
-		}
-	}
-
-	C = (L + R) / 2;
-	int rv = C;
-	double min_dv = DBL_MAX;
-	L = C - 1;
-	if (L < 0) L = 0;
-	R = C + 1;
-	if (R > count - 1) R = count - 1;
-	for (int i = L; i <= R; i++) {
-
-		double dv = fabs(pt[i].v - v);
-		if (dv < min_dv) {
-			min_dv = dv;
-			rv = i;
-		}
-	}
-	return rv;
-}
-
 double
 pto_stddev(struct PTO *pto, int count)
 {
@@ -102,15 +77,32 @@ pto_stddev(struct PTO *pto, int count)
 	return sqrt(sum / count);
 }
 
+// table は v の昇順で、g も u8 について単調なので、
+// 二分探索せずに前の位置から進めるだけで最も近いものが求まる。
+// 同じ距離なら v の小さい方、同じ v が並ぶときはその先頭。
 void
 pto_make(struct PTO *pto, int pto_count,
 	struct PTE *table, int table_count,
 	double gain, double offset)
 {
-	for (int i = 0; i < pto_count; i++) {
+	int n = 0;
+	for (int k = 0; k < pto_count; k++) {
+		// gain が負なら後ろから回すと g が昇順になる
+		int i = gain < 0 ? pto_count - 1 - k : k;
 		double v = u8_v(i);
 		double g = v * gain + offset;
-		int n = pte_search(table, table_count, g);
+
+		for (;;) {
+			int m = n + 1;
+			while (m < table_count && table[m].v == table[n].v) {
+				m++;
+			}
+			if (m >= table_count ||
+			    fabs(table[m].v - g) >= fabs(table[n].v - g)) {
+				break;
+			}
+			n = m;
+		}
 
 		pto[i].original = v;
 		pto[i].gained = g;
@@ -168,6 +160,127 @@ pto_level(struct PTO *pto, int pto_count)
 	return rv;
 }
 
+/*
+ * 信号での評価
+ * テーブルは u8 の値ごとの写像なので、往復の誤差は信号の u8 の
+ * ヒストグラムだけで決まる。コーパス (-w) かサイン波のスイープの
+ * ヒストグラムを作っておき、点ごとにそれで重みを付けて SNR を求める。
+ */
+double corpus_hist[256];
+double corpus_count;
+
+// u8 の WAV (lunaplay -o WAV の出力) か、ヘッダの無い u8 のファイルを足す
+void
+corpus_add(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		err(1, "%s", path);
+	}
+
+	uint8_t buf[8192];
+	size_t len = fread(buf, 1, 12, fp);
+	if (len == 12 && memcmp(buf, "RIFF", 4) == 0 &&
+	    memcmp(buf + 8, "WAVE", 4) == 0) {
+		// data チャンクまで進める
+		int bits = 0;
+		for (;;) {
+			uint8_t ch[8];
+			if (fread(ch, 1, 8, fp) != 8) {
+				errx(1, "%s: no data chunk", path);
+			}
+			uint32_t size = ch[4] | ch[5] << 8 | ch[6] << 16 |
+				(uint32_t)ch[7] << 24;
+			if (memcmp(ch, "fmt ", 4) == 0 && size >= 16) {
+				uint8_t fmt[16];
+				if (fread(fmt, 1, 16, fp) != 16) {
+					errx(1, "%s: short fmt chunk", path);
+				}
+				bits = fmt[14] | fmt[15] << 8;
+				size -= 16;
+			} else if (memcmp(ch, "data", 4) == 0) {
+				break;
+			}
+			if (fseek(fp, size + (size & 1), SEEK_CUR) != 0) {
+				err(1, "%s", path);
+			}
+		}
+		if (bits != 8) {
+			errx(1, "%s: not 8bit WAV (convert with lunaplay -o WAV)", path);
+		}
+		len = 0;
+	}
+
+	do {
+		for (size_t i = 0; i < len; i++) {
+			corpus_hist[buf[i]]++;
+		}
+		corpus_count += len;
+	} while ((len = fread(buf, 1, sizeof(buf), fp)) > 0);
+	fclose(fp);
+}
+
+// 0, -6, -12, -24 dBFS の対数スイープ (20Hz-10kHz, 22050Hz, 各 10 秒)
+void
+corpus_sweep()
+{
+	const double freq = 22050;
+	const double f0 = 20;
+	const double f1 = 10000;
+	const double dur = 10;
+	const double db[] = { 0, -6, -12, -24 };
+
+	for (int k = 0; k < countof(db); k++) {
+		double amp = pow(10, db[k] / 20);
+		double rate = log(f1 / f0) / dur;
+		for (int i = 0; i < freq * dur; i++) {
+			double t = i / freq;
+			double phase = 2 * M_PI * f0 * (exp(rate * t) - 1) / rate;
+			int u = floor(127.5 + 127.5 * amp * sin(phase) + 0.5);
+			if (u < 0) u = 0;
+			if (u > 255) u = 255;
+			corpus_hist[u]++;
+			corpus_count++;
+		}
+	}
+}
+
+// コーパスでの往復の SNR (dB)。直流の誤差は除く。
+double
+pto_snr(struct PTO *pto, int pto_count, double gain)
+{
+	double n = 0;
+	double sx = 0, sxx = 0;
+	double se = 0, see = 0;
+
+	if (gain <= 0) {
+		return -DBL_MAX;
+	}
+	for (int i = 0; i < pto_count; i++) {
+		double w = corpus_hist[i];
+		if (w == 0) {
+			continue;
+		}
+		double x = pto[i].original;
+		// 出力の電圧を入力の目盛りに戻したときの誤差
+		double e = (pto[i].psg.v - pto[i].gained) / gain;
+		n += w;
+		sx += w * x;
+		sxx += w * x * x;
+		se += w * e;
+		see += w * e * e;
+	}
+	if (n == 0) {
+		return -DBL_MAX;
+	}
+	double sig = sxx / n - (sx / n) * (sx / n);
+	double noise = see / n - (se / n) * (se / n);
+	if (noise <= 0) {
+		return DBL_MAX;
+	}
+	return 10 * log10(sig / noise);
+}
+
 void
 pto_print(struct PTO *pto, int pto_count,
 	const char *table_name,
@@ -188,6 +301,13 @@ pto_print(struct PTO *pto, int pto_count,
 
 	printf("const double %s_gain = %a;\n", table_name, gain);
 	printf("const double %s_offset = %a;\n", table_name, offset);
+	if (pam_phases > 0) {
+		printf("const double %s_duty[] = {", table_name);
+		for (int i = 0; i < pam_phases; i++) {
+			printf("%s %a", i ? "," : "", pam_duty[i]);
+		}
+		printf(" };\n");
+	}
 	printf("const %s %s[] = {\n", table_type, table_name);
 	printf("\t %*s/* u8 v : gained : out v */\n", channel_count * 2 + 3, "");
 
@@ -215,6 +335,10 @@ pto_print(struct PTO *pto, int pto_count,
 		pto_centerfactor(pto, pto_count));
 	printf("\t/* level=%d */\n",
 		pto_level(pto, pto_count));
+	if (corpus_count > 0) {
+		printf("\t/* snr=%g dB */\n",
+			pto_snr(pto, pto_count, gain));
+	}
 
 	printf("};\n");
 }
@@ -265,13 +389,81 @@ pcm3()
 	pte_sort(PCM3, countof(PCM3));
 }
 
+// フィルタが比べる点の評価値
+struct metric {
+	int level;
+	double cf;
+	double snr;
+};
+
+/*
+ * PAM は 1 チャンネルの音量を相ごとに切り替える時分割なので、
+ * 出る電圧は各相の電圧を時間で重み付けした平均になる。
+ * 相の比はファームウェアの OUT の間隔で決まる。
+ *   xppcm.asm     PAM2 1:1, PAM3 1:1:1 (OUT (C),r の 13 クロックずつ)
+ *   psgpam48.txt  7:9
+ * 比が等しくなければ相の順番で電圧が変わるので、並べ替えも別の点になる。
+ */
+void
+pam(struct PTE *pt, int phases)
+{
+	int count = 1 << (4 * phases);
+
+	for (int i = 0; i < count; i++) {
+		int x[3] = { 0, 0, 0 };
+		double v = 0;
+		// 上位のニブルが最初の相
+		for (int k = 0; k < phases; k++) {
+			x[k] = (i >> (4 * (phases - 1 - k))) & 15;
+			v += pam_duty[k] * PSG_VT[x[k]];
+		}
+		pt[i].v = v;
+		pt[i].a = x[0];
+		pt[i].b = x[1];
+		pt[i].c = x[2];
+	}
+
+	pte_sort(pt, count);
+}
+
+// "7:9" のような比を pam_duty に入れる
+void
+parse_duty(const char *arg, int phases)
+{
+	double sum = 0;
+	const char *p = arg;
+	char *endp;
+
+	for (int k = 0; k < phases; k++) {
+		pam_duty[k] = strtod(p, &endp);
+		if (endp == p || pam_duty[k] <= 0 ||
+		    *endp != (k == phases - 1 ? '\0' : ':')) {
+			errx(1, "duty: %s (need %d ratios)", arg, phases);
+		}
+		sum += pam_duty[k];
+		p = endp + 1;
+	}
+	for (int k = 0; k < phases; k++) {
+		pam_duty[k] /= sum;
+	}
+}
+
 static double min_cf = DBL_MAX;
 static int max_level = 0;
+static double max_snr = -DBL_MAX;
+
+void
+filter_reset()
+{
+	min_cf = DBL_MAX;
+	max_level = 0;
+	max_snr = -DBL_MAX;
+}
 
 int
-filter_c(struct PTO *pto, int pto_count)
+filter_c(const struct metric *mt)
 {
-	double cf = pto_centerfactor(pto, pto_count);
+	double cf = mt->cf;
 	if (cf < min_cf) {
 		min_cf = cf;
 		return -1;
@@ -283,9 +475,9 @@ filter_c(struct PTO *pto, int pto_count)
 }
 
 int
-filter_l(struct PTO *pto, int pto_count)
+filter_l(const struct metric *mt)
 {
-	int level = pto_level(pto, pto_count);
+	int level = mt->level;
 	if (level > max_level) {
 		max_level = level;
 		return -1;
@@ -297,29 +489,181 @@ filter_l(struct PTO *pto, int pto_count)
 }
 
 int
-filter_cl(struct PTO *pto, int pto_count)
+filter_cl(const struct metric *mt)
 {
-	int r = filter_c(pto, pto_count);
+	int r = filter_c(mt);
 	if (r) {
 		if (r < 0) max_level = 0;
-		return filter_l(pto, pto_count);
+		return filter_l(mt);
 	}
 	return 0;
 }
 
 int
-filter_lc(struct PTO *pto, int pto_count)
+filter_lc(const struct metric *mt)
 {
-	int r = filter_l(pto, pto_count);
+	int r = filter_l(mt);
 	if (r) {
 		if (r < 0) min_cf = DBL_MAX;
-		return filter_c(pto, pto_count);
+		return filter_c(mt);
 	}
 	return 0;
 }
 
-typedef int (*FILTER)(struct PTO *pto, int pto_count);
+// コーパスでの SNR が大きいもの
+int
+filter_snr(const struct metric *mt)
+{
+	if (mt->snr > max_snr) {
+		max_snr = mt->snr;
+		return -1;
+	} else if (mt->snr == max_snr) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+typedef int (*FILTER)(const struct metric *mt);
+
+/*
+ * グリッド探索
+ * 各点の評価値 (level, center-factor, SNR) をスレッドで並列に求めて、
+ * フィルタはそれを逐次と同じ順に流す。フィルタは状態を持ち、
+ * 同点なら後の点を選ぶので、順番を変えると結果が変わる。
+ * メモリを抑えるため GRID_ROWS 行ずつ処理する。
+ */
+#define GRID_ROWS	(256)
+
+struct grid {
+	struct PTE *table;
+	int count;
+	double gain;
+	double offset;
+	double gainshift;
+	double offsetshift;
+	int m;
+	int n;
+	int row0;			// このバッチの最初の行 (-m から)
+	int nrows;
+	atomic_int next;
+	struct metric *mt;	// [nrows][2n+1]
+};
+
+void *
+grid_main(void *arg)
+{
+	struct grid *gr = arg;
+	struct PTO pto[256];
+	int cols = 2 * gr->n + 1;
+
+	for (;;) {
+		int r = atomic_fetch_add(&gr->next, 1);
+		if (r >= gr->nrows) {
+			break;
+		}
+		int i = gr->row0 + r;
+		double g = gr->gain + gr->gainshift * i / gr->m;
+		for (int j = -gr->n; j <= gr->n; j++) {
+			double o = gr->offset + gr->offsetshift * j / gr->n;
+			pto_make(pto, countof(pto), gr->table, gr->count, g, o);
+			struct metric *mt = &gr->mt[r * cols + j + gr->n];
+			mt->level = pto_level(pto, countof(pto));
+			mt->cf = pto_centerfactor(pto, countof(pto));
+			mt->snr = corpus_count > 0 ? pto_snr(pto, countof(pto), g) : 0;
+		}
+	}
+	return NULL;
+}
+
+void
+grid_search(struct PTE *table, int count, FILTER filter, int nthreads,
+	double *gain, double *offset, double gainshift, double offsetshift,
+	int m, int n)
+{
+	struct grid gr;
+	int cols = 2 * n + 1;
+	pthread_t th[nthreads];
+
+	gr.table = table;
+	gr.count = count;
+	gr.gain = *gain;
+	gr.offset = *offset;
+	gr.gainshift = gainshift;
+	gr.offsetshift = offsetshift;
+	gr.m = m;
+	gr.n = n;
+	gr.mt = malloc(GRID_ROWS * cols * sizeof(struct metric));
+	if (gr.mt == NULL) {
+		err(1, "malloc");
+	}
+
+	double best_g = *gain - gainshift;
+	double best_o = *offset - offsetshift;
+	for (int row0 = -m; row0 <= m; row0 += GRID_ROWS) {
+		gr.row0 = row0;
+		gr.nrows = m - row0 + 1;
+		if (gr.nrows > GRID_ROWS) {
+			gr.nrows = GRID_ROWS;
+		}
+		atomic_init(&gr.next, 0);
+		for (int t = 0; t < nthreads; t++) {
+			if (pthread_create(&th[t], NULL, grid_main, &gr) != 0) {
+				errx(1, "pthread_create");
+			}
+		}
+		for (int t = 0; t < nthreads; t++) {
+			pthread_join(th[t], NULL);
+		}
+
+		for (int r = 0; r < gr.nrows; r++) {
+			int i = row0 + r;
+			for (int j = -n; j <= n; j++) {
+				if (filter(&gr.mt[r * cols + j + n])) {
+					best_g = *gain + gainshift * i / m;
+					best_o = *offset + offsetshift * j / n;
+				}
+			}
+		}
+	}
+	free(gr.mt);
+	*gain = best_g;
+	*offset = best_o;
+}
+
+/*
+ * coarse-to-fine
+ * 粗いグリッドで一番良い点を中心に、範囲を 1/C2F_SHRINK にして
+ * stages 回探し直す。範囲は前の刻みの ±(m/C2F_SHRINK) 個分になるので、
+ * m, n が C2F_SHRINK より大きければ前の最良点の両隣を含む。
+ * 各段はグリッド探索と同じなので、結果はスレッド数によらない。
+ */
+#define C2F_SHRINK	(4)
+
+void
+c2f_search(struct PTE *table, int count, FILTER filter, int nthreads,
+	double *gain, double *offset, double gainshift, double offsetshift,
+	int m, int n, int stages)
+{
+	for (int s = 0; s <= stages; s++) {
+		filter_reset();
+		grid_search(table, count, filter, nthreads, gain, offset,
+			gainshift, offsetshift, m, n);
+		gainshift /= C2F_SHRINK;
+		offsetshift /= C2F_SHRINK;
+	}
+}
 
+/*
+ * gentbl [options] [PCM1|PCM2|PCM3|PAM2|PAM3]
+ *  -g gain, -o offset   中心 (-a なしならそのまま使う)
+ *  -a                   グリッド探索 (gain ±G を ±m, offset ±O を ±n 分割)
+ *  -c stages            coarse-to-fine で範囲を狭めて stages 回探し直す
+ *  -f L|C|LC|CL|SNR     評価。SNR はコーパスでの往復の SNR
+ *  -w file              コーパスに u8 の WAV/raw を足す (無ければスイープ)
+ *  -j threads           探索のスレッド数 (default: CPU 数)
+ *  -d w0:w1[:w2]        PAM2/PAM3 の各相の時間の比 (default 1:1, 1:1:1)
+ */
 int
 main(int ac, char *av[])
 {
@@ -330,12 +674,15 @@ main(int ac, char *av[])
 	int opt_a = 0;
 	int opt_m = 1000;
 	int opt_n = 10;
+	int nthreads = 0;
+	int stages = 0;
+	const char *duty = NULL;
 	FILTER filter = filter_lc;
 
 	gain = 1;
 	offset = 0;
 
-	while ((c = getopt(ac, av, "f:am:n:G:O:g:o:")) != -1) {
+	while ((c = getopt(ac, av, "c:d:f:aj:m:n:w:G:O:g:o:")) != -1) {
 		switch (c) {
 		 case 'f':
 			if (strcasecmp(optarg, "L") == 0) {
@@ -346,6 +693,8 @@ main(int ac, char *av[])
 				filter = filter_lc;
 			} else if (strcasecmp(optarg, "CL") == 0) {
 				filter = filter_cl;
+			} else if (strcasecmp(optarg, "SNR") == 0) {
+				filter = filter_snr;
 			} else {
 				errx(1, "filter");
 			}
@@ -353,6 +702,18 @@ main(int ac, char *av[])
 		 case 'a':
 			opt_a++;
 			break;
+		 case 'c':
+			stages = atoi(optarg);
+			break;
+		 case 'd':
+			duty = optarg;
+			break;
+		 case 'w':
+			corpus_add(optarg);
+			break;
+		 case 'j':
+			nthreads = atoi(optarg);
+			break;
 		 case 'm':
 			opt_m = atoi(optarg);
 			break;
@@ -386,13 +747,41 @@ main(int ac, char *av[])
 	if (opt_n <= 0) {
 		errx(1, "n");
 	}
+	if (stages < 0) {
+		errx(1, "c");
+	}
+	if (filter == filter_snr && corpus_count == 0) {
+		corpus_sweep();
+	}
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads < 1) {
+			nthreads = 1;
+		}
+	}
 
 	struct PTE *table;
 	int count;
 	const char *name;
 	int channel_count;
 
-	if (strcasecmp(arg, "PCM2") == 0) {
+	if (strcasecmp(arg, "PAM2") == 0) {
+		pam_phases = 2;
+		parse_duty(duty ? duty : "1:1", pam_phases);
+		pam(PAM2, pam_phases);
+		table = PAM2;
+		count = countof(PAM2);
+		name = "PAM2_TABLE";
+		channel_count = 2;
+	} else if (strcasecmp(arg, "PAM3") == 0) {
+		pam_phases = 3;
+		parse_duty(duty ? duty : "1:1:1", pam_phases);
+		pam(PAM3, pam_phases);
+		table = PAM3;
+		count = countof(PAM3);
+		name = "PAM3_TABLE";
+		channel_count = 3;
+	} else if (strcasecmp(arg, "PCM2") == 0) {
 		pcm2();
 		table = PCM2;
 		count = countof(PCM2);
@@ -414,23 +803,8 @@ main(int ac, char *av[])
 
 	struct PTO pto[256];
 	if (opt_a) {
-		double best_g, best_o;
-		best_g = gain - gainshift;
-		best_o = offset - offsetshift;
-
-		for (int i = -opt_m; i <= opt_m; i++) {
-			double g = gain + gainshift * i / opt_m;
-			for (int j = -opt_n; j <= opt_n; j++) {
-				double o = offset + offsetshift * j / opt_n;
-				pto_make(pto, countof(pto), table, count, g, o);
-				if (filter(pto, countof(pto))) {
-					best_g = g;
-					best_o = o;
-				}
-			}
-		}
-		gain = best_g;
-		offset = best_o;
+		c2f_search(table, count, filter, nthreads, &gain, &offset,
+			gainshift, offsetshift, opt_m, opt_n, stages);
 	}
 
 	pto_make(pto, countof(pto), table, count, gain, offset);
@@ -0,0 +1,277 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* liblunaplay: streaming encode and XP playback */
+
+/*
+ * 渡されたサンプルは、中間のバッファを通さずに psgconv の変換で
+ * XP の共有メモリのページ (xp_page) に直接書き込む。ページが埋まったら
+ * xp_commit で XP に渡す。最後の半端なページは lunaplay_drain で
+ * 最後のサンプルで埋めて渡す。
+ *
+ * ADPT (ページ全体を見てフォーマットを選ぶ) と trellis (先を見て
+ * 量子化する) はページを書きながら変換できないので、ここでは扱わない。
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+#include "liblunaplay.h"
+
+// ページの空きを待つ間隔
+#define LUNAPLAY_POLL_USEC	(1000)
+
+// lunaplay_write_s16 で一度に u8 にする数
+#define LUNAPLAY_S16CHUNK	(1024)
+
+struct LUNAPLAY_T {
+	char *firmware;			// NULL なら内蔵のもの
+	struct xp *xp;
+	int enc;
+	int stride;
+	CONVERTER conv;
+	uint8_t *page;			// 書きかけのページ (NULL なら無し)
+	size_t fill;			// page に書いたバイト数
+	bool written;			// 一度でも書いた
+};
+
+static const struct {
+	int enc;
+	CONVERTER conv;
+} lunaplay_convs[] = {
+	{ ENC_PCM1, conv_u8_pcm1 },
+	{ ENC_PCM2, conv_u8_pcm2 },
+	{ ENC_PCM3, conv_u8_pcm3 },
+	{ ENC_PAM2, conv_u8_pam2 },
+	{ ENC_PAM3, conv_u8_pam3 },
+};
+
+/*
+ XP で鳴らす準備をします。firmware はファームウェアのファイル名で、
+ NULL なら内蔵のものを使います。デバイスは lunaplay_set_format で開きます。
+ */
+LUNAPLAY *
+lunaplay_open(const char *firmware)
+{
+	LUNAPLAY *lp = calloc(1, sizeof(LUNAPLAY));
+	if (lp == NULL) {
+		return NULL;
+	}
+	if (firmware != NULL) {
+		lp->firmware = strdup(firmware);
+		if (lp->firmware == NULL) {
+			free(lp);
+			return NULL;
+		}
+	}
+	return lp;
+}
+
+/*
+ エンコーディング enc (LUNAPLAY_PCM1 .. LUNAPLAY_PAM3) と周波数 freq を
+ 設定して XP を開きます。最初の lunaplay_write の前に呼ぶこと。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+lunaplay_set_format(LUNAPLAY *lp, int enc, int freq)
+{
+	CONVERTER conv = NULL;
+
+	if (lp->written) {
+		errno = EBUSY;
+		return -1;
+	}
+	for (int i = 0; i < countof(lunaplay_convs); i++) {
+		if (lunaplay_convs[i].enc == enc) {
+			conv = lunaplay_convs[i].conv;
+		}
+	}
+	if (conv == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (lp->xp != NULL) {
+		xp_close(lp->xp);
+		lp->xp = NULL;
+	}
+	lp->xp = xp_open(lp->firmware, enc, freq, LUNAPLAY_POLL_USEC);
+	if (lp->xp == NULL) {
+		return -1;
+	}
+	lp->enc = enc;
+	lp->stride = enc_stride(enc);
+	lp->conv = conv;
+	return 0;
+}
+
+/*
+ XP の実際の再生周波数を返します。
+ */
+double
+lunaplay_rate(LUNAPLAY *lp)
+{
+	if (lp->xp == NULL) {
+		return 0;
+	}
+	return xp_rate(lp->xp);
+}
+
+/*
+ 符号なし 8bit のサンプルを count 個、変換して XP に渡します。
+ ページの空きを待ちますが、LUNAPLAY_NONBLOCK なら待たずに書けただけで
+ 戻ります。
+ 渡したサンプル数を返します。エラーなら -1 を返します
+ (LUNAPLAY_NONBLOCK で 1 つも書けなければ EAGAIN、XP のエラーは EIO)。
+ */
+ssize_t
+lunaplay_write(LUNAPLAY *lp, const uint8_t *samples, size_t count, int flags)
+{
+	size_t done = 0;
+	int waits;
+
+	if (lp->xp == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	lp->written = true;
+
+	while (done < count) {
+		if (lp->page == NULL) {
+			lp->page = xp_page(lp->xp, (flags & LUNAPLAY_NONBLOCK) == 0,
+				&waits);
+			if (lp->page == NULL) {
+				if (errno != EAGAIN) {
+					return -1;
+				}
+				break;
+			}
+			lp->fill = 0;
+		}
+
+		// ページの残りに入るだけ、ページに直接変換する
+		size_t n = (XP_BUFSIZE - lp->fill) / lp->stride;
+		if (n > count - done) {
+			n = count - done;
+		}
+		BUFFER src;
+		BUFFER dst;
+		memset(&src, 0, sizeof(src));
+		memset(&dst, 0, sizeof(dst));
+		src.ptr = (uint8_t *)samples + done;
+		src.length = n;
+		src.bufsize = n;
+		dst.ptr = lp->page + lp->fill;
+		dst.bufsize = XP_BUFSIZE - lp->fill;
+		lp->conv(&dst, &src);
+		lp->fill += dst.length;
+		done += n;
+
+		if (lp->fill == XP_BUFSIZE) {
+			lp->page = NULL;
+			if (xp_commit(lp->xp, XP_BUFSIZE / lp->stride) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	if (done == 0 && count > 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return done;
+}
+
+/*
+ 符号付き 16bit のサンプルを count 個、変換して XP に渡します。
+ 下位 8bit は捨てます。ほかは lunaplay_write と同じです。
+ */
+ssize_t
+lunaplay_write_s16(LUNAPLAY *lp, const int16_t *samples, size_t count,
+	int flags)
+{
+	uint8_t u8[LUNAPLAY_S16CHUNK];
+	size_t done = 0;
+
+	while (done < count) {
+		size_t n = count - done;
+		if (n > sizeof(u8)) {
+			n = sizeof(u8);
+		}
+		for (size_t i = 0; i < n; i++) {
+			u8[i] = ((uint16_t)samples[done + i] >> 8) ^ 0x80;
+		}
+		ssize_t r = lunaplay_write(lp, u8, n, flags);
+		if (r < 0) {
+			if (done > 0 && errno == EAGAIN) {
+				break;
+			}
+			return -1;
+		}
+		done += r;
+		if (r < n) {
+			break;
+		}
+	}
+	return done;
+}
+
+/*
+ 再生したサンプル数の見積もりを返します。
+ */
+int64_t
+lunaplay_position(LUNAPLAY *lp)
+{
+	if (lp->xp == NULL) {
+		return 0;
+	}
+	return xp_position(lp->xp);
+}
+
+/*
+ 渡したサンプルをすべて鳴らし終えるまで待ちます。その後は無音になり、
+ また lunaplay_write で続けられます。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+lunaplay_drain(LUNAPLAY *lp)
+{
+	if (lp->xp == NULL) {
+		return 0;
+	}
+	if (lp->page != NULL && lp->fill > 0) {
+		// 半端なページは最後のサンプルで埋める
+		BUFFER buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.ptr = lp->page;
+		buf.bufsize = XP_BUFSIZE;
+		buf.length = lp->fill;
+		filltail(&buf, lp->stride);
+		lp->page = NULL;
+		if (xp_commit(lp->xp, lp->fill / lp->stride) < 0) {
+			return -1;
+		}
+	}
+	lp->page = NULL;
+	return xp_drain(lp->xp);
+}
+
+/*
+ 残りを鳴らし終えてから XP を閉じ、lp を解放します。
+ 成功すれば 0、drain に失敗すれば -1 を返します (lp は解放します)。
+ */
+int
+lunaplay_close(LUNAPLAY *lp)
+{
+	int r = 0;
+
+	if (lp->xp != NULL) {
+		r = lunaplay_drain(lp);
+		xp_close(lp->xp);
+	}
+	free(lp->firmware);
+	free(lp);
+	return r;
+}
@@ -0,0 +1,50 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* liblunaplay: PSG PCM playback on the LUNA XP */
+
+/*
+ * アプリケーションから直接 XP で鳴らすためのライブラリ。
+ * サンプル (符号なし 8bit か符号付き 16bit, モノラル) を渡すと、
+ * PSG の PCM に変換しながら XP の共有メモリのページに直接書く。
+ *
+ *	LUNAPLAY *lp = lunaplay_open(NULL);
+ *	lunaplay_set_format(lp, LUNAPLAY_PCM3, 22050);
+ *	while (...)
+ *		lunaplay_write(lp, samples, count, 0);
+ *	lunaplay_drain(lp);
+ *	lunaplay_close(lp);
+ *
+ * 状態はすべて LUNAPLAY にあるが、XP は 1 つしかないので同時に
+ * 開けるのは 1 つだけ。1 つの LUNAPLAY を複数のスレッドから同時に
+ * 使わないこと。
+ * エラーは -1 (ポインタなら NULL) を返して errno を設定する。
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct LUNAPLAY_T LUNAPLAY;
+
+/* encodings (same as PSGPCM) */
+#define LUNAPLAY_PCM1	(0x41)
+#define LUNAPLAY_PCM2	(0x42)
+#define LUNAPLAY_PCM3	(0x43)
+#define LUNAPLAY_PAM2	(0x44)
+#define LUNAPLAY_PAM3	(0x45)
+
+/* lunaplay_write flags */
+#define LUNAPLAY_NONBLOCK	(1 << 0)	// don't wait for a free page
+
+extern LUNAPLAY *lunaplay_open(const char *firmware);
+extern int lunaplay_set_format(LUNAPLAY *lp, int enc, int freq);
+extern double lunaplay_rate(LUNAPLAY *lp);
+extern ssize_t lunaplay_write(LUNAPLAY *lp, const uint8_t *samples,
+	size_t count, int flags);
+extern ssize_t lunaplay_write_s16(LUNAPLAY *lp, const int16_t *samples,
+	size_t count, int flags);
+extern int64_t lunaplay_position(LUNAPLAY *lp);
+extern int lunaplay_drain(LUNAPLAY *lp);
+extern int lunaplay_close(LUNAPLAY *lp);
@@ -0,0 +1,212 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* looped playback from a resident buffer */
+
+/*
+ * 入力を最初に一度だけ全部変換してメモリに置き、そこから繰り返し出力する。
+ * 2 周目以降はファイルを読まないし、変換もしない。
+ *
+ * WAV の smpl チャンクにループポイントがあれば、
+ *   先頭 .. loopend を 1 回、loopstart .. loopend を残りの回数、
+ *   最後に loopend .. 末尾 (リリース部分)
+ * の順に出力する。無ければ全体を繰り返す。
+ *
+ * ループの継ぎ目ではページの途中でも次の周のデータで埋めるので、
+ * filltail するのは本当の終端だけ。
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+
+// 常駐させる変換済みデータの上限
+#define LOOP_MAXBYTES	(64 * 1024 * 1024)
+
+struct loop {
+	uint8_t *mem;		// 変換済みデータ
+	size_t len;
+	size_t pos;
+	size_t loopstart;	// バイト位置
+	size_t loopend;		// バイト位置 (この手前までがループ)
+	int remain;			// ループ部分の残り回数 (<0 なら無限)
+};
+
+// 入力をすべて変換して mem に置く
+static
+int
+loop_load(struct loop *lp, DESC *in, CONVERTER conv, size_t srcsize)
+{
+	BUFFER src0, *src = &src0;
+	BUFFER dst0, *dst = &dst0;
+	size_t cap = 0;
+	int rv = -1;
+
+	memset(src, 0, sizeof(*src));
+	memset(dst, 0, sizeof(*dst));
+	src->bufsize = srcsize;
+	src->ptr = malloc(src->bufsize);
+	src->isfree = true;
+	dst->bufsize = XP_BUFSIZE;
+	dst->ptr = malloc(dst->bufsize);
+	dst->isfree = true;
+	if (src->ptr == NULL || dst->ptr == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		goto done;
+	}
+
+	for (;;) {
+		src->length = 0;
+		dst->length = 0;
+		uint64_t t = trace_begin();
+		int r = in->reader(in, src);
+		trace_end(TRACE_READ, t);
+		if (r < 0) {
+			fprintf(stderr, "read error %s\n", strerror(errno));
+			goto done;
+		}
+		if (r == 0) {
+			break;
+		}
+		BUFFER *d = dst;
+		if (conv == conv_pass) {
+			d = src;
+		} else {
+			t = trace_begin();
+			conv(dst, src);
+			trace_end(TRACE_CONV, t);
+		}
+		if (lp->len + d->length > LOOP_MAXBYTES) {
+			fprintf(stderr, "input too long for loop buffer (max %d bytes)\n",
+				LOOP_MAXBYTES);
+			goto done;
+		}
+		if (lp->len + d->length > cap) {
+			size_t n = cap ? cap * 2 : 1024 * 1024;
+			while (n < lp->len + d->length) {
+				n *= 2;
+			}
+			uint8_t *p = realloc(lp->mem, n);
+			if (p == NULL) {
+				fprintf(stderr, "realloc: %s\n", strerror(errno));
+				goto done;
+			}
+			lp->mem = p;
+			cap = n;
+		}
+		memcpy(lp->mem + lp->len, d->ptr, d->length);
+		lp->len += d->length;
+	}
+	rv = 0;
+
+ done:
+	buffer_free(src);
+	buffer_free(dst);
+	return rv;
+}
+
+// buf を満たすまで (または終端まで) ループを展開して詰める
+static
+void
+loop_fill(struct loop *lp, BUFFER *buf)
+{
+	while (buf->length < buf->bufsize) {
+		if (lp->pos == lp->loopend && lp->remain != 0) {
+			// 継ぎ目
+			lp->pos = lp->loopstart;
+			if (lp->remain > 0) {
+				lp->remain--;
+			}
+		}
+		size_t limit = lp->remain != 0 ? lp->loopend : lp->len;
+		size_t n = limit - lp->pos;
+		if (n == 0) {
+			break;
+		}
+		if (n > buf->bufsize - buf->length) {
+			n = buf->bufsize - buf->length;
+		}
+		memcpy(buf->ptr + buf->length, lp->mem + lp->pos, n);
+		buf->length += n;
+		lp->pos += n;
+	}
+}
+
+/*
+ in を変換して out に loops 回 (<0 なら無限に) 出力します。
+ fillstride が 0 でなければ、最後のバッファをそのストライドで埋めます。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+loop_run(DESC *in, DESC *out, CONVERTER conv, size_t srcsize, int loops,
+	int fillstride)
+{
+	struct loop lp0, *lp = &lp0;
+	BUFFER buf0, *buf = &buf0;
+	int stride = enc_stride(out->enc);
+	int rv = -1;
+
+	memset(lp, 0, sizeof(*lp));
+	memset(buf, 0, sizeof(*buf));
+
+	if (loops == 0) {
+		return 0;
+	}
+	if (loop_load(lp, in, conv, srcsize) < 0) {
+		goto done;
+	}
+	if (lp->len == 0) {
+		rv = 0;
+		goto done;
+	}
+
+	lp->loopstart = 0;
+	lp->loopend = lp->len;
+	if (in->loopend > in->loopstart &&
+	    in->loopend * stride <= lp->len) {
+		lp->loopstart = in->loopstart * stride;
+		lp->loopend = in->loopend * stride;
+	}
+	// 1 周目はループの頭までも含むので、残りは loops - 1 回
+	lp->remain = loops < 0 ? -1 : loops - 1;
+	if (opt_v) {
+		printf("loop %d times, %zu bytes, loop %zu-%zu\n",
+			loops, lp->len, lp->loopstart, lp->loopend);
+	}
+
+	buf->bufsize = XP_BUFSIZE;
+	buf->ptr = malloc(buf->bufsize);
+	buf->isfree = true;
+	if (buf->ptr == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		goto done;
+	}
+
+	for (;;) {
+		buf->length = 0;
+		loop_fill(lp, buf);
+		if (buf->length == 0) {
+			break;
+		}
+		if (fillstride && buf->length < buf->bufsize) {
+			// 本当の終端
+			filltail(buf, fillstride);
+		}
+		uint64_t t = trace_begin();
+		int r = out->writer(out, buf);
+		trace_end(TRACE_WRITE, t);
+		if (r < 0) {
+			fprintf(stderr, "write error %s\n", strerror(errno));
+			goto done;
+		}
+	}
+	rv = 0;
+
+ done:
+	free(lp->mem);
+	buffer_free(buf);
+	return rv;
+}
@@ -0,0 +1,754 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* lunaplay benchmark */
+
+/*
+ * 合成した信号 (サイン, スイープ, ノイズ, 無音) を u8 で作り、
+ * - 各 WAV の形式 (u8, s16, s24, s32, float, IMA ADPCM) に書いて
+ *   reader で u8 に戻す速さと、元の u8 との誤差
+ * - psgconv.c の各 CONVERTER (と trellis) で u8 -> PSG -> u8 と往復する
+ *   速さと、元の u8 との SNR / 最大誤差
+ * を計る。-o で結果を JSON に書き、-b で前の JSON と比べて
+ * 悪くなっていれば終了コード 1 で終わる。
+ *
+ * 1 回の計測は短すぎて揺れるので、どれも -T 秒かつ 3 回以上繰り返し、
+ * いちばん速かった回の速さを取る。マシンが遅くなっている時間に
+ * 当たっても良いように、全体を -n 周して各計測のいちばん速い周を取る。
+ *
+ * JSON は 1 結果 1 行で書くので、比べるときは行ごとに読む。
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "lunaplay.h"
+#include "filehelper.h"
+#include "psgconv.h"
+
+/* global */
+int opt_v;
+
+static int opt_sec = 60;		// 試験データの長さ(秒)
+static int opt_freq = 22050;	// 試験データの周波数
+static int opt_ch = 1;			// 試験データのチャンネル数
+static double opt_snrtol = 0.01;	// 許す SNR の低下 (dB)
+static double opt_ratetol = 20;		// 許す速さの低下 (%)
+static double opt_mintime = 0.05;	// 1 つの計測を繰り返す時間 (秒)
+static int opt_rounds = 5;			// 全体を繰り返す周回数
+static bool bench_last;				// 最後の周 (結果を表示する)
+
+// 1 つの計測を繰り返す最低の回数
+#define BENCH_MINRUNS	(3)
+
+// 試験信号
+enum {
+	SIG_SINE,
+	SIG_SWEEP,
+	SIG_NOISE,
+	SIG_SILENCE,
+	SIG_MAX,
+};
+static const char *sig_names[SIG_MAX] = {
+	"sine", "sweep", "noise", "silence",
+};
+
+// 1 つの計測の結果
+struct result {
+	char kind[16];			// "reader" か "conv"
+	char name[32];
+	char signal[16];
+	double rate;			// samples/s (conv は u8 -> PSG)
+	double rate2;			// conv の PSG -> u8 (samples/s)
+	double snr;				// dB (求まらなければ NAN)
+	int maxerr;				// u8 の段数 (求まらなければ -1)
+};
+
+#define MAXRESULTS	(256)
+static struct result results[MAXRESULTS];
+static int nresults;
+
+static
+double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+int
+mktmp()
+{
+	char template[] = "/tmp/lpbench.XXXXXX";
+	int fd = mkstemp(template);
+	if (fd == -1) {
+		err(EXIT_FAILURE, "mkstemp");
+	}
+	unlink(template);
+	return fd;
+}
+
+static
+void
+write_wavhdr(int fd, int fmtid, int ch, int blockalign, int bits,
+	const uint8_t *ext, int extlen, uint32_t datalen)
+{
+	int r =
+	writetag(fd, "RIFF") &&
+	write32le(fd, 4 + 8 + 16 + extlen + 8 + datalen) &&
+	writetag(fd, "WAVE") &&
+	writetag(fd, "fmt ") &&
+	write32le(fd, 16 + extlen) &&
+	write16le(fd, fmtid) &&
+	write16le(fd, ch) &&
+	write32le(fd, opt_freq) &&
+	write32le(fd, opt_freq * blockalign) &&
+	write16le(fd, blockalign) &&
+	write16le(fd, bits) &&
+	(extlen == 0 || writebuf(fd, (uint8_t *)ext, extlen) == extlen) &&
+	writetag(fd, "data") &&
+	write32le(fd, datalen)
+	;
+	if (!r) {
+		err(EXIT_FAILURE, "write");
+	}
+}
+
+// u8 の信号を作る
+static
+void
+make_signal(uint8_t *u, int n, int kind)
+{
+	double f0 = 20;
+	double f1 = opt_freq / 2;
+	double rate = log(f1 / f0) / ((double)n / opt_freq);
+
+	srandom(1);
+	for (int i = 0; i < n; i++) {
+		double t = (double)i / opt_freq;
+		double v;
+		switch (kind) {
+		 case SIG_SINE:
+			// 1kHz -1dBFS
+			v = 0.891 * sin(2 * M_PI * 1000 * t);
+			break;
+		 case SIG_SWEEP:
+			// 20Hz から fs/2 までの対数スイープ -6dBFS
+			v = 0.501 * sin(2 * M_PI * f0 * (exp(rate * t) - 1) / rate);
+			break;
+		 case SIG_NOISE:
+			v = (random() % 65536) / 32768.0 - 1;
+			break;
+		 default:
+			v = 0;
+			break;
+		}
+		int x = floor(v * 127.5 + 128);
+		if (x < 0) x = 0;
+		if (x > 255) x = 255;
+		u[i] = x;
+	}
+}
+
+// u8 の信号を bits の PCM (fmtid 3 なら float) の WAV にする。
+// reader が上位バイトを取れば元の u8 に戻るように、下位は適当に埋める。
+static
+int
+make_wav(const uint8_t *u, int frames, int fmtid, int bits)
+{
+	int fd = mktmp();
+	int bps = bits / 8;
+	int len = frames * bps * opt_ch;
+	uint8_t *buf = malloc(len);
+	if (buf == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	uint8_t *d = buf;
+	for (int i = 0; i < frames; i++) {
+		int x = u[i];
+		for (int c = 0; c < opt_ch; c++) {
+			if (bits == 8) {
+				*d++ = x;
+			} else if (fmtid == 3) {
+				float f = (x - 128) / 128.0f;
+				uint32_t v;
+				memcpy(&v, &f, sizeof(v));
+				for (int k = 0; k < 4; k++) {
+					*d++ = v >> (8 * k);
+				}
+			} else {
+				for (int k = 0; k < bps - 1; k++) {
+					*d++ = random();
+				}
+				*d++ = x ^ 0x80;
+			}
+		}
+	}
+	write_wavhdr(fd, fmtid, opt_ch, bps * opt_ch, bits, NULL, 0, len);
+	writebuf(fd, buf, len);
+	free(buf);
+	return fd;
+}
+
+// IMA ADPCM の試験データ。ニブル列はランダムで良い。
+static
+int
+make_ima(int frames)
+{
+	int fd = mktmp();
+	int blockalign = 256 * opt_ch;
+	int spb = (blockalign - 4 * opt_ch) * 2 / opt_ch + 1;
+	int blocks = (frames + spb - 1) / spb;
+	int len = blocks * blockalign;
+	uint8_t *buf = malloc(len);
+	if (buf == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (int i = 0; i < len; i++) {
+		buf[i] = random();
+	}
+	for (int b = 0; b < blocks; b++) {
+		for (int c = 0; c < opt_ch; c++) {
+			uint8_t *h = buf + b * blockalign + 4 * c;
+			h[2] = random() % 89;
+			h[3] = 0;
+		}
+	}
+	uint8_t ext[4] = { 2, 0, spb & 0xff, spb >> 8 };
+	write_wavhdr(fd, 0x11, opt_ch, blockalign, 4, ext, sizeof(ext), len);
+	writebuf(fd, buf, len);
+	free(buf);
+	return fd;
+}
+
+static
+struct result *
+add_result(const char *kind, const char *name, const char *signal)
+{
+	// 前の周の結果があればそれに足す
+	for (int i = 0; i < nresults; i++) {
+		struct result *rs = &results[i];
+		if (strcmp(rs->kind, kind) == 0 && strcmp(rs->name, name) == 0 &&
+		    strcmp(rs->signal, signal) == 0) {
+			return rs;
+		}
+	}
+	if (nresults >= MAXRESULTS) {
+		errx(EXIT_FAILURE, "too many results");
+	}
+	struct result *rs = &results[nresults++];
+	memset(rs, 0, sizeof(*rs));
+	strlcpy(rs->kind, kind, sizeof(rs->kind));
+	strlcpy(rs->name, name, sizeof(rs->name));
+	strlcpy(rs->signal, signal, sizeof(rs->signal));
+	rs->snr = NAN;
+	rs->maxerr = -1;
+	return rs;
+}
+
+// ref と out の n サンプルの SNR と最大誤差
+static
+void
+compare_u8(struct result *rs, const uint8_t *ref, const uint8_t *out, int64_t n)
+{
+	double sx = 0, sxx = 0, see = 0;
+	int maxerr = 0;
+
+	for (int64_t i = 0; i < n; i++) {
+		int e = out[i] - ref[i];
+		sx += ref[i];
+		sxx += (double)ref[i] * ref[i];
+		see += (double)e * e;
+		if (abs(e) > maxerr) {
+			maxerr = abs(e);
+		}
+	}
+	rs->maxerr = maxerr;
+	double sig = n > 0 ? sxx / n - (sx / n) * (sx / n) : 0;
+	if (sig > 0) {
+		rs->snr = see > 0 ? 10 * log10(sig / (see / n)) : INFINITY;
+	}
+}
+
+typedef int (*READ_INIT)(DESC *desc, int fd);
+
+// 繰り返しを続けるか
+static
+bool
+bench_more(int runs, double t0)
+{
+	return runs < BENCH_MINRUNS || now() - t0 < opt_mintime;
+}
+
+// fd の入力を先頭からすべて u8 に読み込み、かかった時間を返す。
+// out があれば読んだものを reflen まで写す。
+static
+double
+reader_pass(const char *name, int fd, READ_INIT init, uint8_t *out,
+	int64_t reflen, int64_t *samples, int *freq)
+{
+	DESC desc;
+	BUFFER buf;
+	uint8_t data[XP_BUFSIZE];
+
+	// closer が fd を閉じるので複製を渡す
+	lseek(fd, 0, SEEK_SET);
+	int rfd = dup(fd);
+	if (rfd == -1) {
+		err(EXIT_FAILURE, "dup");
+	}
+	memset(&desc, 0, sizeof(desc));
+	memset(&buf, 0, sizeof(buf));
+	buf.ptr = data;
+	buf.bufsize = sizeof(data);
+
+	double t0 = now();
+	if (init(&desc, rfd) < 0) {
+		errx(EXIT_FAILURE, "%s: read init error", name);
+	}
+	*samples = 0;
+	for (;;) {
+		buf.length = 0;
+		int r = desc.reader(&desc, &buf);
+		if (r < 0) {
+			err(EXIT_FAILURE, "%s: read", name);
+		}
+		if (r == 0) {
+			break;
+		}
+		if (out != NULL) {
+			// 比べるのは時間の外にしたいが、コピーだけなので含めてしまう
+			size_t n = buf.length;
+			if (*samples + n > reflen) {
+				n = *samples < reflen ? reflen - *samples : 0;
+			}
+			memcpy(out + *samples, data, n);
+		}
+		*samples += buf.length;
+	}
+	double t = now() - t0;
+	*freq = desc.freq;
+	desc.closer(&desc);
+	return t;
+}
+
+// fd の入力をすべて u8 に読み込む時間を計る。
+// ref があれば読んだものと比べる。
+static
+void
+bench_reader(const char *name, const char *signal, int fd, READ_INIT init,
+	const uint8_t *ref, int64_t reflen)
+{
+	uint8_t *out = NULL;
+	int64_t samples;
+	int freq;
+
+	off_t filelen = lseek(fd, 0, SEEK_END);
+	if (ref != NULL) {
+		out = malloc(reflen);
+		if (out == NULL) {
+			err(EXIT_FAILURE, "malloc");
+		}
+	}
+
+	// 比べるのは最初の回だけ
+	double t = reader_pass(name, fd, init, out, reflen, &samples, &freq);
+	double t0 = now();
+	for (int runs = 1; bench_more(runs, t0); runs++) {
+		double t1 = reader_pass(name, fd, init, NULL, 0, &samples, &freq);
+		if (t1 < t) {
+			t = t1;
+		}
+	}
+	close(fd);
+
+	struct result *rs = add_result("reader", name, signal);
+	rs->rate = fmax(rs->rate, samples / t);
+	if (out != NULL) {
+		if (samples != reflen) {
+			errx(EXIT_FAILURE, "%s %s: %jd samples, expected %jd",
+				name, signal, (intmax_t)samples, (intmax_t)reflen);
+		}
+		compare_u8(rs, ref, out, reflen);
+		free(out);
+	}
+
+	if (!bench_last) {
+		return;
+	}
+	printf("%-8s %-8s %10.0f samples/s %7.2f MB/s in  realtime x%.1f",
+		name, signal,
+		rs->rate,
+		filelen * rs->rate / samples / 1e6,
+		rs->rate / freq);
+	if (rs->maxerr >= 0) {
+		printf("  maxerr %d", rs->maxerr);
+	}
+	printf("\n");
+}
+
+// 往復する変換
+struct convdef {
+	const char *name;
+	CONVERTER enc;
+	CONVERTER dec;
+	int stride;
+};
+
+static const struct convdef convs[] = {
+	{ "PCM1", conv_u8_pcm1, conv_pcm1_u8, 1 },
+	{ "PCM2", conv_u8_pcm2, conv_pcm2_u8, 2 },
+	{ "PCM3", conv_u8_pcm3, conv_pcm3_u8, 4 },
+	{ "PAM2", conv_u8_pam2, conv_pam2_u8, 2 },
+	{ "PAM3", conv_u8_pam3, conv_pam3_u8, 4 },
+	{ "PCM2-trellis", conv_u8_pcm2_trellis, conv_pcm2_u8, 2 },
+	{ "PCM3-trellis", conv_u8_pcm3_trellis, conv_pcm3_u8, 4 },
+};
+
+// src の n サンプルを chunk サンプルずつ conv で dst に変換し、
+// かかった時間を返す。sstride, dstride は 1 サンプルのバイト数
+static
+double
+conv_time(CONVERTER conv, uint8_t *dst, int dstride, const uint8_t *src,
+	int sstride, int64_t n, int64_t chunk)
+{
+	BUFFER s, d;
+	memset(&s, 0, sizeof(s));
+	memset(&d, 0, sizeof(d));
+
+	double t0 = now();
+	for (int64_t i = 0; i < n; i += chunk) {
+		int64_t len = n - i < chunk ? n - i : chunk;
+		s.ptr = (uint8_t *)src + i * sstride;
+		s.length = len * sstride;
+		s.bufsize = s.length;
+		d.ptr = dst + i * dstride;
+		d.bufsize = chunk * dstride;
+		d.length = 0;
+		conv(&d, &s);
+	}
+	return now() - t0;
+}
+
+// u の n サンプルを convert.c と同じ大きさに区切って往復させる
+static
+void
+bench_conv(const struct convdef *cv, const char *signal, const uint8_t *u,
+	int64_t n)
+{
+	int64_t chunk = XP_BUFSIZE / cv->stride;
+	uint8_t *psg = malloc(n * cv->stride);
+	uint8_t *out = malloc(n);
+	if (psg == NULL || out == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	// 符号化と復号をそれぞれ繰り返して、いちばん速い回を取る
+	double tenc = HUGE_VAL;
+	double t0 = now();
+	for (int runs = 0; bench_more(runs, t0); runs++) {
+		double t = conv_time(cv->enc, psg, cv->stride, u, 1, n, chunk);
+		if (t < tenc) {
+			tenc = t;
+		}
+	}
+	double tdec = HUGE_VAL;
+	t0 = now();
+	for (int runs = 0; bench_more(runs, t0); runs++) {
+		double t = conv_time(cv->dec, out, 1, psg, cv->stride, n, chunk);
+		if (t < tdec) {
+			tdec = t;
+		}
+	}
+
+	struct result *rs = add_result("conv", cv->name, signal);
+	rs->rate = fmax(rs->rate, n / tenc);
+	rs->rate2 = fmax(rs->rate2, n / tdec);
+	compare_u8(rs, u, out, n);
+	if (bench_last) printf("%-12s %-8s %10.0f samples/s enc %10.0f samples/s dec"
+		"  snr %6.2f dB  maxerr %d\n",
+		cv->name, signal, rs->rate, rs->rate2, rs->snr, rs->maxerr);
+	free(psg);
+	free(out);
+}
+
+// NAN は null にする
+static
+void
+json_double(FILE *fp, const char *key, double v)
+{
+	if (isfinite(v)) {
+		fprintf(fp, ", \"%s\": %.6g", key, v);
+	} else {
+		fprintf(fp, ", \"%s\": null", key);
+	}
+}
+
+static
+void
+write_json(const char *path)
+{
+	FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	if (fp == NULL) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	fprintf(fp, "{\"sec\": %d, \"freq\": %d, \"ch\": %d, \"results\": [\n",
+		opt_sec, opt_freq, opt_ch);
+	for (int i = 0; i < nresults; i++) {
+		struct result *rs = &results[i];
+		fprintf(fp, "{\"kind\": \"%s\", \"name\": \"%s\", \"signal\": \"%s\"",
+			rs->kind, rs->name, rs->signal);
+		json_double(fp, "samples_per_sec", rs->rate);
+		if (strcmp(rs->kind, "conv") == 0) {
+			json_double(fp, "decode_samples_per_sec", rs->rate2);
+		}
+		json_double(fp, "snr_db", rs->snr);
+		fprintf(fp, ", \"max_err\": %d}%s\n", rs->maxerr,
+			i < nresults - 1 ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+	if (fp != stdout) {
+		fclose(fp);
+	}
+}
+
+// line の "key": の値。無いか null なら NAN
+static
+double
+json_get(const char *line, const char *key)
+{
+	char pat[64];
+	snprintf(pat, sizeof(pat), "\"%s\": ", key);
+	const char *p = strstr(line, pat);
+	if (p == NULL) {
+		return NAN;
+	}
+	p += strlen(pat);
+	if (strncmp(p, "null", 4) == 0) {
+		return NAN;
+	}
+	return strtod(p, NULL);
+}
+
+static
+int
+json_getstr(const char *line, const char *key, char *buf, size_t len)
+{
+	char pat[64];
+	snprintf(pat, sizeof(pat), "\"%s\": \"", key);
+	const char *p = strstr(line, pat);
+	if (p == NULL) {
+		return -1;
+	}
+	p += strlen(pat);
+	const char *e = strchr(p, '"');
+	if (e == NULL || e - p >= len) {
+		return -1;
+	}
+	memcpy(buf, p, e - p);
+	buf[e - p] = '\0';
+	return 0;
+}
+
+// 前の結果と比べて、悪くなったものの数を返す
+static
+int
+compare_baseline(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+
+	int bad = 0;
+	int matched = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char kind[16], name[32], signal[16];
+		if (json_getstr(line, "kind", kind, sizeof(kind)) < 0 ||
+		    json_getstr(line, "name", name, sizeof(name)) < 0 ||
+		    json_getstr(line, "signal", signal, sizeof(signal)) < 0) {
+			continue;
+		}
+		struct result *rs = NULL;
+		for (int i = 0; i < nresults; i++) {
+			if (strcmp(results[i].kind, kind) == 0 &&
+			    strcmp(results[i].name, name) == 0 &&
+			    strcmp(results[i].signal, signal) == 0) {
+				rs = &results[i];
+				break;
+			}
+		}
+		if (rs == NULL) {
+			continue;
+		}
+		matched++;
+
+		double snr = json_get(line, "snr_db");
+		double maxerr = json_get(line, "max_err");
+		double rate = json_get(line, "samples_per_sec");
+		double rate2 = json_get(line, "decode_samples_per_sec");
+		double keep = 1 - opt_ratetol / 100;
+		if (isfinite(snr) && (isnan(rs->snr) || rs->snr < snr - opt_snrtol)) {
+			printf("REGRESSION %s %s %s: snr %.2f -> %.2f dB\n",
+				kind, name, signal, snr, rs->snr);
+			bad++;
+		}
+		if (maxerr >= 0 && rs->maxerr > maxerr) {
+			printf("REGRESSION %s %s %s: maxerr %.0f -> %d\n",
+				kind, name, signal, maxerr, rs->maxerr);
+			bad++;
+		}
+		if (isfinite(rate) && rs->rate < rate * keep) {
+			printf("REGRESSION %s %s %s: %.0f -> %.0f samples/s\n",
+				kind, name, signal, rate, rs->rate);
+			bad++;
+		}
+		if (isfinite(rate2) && rs->rate2 < rate2 * keep) {
+			printf("REGRESSION %s %s %s: decode %.0f -> %.0f samples/s\n",
+				kind, name, signal, rate2, rs->rate2);
+			bad++;
+		}
+	}
+	fclose(fp);
+	printf("baseline %s: %d compared, %d regressions\n", path, matched, bad);
+	return bad;
+}
+
+// 拡張子で入力形式を決めて計る。
+static
+void
+bench_file(const char *fname)
+{
+	READ_INIT init;
+	const char *ext = strrchr(fname, '.');
+
+	if (ext == NULL) {
+		errx(EXIT_FAILURE, "%s: unknown format", fname);
+	} else if (strcasecmp(ext, ".wav") == 0) {
+		init = wav_read_init;
+	} else if (strcasecmp(ext, ".au") == 0 || strcasecmp(ext, ".snd") == 0) {
+		init = au_read_init;
+	} else if (strcasecmp(ext, ".flac") == 0) {
+		init = flac_read_init;
+	} else {
+		errx(EXIT_FAILURE, "%s: unknown format", fname);
+	}
+
+	int fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		err(EXIT_FAILURE, "open: %s", fname);
+	}
+	bench_reader(fname, "file", fd, init, NULL, 0);
+}
+
+int
+main(int ac, char *av[])
+{
+	int c;
+	const char *json = NULL;
+	const char *baseline = NULL;
+
+	while ((c = getopt(ac, av, "b:c:f:n:o:R:S:s:T:v")) != -1) {
+		switch (c) {
+		 case 'b':
+			baseline = optarg;
+			break;
+		 case 'c':
+			opt_ch = atoi(optarg);
+			break;
+		 case 'n':
+			opt_rounds = atoi(optarg);
+			break;
+		 case 'o':
+			json = optarg;
+			break;
+		 case 'R':
+			opt_ratetol = atof(optarg);
+			break;
+		 case 'S':
+			opt_snrtol = atof(optarg);
+			break;
+		 case 'f':
+			opt_freq = atoi(optarg);
+			break;
+		 case 's':
+			opt_sec = atoi(optarg);
+			break;
+		 case 'T':
+			opt_mintime = atof(optarg);
+			break;
+		 case 'v':
+			opt_v++;
+			break;
+		 default:
+			errx(1, "usage: lpbench [-c ch] [-f freq] [-s sec] "
+				"[-n rounds] [-T sec] [-o json] [-b baseline] [-R rate%%] [-S snrdB] "
+				"[file...]");
+		}
+	}
+	if (opt_ch < 1 || opt_ch > 2 || opt_freq <= 0 || opt_sec <= 0 ||
+	    opt_mintime < 0 || opt_rounds < 1) {
+		errx(1, "invalid argument");
+	}
+
+	// ファイル指定があればそれを計る
+	if (optind < ac) {
+		for (int r = 0; r < opt_rounds; r++) {
+			bench_last = r == opt_rounds - 1;
+			for (int i = optind; i < ac; i++) {
+				bench_file(av[i]);
+			}
+		}
+	} else {
+		int frames = opt_sec * opt_freq;
+		printf("%d sec, %d Hz, %d ch, %d rounds\n", opt_sec, opt_freq, opt_ch,
+			opt_rounds);
+
+		uint8_t *u = malloc(frames);
+		if (u == NULL) {
+			err(EXIT_FAILURE, "malloc");
+		}
+		trellis_init(TRELLIS_LAMBDA);
+		for (int r = 0; r < opt_rounds; r++) {
+			bench_last = r == opt_rounds - 1;
+			for (int k = 0; k < SIG_MAX; k++) {
+				make_signal(u, frames, k);
+				bench_reader("u8", sig_names[k], make_wav(u, frames, 1, 8),
+					wav_read_init, u, frames);
+				bench_reader("s16le", sig_names[k],
+					make_wav(u, frames, 1, 16), wav_read_init, u, frames);
+				bench_reader("s24le", sig_names[k],
+					make_wav(u, frames, 1, 24), wav_read_init, u, frames);
+				bench_reader("s32le", sig_names[k],
+					make_wav(u, frames, 1, 32), wav_read_init, u, frames);
+				bench_reader("f32le", sig_names[k],
+					make_wav(u, frames, 3, 32), wav_read_init, u, frames);
+				for (int i = 0; i < countof(convs); i++) {
+					bench_conv(&convs[i], sig_names[k], u, frames);
+				}
+			}
+			// IMA ADPCM は元の u8 が無いので速さだけ
+			bench_reader("ima", "noise", make_ima(frames), wav_read_init,
+				NULL, 0);
+		}
+		free(u);
+	}
+
+	if (json != NULL) {
+		write_json(json);
+	}
+	if (baseline != NULL && compare_baseline(baseline) > 0) {
+		return 1;
+	}
+	return 0;
+}
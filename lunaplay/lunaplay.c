@@ -2,8 +2,6 @@
 /* TODO: LICENSE */
 
 #include <err.h>
-#include <errno.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,136 +14,37 @@
 
 /* global */
 int opt_v;		// verbose
+int opt_rt;		// realtime mode
 char *opt_firmware;	// firmware file
 
-/* ***** static func ***** */
-
-static
-bool
-isextension(const char *fname, const char *ext)
-{
-	char *p = strrchr(fname, '.');
-	if (p == NULL) {
-		return false;
-	}
-	return strncasecmp(p, ext, strlen(ext)) == 0;
-}
-
+/*
+ 時間を秒に変換します。"90", "1:30", "1:02:03.5" の形式。
+ 成功すれば 0、失敗すると -1 を返します。
+ */
 static
 int
-enc_stride(int enc)
-{
-	switch (enc) {
-	 case ENC_U8:
-		return 1;
-	 case ENC_PCM1:
-		return 1;
-	 case ENC_PCM2:
-	 case ENC_PAM2:
-		return 2;
-	 case ENC_PCM3:
-	 case ENC_PAM3:
-		return 4;
-	 default:
-		errx(EXIT_FAILURE, "unknown encoding");
-	}
-}
-
-static
-CONVERTER
-get_conv_u8_to(int enc)
-{
-	switch (enc) { 
-	 case ENC_U8:
-		return conv_pass;
-	 case ENC_PCM1:
-		return conv_u8_pcm1;
-	 case ENC_PCM2:
-		return conv_u8_pcm2;
-	 case ENC_PCM3:
-		return conv_u8_pcm3;
-	 case ENC_PAM2:
-		return conv_u8_pam2;
-	 case ENC_PAM3:
-		return conv_u8_pam3;
-	 default:
-		errx(EXIT_FAILURE, "unknown encoding");
-	}
-}
-
-static
-CONVERTER
-get_conv_from_u8(int enc)
-{
-	switch (enc) { 
-	 case ENC_U8:
-		return conv_pass;
-	 case ENC_PCM1:
-		return conv_pcm1_u8;
-	 case ENC_PCM2:
-		return conv_pcm2_u8;
-	 case ENC_PCM3:
-		return conv_pcm3_u8;
-	 case ENC_PAM2:
-		return conv_pam2_u8;
-	 case ENC_PAM3:
-		return conv_pam3_u8;
-	 default:
-		errx(EXIT_FAILURE, "unknown encoding");
-	}
-}
-
-static
-void
-buffer_free(BUFFER *buf)
-{
-	if (buf->isfree) {
-		free(buf->ptr);
-	}
-}
-
-static
-void
-memset8(void *buf, uint8_t val, int len)
-{
-	memset(buf, val, len);
-}
-
-static
-void
-memset16(void *buf, uint16_t val, int len)
-{
-	uint16_t *p = (uint16_t *)buf;
-	for (int i = 0; i < len; i += 2) {
-		*p++ = val;
-	}
-}
-
-static
-void
-memset32(void *buf, uint32_t val, int len)
+parse_time(const char *arg, double *sec)
 {
-	uint32_t *p = (uint32_t *)buf;
-	for (int i = 0; i < len; i += 4) {
-		*p++ = val;
-	}
-}
+	double v = 0;
+	const char *p = arg;
+	char *endp;
 
-static
-void
-filltail(BUFFER *buf, int stride)
-{
-	uint8_t *p = buf->ptr + buf->length;
-	int len = buf->bufsize - buf->length;
-	if (stride == 1) {
-		memset8(p, *(p - 1), len);
-	} else if (stride == 2) {
-		memset16(p, *(p - 2), len);
-	} else if (stride == 4) {
-		memset32(p, *(p - 4), len);
-	} else {
-		errx(EXIT_FAILURE, "invalid stride");
+	for (;;) {
+		double d = strtod(p, &endp);
+		if (endp == p || d < 0) {
+			return -1;
+		}
+		v = v * 60 + d;
+		if (*endp == '\0') {
+			break;
+		}
+		if (*endp != ':') {
+			return -1;
+		}
+		p = endp + 1;
 	}
+	*sec = v;
+	return 0;
 }
 
 _Noreturn
@@ -156,29 +55,80 @@ usage()
 	fprintf(stderr,
 "Play PCM on LUNA-I version %s\n"
 "%s <options> <file>\n"
+"%s <options> -B <list|dir>\n"
 "  file  input file\n"
 "\n"
 "options\n"
+"  -A<lsb>\n"
+"        ADPT: use PCM1/PCM2 for a page if its RMS error is within lsb\n"
+"        (u8 steps, default %g)\n"
+"  -B<list|dir>\n"
+"        batch mode; convert every file in list (\"in [out]\" per line)\n"
+"        or directory. -O is the output directory in batch mode\n"
+"  -C<dir>\n"
+"        cache converted PSGPCM in dir (XP device output only)\n"
 "  -i<format>\n"
 "        override input format\n"
 "  -o<format>\n"
 "        set output format\n"
+"  -n    discard output at full speed instead of XP, and report the\n"
+"        realtime factor, reader/converter/writer time and syscalls\n"
+"  -p    same as -n, but accept data at the XP playback rate\n"
+"  -L<n>\n"
+"        play n times, <0 as infinite (WAV smpl loop points are used)\n"
+"  -M<size>\n"
+"        cache size limit, postfix k/M/G (default 256M)\n"
 "  -O<file>\n"
 "        output file\n"
+"  -j<threads>\n"
+"        batch mode threads (default: number of CPUs)\n"
+"  -P<threads>\n"
+"        split one file into chunks and convert on threads\n"
+"        (seekable PCM WAV/AU input, PSGPCM file output)\n"
+"  -Q trellis[:lambda]\n"
+"        PCM2/PCM3: choose channel combinations by Viterbi search\n"
+"        (lambda: weight of glitches between channel writes, default %g)\n"
+"  -q<depth>\n"
+"        read/convert/write pipeline depth (default %d, 0: no thread)\n"
+"        (batch mode default 0)\n"
+"  -R    realtime mode; lock memory, prefault buffers and the XP window,\n"
+"        run the writer at SCHED_FIFO where permitted, and report wakeup\n"
+"        jitter against the page deadline\n"
+"  -S    print time histograms and the worst case of read, convert,\n"
+"        write, XP wait and XP copy\n"
+"  -J<file>\n"
+"        write every read/convert/write/XP wait/XP copy as Chrome trace\n"
+"        JSON (chrome://tracing, Perfetto)\n"
+"  -s<time>\n"
+"        start position, sec or [h:]m:s (seek on PCM WAV/AU/PSGPCM)\n"
+"  -t<time>\n"
+"        play duration, sec or [h:]m:s\n"
+"  -x<opt>[,<opt>...]\n"
+"        PSGPCM output options\n"
+"        v1   write old header only (no sample count, no index)\n"
+"        crc  store CRC32 of each block in index\n"
+"        align  align data to XP pages (played from mmap)\n"
+"        z    compress blocks (nibble packing + run length)\n"
 "  -v    verbose level +1\n"
 "  -h    show help\n"
 "\n"
 "format (ignore case)\n"
 "  WAV   WAV file format (input default)\n"
-"  AU    (not implemented)\n"
+"  AU    Sun AU file format (u-law, A-law, linear8, linear16)\n"
+"  FLAC  FLAC file format (input only)\n"
 "  PCM1  PCM1 format\n"
 "  PCM2  PCM1 format\n"
 "  PCM3  PCM1 format\n"
 "  PAM2  PAM2 format\n"
-"  PAM3  PAM3 format (output default)\n"
+"  PAM3  PAM3 format (output default; PSGPCM plays as is)\n"
+"  ADPT  PCM1/PCM2/PCM3 switched per XP page\n"
 		,
 		VERSION,
-		getprogname()
+		getprogname(),
+		getprogname(),
+		ADPT_THRESHOLD,
+		TRELLIS_LAMBDA,
+		PIPELINE_DEPTH
 	);
 	exit(1);
 }
@@ -189,31 +139,42 @@ main(int ac, char *av[])
 	int r;
 	int c;
 	char *endp;
-	int freq = 0;
 	double dfreq = 0;
-	char *in_file = NULL;
-	char *out_file = NULL;
-	int in_enc = ENC_UNKNOWN;
-	int out_enc = ENC_UNKNOWN;
-	int in_format = FMT_UNKNOWN;
-	int out_format = FMT_UNKNOWN;
-	int in_fd;
-	int out_fd;
-
-	DESC in0, *in = &in0;
-	DESC out0, *out = &out0;
-	BUFFER src0, *src = &src0;
-	BUFFER dst0, *dst = &dst0;
-	CONVERTER conv = NULL;
+	double dsize;
+	char *batch_list = NULL;
+	int nthreads = 0;
+	bool depth_set = false;
+	bool trace_hist = false;
+	const char *trace_json = NULL;
+	JOB job0, *job = &job0;
 
 	opt_v = 0;
-	memset(in, 0, sizeof(DESC));
-	memset(out, 0, sizeof(DESC));
-	memset(src, 0, sizeof(BUFFER));
-	memset(dst, 0, sizeof(BUFFER));
-
-	while ((c = getopt(ac, av, "f:i:O:o:hv")) != -1) {
+	memset(job, 0, sizeof(JOB));
+	job->in_format = FMT_UNKNOWN;
+	job->in_enc = ENC_UNKNOWN;
+	job->out_format = FMT_UNKNOWN;
+	job->out_enc = ENC_UNKNOWN;
+	job->depth = PIPELINE_DEPTH;
+	job->cachemax = CACHE_DEFAULTMAX;
+	job->loop = 1;
+	job->duration = -1;
+	job->adpt_threshold = ADPT_THRESHOLD;
+	job->trellis = -1;
+
+	while ((c = getopt(ac, av, "A:B:C:f:i:J:j:L:M:O:o:P:Q:q:Rs:t:x:hnpSv")) != -1) {
 		switch (c) {
+		 case 'A':
+			job->adpt_threshold = strtod(optarg, &endp);
+			if (endp == optarg || *endp != '\0' || job->adpt_threshold < 0) {
+				errx(1, "Invalid ADPT threshold: %s", optarg);
+			}
+			break;
+		 case 'B':
+			batch_list = optarg;
+			break;
+		 case 'C':
+			job->cachedir = optarg;
+			break;
 		 case 'f':
 			dfreq = strtod(optarg, &endp);
 			if (*endp == 'k') {
@@ -222,23 +183,108 @@ main(int ac, char *av[])
 			if (dfreq < 0) {
 				errx(1, "Invalid frequency: %s", optarg);
 			}
-			freq = (int)dfreq;
+			job->freq = (int)dfreq;
 			break;
 		 case 'i':
-			r = parse_arg_format_enc(optarg, &in_format, &in_enc);
+			r = parse_arg_format_enc(optarg, &job->in_format, &job->in_enc);
 			if (r < 0) {
 				errx(1, "Invalid format: %s", optarg);
 			}
 			break;
+		 case 'J':
+			trace_json = optarg;
+			break;
+		 case 'j':
+			nthreads = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || nthreads < 1) {
+				errx(1, "Invalid thread count: %s", optarg);
+			}
+			break;
+		 case 'L':
+			job->loop = strtol(optarg, &endp, 10);
+			if (*endp != '\0') {
+				errx(1, "Invalid loop count: %s", optarg);
+			}
+			break;
+		 case 'M':
+			dsize = strtod(optarg, &endp);
+			if (*endp == 'k' || *endp == 'K') {
+				dsize *= 1024;
+			} else if (*endp == 'm' || *endp == 'M') {
+				dsize *= 1024 * 1024;
+			} else if (*endp == 'g' || *endp == 'G') {
+				dsize *= 1024 * 1024 * 1024;
+			}
+			if (dsize <= 0) {
+				errx(1, "Invalid cache size: %s", optarg);
+			}
+			job->cachemax = (off_t)dsize;
+			break;
 		 case 'O':
-			out_file = optarg;
+			job->out_file = optarg;
 			break;
 		 case 'o':
-			r = parse_arg_format_enc(optarg, &out_format, &out_enc);
+			r = parse_arg_format_enc(optarg, &job->out_format, &job->out_enc);
 			if (r < 0) {
 				errx(1, "Invalid format: %s", optarg);
 			}
 			break;
+		 case 'P':
+			job->parallel = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || job->parallel < 0) {
+				errx(1, "Invalid thread count: %s", optarg);
+			}
+			break;
+		 case 'Q':
+			// trellis[:lambda]
+			if (strncasecmp(optarg, "trellis", 7) != 0) {
+				errx(1, "Invalid quantizer: %s", optarg);
+			}
+			job->trellis = TRELLIS_LAMBDA;
+			if (optarg[7] == ':') {
+				job->trellis = strtod(optarg + 8, &endp);
+				if (endp == optarg + 8 || *endp != '\0' || job->trellis < 0) {
+					errx(1, "Invalid trellis lambda: %s", optarg);
+				}
+			} else if (optarg[7] != '\0') {
+				errx(1, "Invalid quantizer: %s", optarg);
+			}
+			break;
+		 case 'q':
+			job->depth = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || job->depth < 0 ||
+			    job->depth > PIPELINE_MAXDEPTH) {
+				errx(1, "Invalid pipeline depth: %s", optarg);
+			}
+			depth_set = true;
+			break;
+		 case 'R':
+			opt_rt = 1;
+			break;
+		 case 'S':
+			trace_hist = true;
+			break;
+		 case 's':
+			if (parse_time(optarg, &job->start) < 0) {
+				errx(1, "Invalid start time: %s", optarg);
+			}
+			break;
+		 case 't':
+			if (parse_time(optarg, &job->duration) < 0) {
+				errx(1, "Invalid duration: %s", optarg);
+			}
+			break;
+		 case 'x':
+			if (parse_psgpcm_opts(optarg, &job->psgopts) < 0) {
+				errx(1, "Invalid PSGPCM option: %s", optarg);
+			}
+			break;
+		 case 'n':
+			job->nullsink = NULLSINK_FAST;
+			break;
+		 case 'p':
+			job->nullsink = NULLSINK_PACED;
+			break;
 		 case 'v':
 			opt_v++;
 			break;
@@ -247,188 +293,89 @@ main(int ac, char *av[])
 			usage();
 		}
 	}
-	if (optind >= ac) {
-		errx(1, "missing input file");
-	}
-
-	in_file = av[optind];
-	// XP デバイス宛?
-	bool isdevxp = out_file == NULL;
 
-	if (opt_v >= 1) {
-		printf("arguments...\n");
-		printf("verbose level  :%d\n", opt_v);
-		printf("input format   :%s\n", format_tostr(in_format));
-		printf("input encoding :%s\n", enc_tostr(in_enc));
-		printf("input file     :%s\n", in_file);
-		printf("output format  :%s\n", format_tostr(out_format));
-		printf("output encoding:%s\n", enc_tostr(out_enc));
-		printf("output file    :%s\n", isdevxp ? "XP device" : out_file);
-		printf("output freq    :%d\n", freq);
+	if (job->trellis >= 0) {
+		trellis_init(job->trellis);
 	}
 
-	if (in_format == FMT_UNKNOWN) {
-		if (isextension(in_file, "." STR_WAV)) {
-			in_format = FMT_WAV;
-		} else if (isextension(in_file, "." STR_PSGPCM)) {
-			in_format = FMT_PSGPCM;
-		} else {
-			errx(EXIT_FAILURE, "input format undeterminate");
+	if (job->nullsink != NULLSINK_OFF) {
+		// 変換の時間を計る状態は 1 つしか持たない
+		if (batch_list != NULL) {
+			errx(1, "-n/-p cannot be used with -B");
 		}
-		if (opt_v >= 1) {
-			printf("input format change to %s\n", format_tostr(in_format));
+		if (job->out_file != NULL) {
+			errx(1, "-n/-p cannot be used with -O");
 		}
 	}
 
-	if (out_format == FMT_UNKNOWN) {
-		if (isextension(out_file, "." STR_WAV)) {
-			out_format = FMT_WAV;
-		} else if (isextension(out_file, "." STR_PSGPCM)) {
-			out_format = FMT_PSGPCM;
-		} else {
-			errx(EXIT_FAILURE, "output format undeterminate");
+	if (trace_hist || trace_json != NULL) {
+		// 段ごとの集計は 1 ファイル分しか持たない
+		if (batch_list != NULL) {
+			errx(1, "-S/-J cannot be used with -B");
 		}
-		if (opt_v >= 1) {
-			printf("output format change to %s\n", format_tostr(out_format));
-		}
-		if (out_enc == ENC_UNKNOWN) {
-			if (out_format == FMT_WAV) out_enc = ENC_U8;
-			if (out_format == FMT_PSGPCM) out_enc = ENC_PAM3;
+		if (trace_init(trace_hist, trace_json) < 0) {
+			return EXIT_FAILURE;
 		}
 	}
 
-	if (strcmp(in_file, "-") == 0) {
-		if (opt_v) printf("opening stdin\n");
-		in_fd = STDIN_FILENO;
-	} else {
-		if (opt_v) printf("opening %s\n", in_file);
-		in_fd = open(in_file, O_RDONLY);
-		if (in_fd == -1) {
-			err(1, "open: %s", in_file);
+	if (opt_rt) {
+		// 再生のためのものなので、バッチ (オフライン) では使わない
+		if (batch_list != NULL) {
+			errx(1, "-R cannot be used with -B");
 		}
+		rt_init();
 	}
 
-	if (opt_v) printf("reading %s\n", format_tostr(in_format));
-	if (in_format == FMT_WAV) {
-		if (wav_read_init(in, in_fd) < 0) {
-			errx(EXIT_FAILURE, "wav read init error");
+	if (batch_list != NULL) {
+		// ファイル単位で並列にするので、既定ではファイル内はスレッドにしない
+		if (!depth_set) {
+			job->depth = 0;
 		}
-	} else if (in_format == FMT_AU) {
-		errx(1, "notimplemented");
-	} else {
-		if (psgpcm_read_init(in, in_fd) < 0) {
-			errx(EXIT_FAILURE, "psgpcm read init error");
+		job->loop = 1;
+		if (nthreads == 0) {
+			nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+			if (nthreads < 1) {
+				nthreads = 1;
+			}
 		}
-	}
-
-	if (opt_v) {
-		printf("freq=%d, in->freq=%d\n", freq, in->freq);
-	}
-	if (freq == 0) {
-		if (opt_v) printf("set out->freq = in->freq = %d\n", in->freq);
-		out->freq = in->freq;
-	} else {
-		if (opt_v) printf("set out->freq = freq = %d\n", freq);
-		out->freq = freq;
-	}
-
-	if (out_enc == ENC_UNKNOWN) {
-		out->enc = in->enc;
-	} else {
-		out->enc = out_enc;
-	}
-
-	dst->bufsize = XP_BUFSIZE;
-	dst->ptr = malloc(dst->bufsize);
-	dst->isfree = true;
-	if (in->enc == out->enc) {
-		src->bufsize = dst->bufsize;
-		src->ptr = dst->ptr;
-		src->isfree = false;
-	} else {
-		if (in->enc == ENC_U8) {
-			conv = get_conv_u8_to(out->enc);
-		} else if (out->enc == ENC_U8) {
-			conv = get_conv_from_u8(in->enc);
-		} else {
-			errx(EXIT_FAILURE, "unsupported encoding pair");
+		// バッチでは -O は出力ディレクトリ
+		const char *outdir = job->out_file;
+		job->out_file = NULL;
+		if (opt_v >= 1) {
+			printf("batch list     :%s\n", batch_list);
+			printf("output dir     :%s\n", outdir ? outdir : "(same as input)");
+			printf("threads        :%d\n", nthreads);
 		}
-		src->bufsize = dst->bufsize * enc_stride(in->enc) / enc_stride(out->enc);
-		src->ptr = malloc(src->bufsize);
-		src->isfree = true;
+		r = batch_run(batch_list, outdir, job, nthreads);
+		return r < 0 ? EXIT_FAILURE : 0;
 	}
 
-	if (out_file == NULL) {
-		if (opt_v) printf("xp write initializing\n");
-		if (xp_write_init(out) < 0) {
-			errx(EXIT_FAILURE, "xp write init error");
-		}
-	} else {
-		if (strcmp(out_file, "-") == 0) {
-			out_fd = STDOUT_FILENO;
-		} else {
-			out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-			if (out_fd == -1) {
-				err(1, "open: %s", out_file);
-			}
-		}
-		if (opt_v) printf("%s write initializing\n", format_tostr(out_format));
-		if (out_format == FMT_WAV) {
-			if (wav_write_init(out, out_fd) < 0) {
-				errx(EXIT_FAILURE, "wav write init error");
-			}
-		} else if (out_format == FMT_AU) {
-			errx(1, "notimplemented");
-		} else {
-			if (psgpcm_write_init(out, out_fd) < 0) {
-				errx(EXIT_FAILURE, "psgpcm write init error");
-			}
-		}
+	if (optind >= ac) {
+		errx(1, "missing input file");
 	}
+	job->in_file = av[optind];
 
 	if (opt_v >= 1) {
-		printf("running...\n");
-		printf("input format   :%s\n", format_tostr(in_format));
-		printf("input encoding :%s\n", enc_tostr(in->enc));
-		printf("input file     :%s\n", in_file);
-		printf("output format  :%s\n", format_tostr(out_format));
-		printf("output encoding:%s\n", enc_tostr(out->enc));
-		printf("output file    :%s\n", out_file == NULL ? "XP device" : out_file);
-		printf("output freq    :%d\n", out->freq);
-		printf("input bufsize  :%d\n", src->bufsize);
-		printf("output bufsize :%d\n", dst->bufsize);
+		printf("arguments...\n");
+		printf("verbose level  :%d\n", opt_v);
+		printf("input format   :%s\n", format_tostr(job->in_format));
+		printf("input encoding :%s\n", enc_tostr(job->in_enc));
+		printf("input file     :%s\n", job->in_file);
+		printf("output format  :%s\n", format_tostr(job->out_format));
+		printf("output encoding:%s\n", enc_tostr(job->out_enc));
+		printf("output file    :%s\n",
+			job->nullsink != NULLSINK_OFF ? "null sink" :
+			job->out_file == NULL ? "XP device" : job->out_file);
+		printf("output freq    :%d\n", job->freq);
 	}
 
-	for (;;) {
-		src->length = 0;
-		dst->length = 0;
-		r = in->reader(in, src);
-		if (r < 0) {
-			fprintf(stderr, "read error %s", strerror(errno));
-			break;
-		}
-		if (r == 0) {
-			break;
-		}
-		if (isdevxp && src->length < src->bufsize) {
-			// XP デバイス宛の書き込みはブロック単位なのでフィル
-			// ファイル終端でしか成立はしない
-			filltail(src, enc_stride(in->enc));
-		}
-		conv(dst, src);
-		r = out->writer(out, dst);
-		if (r < 0) {
-			fprintf(stderr, "write error %s", strerror(errno));
-			break;
-		}
+	r = convert_file(job);
+	rt_report();
+	if (trace_report() < 0) {
+		r = -1;
+	}
+	if (r < 0) {
+		return EXIT_FAILURE;
 	}
-
-	in->closer(in);
-	out->closer(out);
-
-	buffer_free(src);
-	buffer_free(dst);
-
 	return 0;
 }
-
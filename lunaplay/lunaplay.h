@@ -4,12 +4,14 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /* ----- constants ----- */
 
 #define STR_UNKNOWN		"?"
 #define STR_WAV			"WAV"
 #define STR_AU			"AU"
+#define STR_FLAC		"FLAC"
 #define STR_PSGPCM		"PSGPCM"
 
 #define STR_U8			"U8"
@@ -18,12 +20,14 @@
 #define STR_PCM3		"PCM3"
 #define STR_PAM2		"PAM2"
 #define STR_PAM3		"PAM3"
+#define STR_ADPT		"ADPT"
 
 enum {
 	FMT_UNKNOWN = 0,
 	FMT_WAV,
 	FMT_AU,
 	FMT_PSGPCM,
+	FMT_FLAC,
 };
 
 enum {
@@ -34,6 +38,7 @@ enum {
 	ENC_PCM3,
 	ENC_PAM2,
 	ENC_PAM3,
+	ENC_ADPT,		// per-page PCM1/PCM2/PCM3 (adpt.c)
 };
 
 /* PSG voltage table */
@@ -47,6 +52,7 @@ struct BUFFER_T;
 typedef int (*READER)(struct DESC_T *desc, struct BUFFER_T *buf);
 typedef int (*WRITER)(struct DESC_T *desc, struct BUFFER_T *buf);
 typedef int (*CLOSER)(struct DESC_T *desc);
+typedef int64_t (*SEEKER)(struct DESC_T *desc, int64_t frames);
 
 typedef struct DESC_T
 {
@@ -55,10 +61,22 @@ typedef struct DESC_T
 	int format;			// file format
 	int enc;			// encoding
 	int freq;			// Hz
+	off_t remain;		// remaining data bytes (-1 = until EOF)
+	int channels;		// channel count of file
+	int samplesize;		// bytes per sample of file
+	int framesize;		// bytes per frame of file
+	uint32_t mixmul;	// downmix factor (65536 / channels, roundup)
+	uint8_t *tmp;		// reader work buffer
+	void *priv;			// format private data
+	bool splittable;	// reader is stateless per frame (can start at any frame)
+	int64_t loopstart;	// loop start frame (WAV smpl)
+	int64_t loopend;	// loop end frame, exclusive (0 = no loop point)
 
 	READER reader;
 	WRITER writer;
 	CLOSER closer;
+	SEEKER seeker;		// skip frames forward (NULL = decode and discard)
+	int opts;			// writer options (PSGPCM_OPT_*)
 } DESC;
 
 typedef struct BUFFER_T
@@ -69,6 +87,41 @@ typedef struct BUFFER_T
 	uint8_t *ptr;	// buffer pointer
 } BUFFER;
 
+/* conversion job (one input file to one output) */
+typedef struct JOB_T
+{
+	const char *in_file;	// "-" = stdin
+	int in_format;			// FMT_UNKNOWN = by extension
+	int in_enc;
+	const char *out_file;	// NULL = XP device, "-" = stdout
+	int out_format;			// FMT_UNKNOWN = by extension
+	int out_enc;
+	int freq;				// output freq (0 = same as input)
+	int depth;				// pipeline depth (0 = no thread)
+	int parallel;			// intra-file threads (0 = off)
+	int loop;				// play count (<0 = infinite)
+	double start;			// start position (sec)
+	double duration;		// play length (sec, <0 = to the end)
+	const char *cachedir;	// converted PSGPCM cache (NULL = off)
+	off_t cachemax;			// cache size limit (bytes)
+	int psgopts;			// PSGPCM writer options (PSGPCM_OPT_*)
+	double adpt_threshold;	// ADPT RMS error limit (u8 LSB)
+	double trellis;			// trellis quantizer lambda (<0 = table)
+	int nullsink;			// discard output instead of XP (NULLSINK_*)
+	off_t inbytes;			// (result) input file bytes
+} JOB;
+
+/* null sink (-n, -p) */
+#define NULLSINK_OFF	(0)
+#define NULLSINK_FAST	(1)		// discard at full speed
+#define NULLSINK_PACED	(2)		// accept at the XP playback rate
+
+/* PSGPCM writer options (-x) */
+#define PSGPCM_OPT_V1	(1 << 0)	// v1 header only (no index)
+#define PSGPCM_OPT_CRC	(1 << 1)	// per-block CRC32 in index
+#define PSGPCM_OPT_ALIGN	(1 << 2)	// data aligned and padded to XP pages
+#define PSGPCM_OPT_Z	(1 << 3)	// block compressed (psgz)
+
 /* fixed (fit as XP(Z80) buffer, 16KiB) */
 #define XP_BUFSIZE	(16384)
 
@@ -76,20 +129,121 @@ typedef void (*CONVERTER)(BUFFER *dst, BUFFER *src);
 
 /* ----- functions ----- */
 
+// pipeline のリング段数
+#define PIPELINE_DEPTH		(4)
+#define PIPELINE_MAXDEPTH	(64)
+
+// ADPT で安いフォーマットを選ぶ RMS 誤差の既定の上限 (u8 LSB)
+#define ADPT_THRESHOLD		(2.0)
+
+// trellis の書き換え途中の誤差の既定の重み
+#define TRELLIS_LAMBDA		(0.1)
+
+// -R で XP のページの切り替えを待つ間隔
+#define RT_POLL_USEC		(1000)
+
+// キャッシュの既定の上限
+#define CACHE_DEFAULTMAX	(256 * 1024 * 1024)
+
 #define countof(x) (sizeof(x)/sizeof((x)[0]))
 
 extern int wav_read_init(DESC *desc, int fd);
 extern int wav_write_init(DESC *desc, int fd);
+extern int au_read_init(DESC *desc, int fd);
+extern int au_write_init(DESC *desc, int fd);
+extern int flac_read_init(DESC *desc, int fd);
 extern int psgpcm_read_init(DESC *desc, int fd);
 extern int psgpcm_write_init(DESC *desc, int fd);
+extern int psgpcm_write_sync(DESC *desc);
+extern int psgpcm_xp_run(DESC *in, DESC *out);
+extern int parse_psgpcm_opts(const char *arg, int *opts);
 extern int xp_write_init(DESC *desc);
 
+// XP デバイス (xp.c)
+struct xp;
+extern struct xp *xp_open(const char *firmware, int enc, int freq,
+	int pollusec);
+extern void xp_close(struct xp *xp);
+extern volatile uint8_t *xp_window(struct xp *xp, size_t *len);
+extern double xp_rate(struct xp *xp);
+extern uint8_t *xp_page(struct xp *xp, bool block, int *waits);
+extern int xp_commit(struct xp *xp, int64_t frames);
+extern int64_t xp_position(struct xp *xp);
+extern int xp_drain(struct xp *xp);
+
+extern int adpt_init(DESC *desc, DESC *next, double threshold);
+extern int64_t adpt_frames(const BUFFER *buf);
+extern int adpt_read_init(DESC *desc, DESC *inner);
+
+extern int null_write_init(DESC *desc, bool paced);
+extern void bench_wrap_writer(DESC *desc, DESC *next);
+extern void bench_wrap_reader(DESC *desc, DESC *inner, CONVERTER *conv);
+extern void bench_report(const DESC *out);
+
+// 計る段 (trace.c)
+enum {
+	TRACE_READ,
+	TRACE_CONV,
+	TRACE_WRITE,
+	TRACE_WAIT,		// XP の再生が次のページに移るのを待つ
+	TRACE_COPY,		// XP の共有メモリへのコピー
+	TRACE_MAX,
+};
+extern int trace_init(bool hist, const char *json);
+extern uint64_t trace_begin(void);
+extern void trace_end(int stage, uint64_t t0);
+extern void trace_mark(int stage, const char *name);
+extern int trace_report(void);
+
+extern void rt_init(void);
+extern void rt_worker(void);
+extern void rt_prefault(void *ptr, size_t len);
+extern void rt_prefault_ro(volatile const void *ptr, size_t len);
+extern double rt_now(void);
+extern void rt_jitter(double late);
+extern void rt_report(void);
+
+extern void psgz_init(void);
+extern int psgz_encode(uint8_t *out, int outsize, const uint8_t *raw, int len,
+	int stride);
+extern int psgz_decode(uint8_t *raw, int rawlen, const uint8_t *in, int clen,
+	int stride);
+
+extern void buffer_free(BUFFER *buf);
+extern void filltail(BUFFER *buf, int stride);
+
+extern int pipeline_run(DESC *in, DESC *out, CONVERTER conv,
+	size_t srcsize, size_t dstsize, int depth, int fillstride, bool prefill);
+
+extern int range_seek(DESC *in, int64_t frames);
+extern int range_init(DESC *desc, DESC *inner, int64_t frames);
+extern int loop_run(DESC *in, DESC *out, CONVERTER conv, size_t srcsize,
+	int loops, int fillstride);
+extern int parallel_run(DESC *in, DESC *out, CONVERTER conv,
+	const char *in_file, int nthreads);
+
+extern int cache_path(const char *dir, int fd, int enc, int freq,
+	char *path, size_t len);
+extern int cache_open(const char *path);
+extern void cache_evict(const char *dir, off_t maxsize);
+extern int cache_tee_init(DESC *desc, DESC *next, const char *dir,
+	const char *path, off_t maxsize);
+extern void cache_tee_abort(DESC *desc);
+
+extern int convert_file(JOB *job);
+extern int batch_run(const char *list, const char *outdir, const JOB *proto,
+	int nthreads);
+
 extern int parse_arg_format_enc(const char *arg, int *format, int *enc);
 extern const char *format_tostr(const int format);
 extern const char *enc_tostr(const int enc);
+extern int format_fromext(const char *fname);
+extern const char *format_toext(const int format);
+extern int enc_stride(int enc);
 
 /* ----- variables ----- */
 
 extern int opt_v;
+extern int opt_rt;
 extern char *opt_firmware;
 
@@ -0,0 +1,953 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* lunaplayd: XP playback daemon */
+
+/*
+ * /dev/xp を開いたままにして (ファームウェアは最初に 1 度だけ入れる)、
+ * 複数のクライアントの音を混ぜて鳴らす。プロトコルは lunaplayd.h。
+ *
+ * クライアントごとのリングから LPD_MIXFRAMES ずつ取って int32 で足し、
+ * 16bit に飽和させてから u8 にし、liblunaplay でデバイスの
+ * エンコーディングに 1 度だけ変換する。データの来ていないクライアントは
+ * 無音として混ぜ、他のクライアントを待たせない。
+ *
+ * XP は止められず、書かなければ最後の 2 ページを繰り返すので、
+ * クライアントがいる間は無音でも書き続け、いなくなったら drain する。
+ *
+ * -D では /dev/xp の代わりに、XP のダブルバッファと同じ速さで
+ * ページを受け取ってファイルに書く代役を使う (Linux でも試せる)。
+ *
+ * 1 スレッドで poll して回す。
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+#include "liblunaplay.h"
+#include "lunaplayd.h"
+
+#define VERSION "0.1"
+
+// 同時につなげるクライアント
+#define LPD_MAXCLIENTS	(16)
+// 1 回に混ぜるサンプル数
+#define LPD_MIXFRAMES	(1024)
+// デバイスの空きを待つ間隔
+#define LPD_POLL_MSEC	(5)
+
+struct client {
+	int fd;					// -1 なら空き
+	int id;
+	struct lpd_ring *ring;
+	size_t mapsize;
+	uint32_t rpos;			// 読んだ位置 (リングの rpos はクライアント向けの写し)
+	bool closing;			// ソケットが閉じた。残りを鳴らしたら捨てる
+	bool draining;			// リングが空になったら LPD_DRAINED を返す
+	int64_t mixed;			// 混ぜたサンプル数
+	int64_t underrun;		// 足りなかった回数
+};
+
+// 出力 (XP か代役)
+struct output {
+	LUNAPLAY *lp;			// XP (NULL なら代役)
+	double rate;
+	bool active;			// drain してから書いた
+
+	// 代役 (-D)
+	int fd;					// 書き出し先 (-1 なら捨てる)
+	CONVERTER conv;
+	int stride;
+	uint8_t page[XP_BUFSIZE];
+	size_t fill;
+	int64_t pages;			// 渡したページ数
+	double t0;				// 最初のページを渡した時刻
+	int64_t late;			// アンダーランの回数
+};
+
+int opt_v;		// verbose
+static bool detached;
+static volatile sig_atomic_t terminated;
+static bool failed;			// デバイスのエラーで止めた
+static int sigpipe[2];		// シグナルで poll を起こす
+
+static struct client clients[LPD_MAXCLIENTS];
+static struct output out;
+
+static
+void
+lpd_log(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (detached) {
+		vsyslog(LOG_INFO, fmt, ap);
+	} else {
+		vfprintf(stderr, fmt, ap);
+		fprintf(stderr, "\n");
+	}
+	va_end(ap);
+}
+
+static
+double
+lpd_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static
+void
+lpd_sleep(double sec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)sec;
+	ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static
+void
+lpd_signal(int sig)
+{
+	int e = errno;
+
+	terminated = 1;
+	write(sigpipe[1], "", 1);
+	errno = e;
+}
+
+/* ***** output ***** */
+
+static
+int
+output_open(int enc, int freq, const char *standin)
+{
+	static const struct {
+		int enc;
+		CONVERTER conv;
+	} convs[] = {
+		{ ENC_PCM1, conv_u8_pcm1 },
+		{ ENC_PCM2, conv_u8_pcm2 },
+		{ ENC_PCM3, conv_u8_pcm3 },
+		{ ENC_PAM2, conv_u8_pam2 },
+		{ ENC_PAM3, conv_u8_pam3 },
+	};
+
+	memset(&out, 0, sizeof(out));
+	out.fd = -1;
+
+	if (standin == NULL) {
+		out.lp = lunaplay_open(NULL);
+		if (out.lp == NULL) {
+			fprintf(stderr, "lunaplay_open: %s\n", strerror(errno));
+			return -1;
+		}
+		if (lunaplay_set_format(out.lp, enc, freq) < 0) {
+			fprintf(stderr, "XP: %s\n", strerror(errno));
+			lunaplay_close(out.lp);
+			return -1;
+		}
+		out.rate = lunaplay_rate(out.lp);
+		return 0;
+	}
+
+	for (int i = 0; i < countof(convs); i++) {
+		if (convs[i].enc == enc) {
+			out.conv = convs[i].conv;
+		}
+	}
+	if (out.conv == NULL) {
+		fprintf(stderr, "%s: not supported\n", enc_tostr(enc));
+		return -1;
+	}
+	out.stride = enc_stride(enc);
+	out.rate = freq;
+	if (strcmp(standin, "-") != 0) {
+		out.fd = open(standin, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out.fd == -1) {
+			fprintf(stderr, "%s: %s\n", standin, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// 代役: 埋まったページを XP に渡したことにする
+static
+void
+standin_commit()
+{
+	double pagedur = (double)(XP_BUFSIZE / out.stride) / out.rate;
+	double t = lpd_now();
+
+	if (out.pages == 0) {
+		out.t0 = t;
+	} else if (t > out.t0 + out.pages * pagedur) {
+		// 渡したページをすべて再生し終えていた。XP は前のページを
+		// 繰り返しているので、ここから再生し直したことにする
+		out.late++;
+		out.t0 = t - (out.pages - 1) * pagedur;
+	}
+	if (out.fd != -1 && write(out.fd, out.page, XP_BUFSIZE) != XP_BUFSIZE) {
+		lpd_log("stand-in write: %s", strerror(errno));
+		close(out.fd);
+		out.fd = -1;
+	}
+	out.pages++;
+	out.fill = 0;
+}
+
+/*
+ u8 のサンプルを n 個まで、待たずに渡せるだけ渡します。
+ 渡した数を返します。
+ */
+static
+size_t
+output_write(const uint8_t *u8, size_t n)
+{
+	out.active = true;
+	if (out.lp != NULL) {
+		ssize_t r = lunaplay_write(out.lp, u8, n, LUNAPLAY_NONBLOCK);
+		if (r < 0) {
+			if (errno != EAGAIN) {
+				// XP が止まった。続けられない
+				lpd_log("XP: %s", strerror(errno));
+				failed = true;
+				terminated = 1;
+			}
+			return 0;
+		}
+		return r;
+	}
+
+	size_t done = 0;
+	double pagedur = (double)(XP_BUFSIZE / out.stride) / out.rate;
+	while (done < n) {
+		// ページ k は、ページ k-2 の再生が終わるまで書けない
+		if (out.fill == 0 && out.pages >= 2 &&
+		    lpd_now() < out.t0 + (out.pages - 1) * pagedur) {
+			break;
+		}
+		size_t len = (XP_BUFSIZE - out.fill) / out.stride;
+		if (len > n - done) {
+			len = n - done;
+		}
+		BUFFER src;
+		BUFFER dst;
+		memset(&src, 0, sizeof(src));
+		memset(&dst, 0, sizeof(dst));
+		src.ptr = (uint8_t *)u8 + done;
+		src.length = len;
+		src.bufsize = len;
+		dst.ptr = out.page + out.fill;
+		dst.bufsize = XP_BUFSIZE - out.fill;
+		out.conv(&dst, &src);
+		out.fill += dst.length;
+		done += len;
+		if (out.fill == XP_BUFSIZE) {
+			standin_commit();
+		}
+	}
+	return done;
+}
+
+/*
+ 渡したものを鳴らし終えるまで待ち、無音にします。
+ */
+static
+void
+output_drain()
+{
+	if (!out.active) {
+		return;
+	}
+	out.active = false;
+	if (out.lp != NULL) {
+		lunaplay_drain(out.lp);
+		return;
+	}
+
+	if (out.fill > 0) {
+		BUFFER buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.ptr = out.page;
+		buf.bufsize = XP_BUFSIZE;
+		buf.length = out.fill;
+		filltail(&buf, out.stride);
+		standin_commit();
+	}
+	if (out.pages > 0) {
+		double pagedur = (double)(XP_BUFSIZE / out.stride) / out.rate;
+		double wait = out.t0 + out.pages * pagedur - lpd_now();
+		if (wait > 0) {
+			lpd_sleep(wait);
+		}
+	}
+	// 次は再生し直し
+	out.pages = 0;
+}
+
+static
+void
+output_close()
+{
+	output_drain();
+	if (out.lp != NULL) {
+		lunaplay_close(out.lp);
+	}
+	if (out.fd != -1) {
+		close(out.fd);
+	}
+	if (out.late > 0) {
+		lpd_log("stand-in: %jd underruns", (intmax_t)out.late);
+	}
+}
+
+/* ***** clients ***** */
+
+static
+int
+lpd_send(int fd, uint32_t cmd, uint32_t arg, int passfd)
+{
+	struct lpd_msg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+
+	msg.cmd = cmd;
+	msg.arg = arg;
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (passfd != -1) {
+		memset(&cm, 0, sizeof(cm));
+		mh.msg_control = cm.buf;
+		mh.msg_controllen = sizeof(cm.buf);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(c), &passfd, sizeof(int));
+	}
+	if (sendmsg(fd, &mh, 0) != sizeof(msg)) {
+		return -1;
+	}
+	return 0;
+}
+
+// リングを作って c に割り当て、fd を返す
+static
+int
+client_ring(struct client *c)
+{
+	static int serial;
+	char name[64];
+
+	snprintf(name, sizeof(name), "/lunaplayd.%d.%d", (int)getpid(), serial++);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+	// fd を渡せば名前は要らない
+	shm_unlink(name);
+
+	size_t size = sizeof(struct lpd_ring) + LPD_RINGSIZE * sizeof(int16_t);
+	if (ftruncate(fd, size) == -1) {
+		goto error;
+	}
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		goto error;
+	}
+	c->ring = p;
+	c->mapsize = size;
+	c->ring->magic = LPD_RING_MAGIC;
+	c->ring->size = LPD_RINGSIZE;
+	c->ring->rate = (uint32_t)(out.rate + 0.5);
+	atomic_init(&c->ring->wpos, 0);
+	atomic_init(&c->ring->rpos, 0);
+	return fd;
+
+ error:
+	close(fd);
+	return -1;
+}
+
+static
+void
+client_free(struct client *c)
+{
+	if (opt_v) {
+		lpd_log("client %d: closed, %jd samples, %jd underruns",
+			c->id, (intmax_t)c->mixed, (intmax_t)c->underrun);
+	}
+	if (c->fd != -1) {
+		close(c->fd);
+	}
+	if (c->ring != NULL) {
+		munmap(c->ring, c->mapsize);
+	}
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static
+void
+client_accept(int lfd)
+{
+	static int nextid;
+
+	int fd = accept(lfd, NULL, NULL);
+	if (fd == -1) {
+		return;
+	}
+	for (int i = 0; i < LPD_MAXCLIENTS; i++) {
+		struct client *c = &clients[i];
+		if (c->fd == -1 && c->ring == NULL) {
+			// 前に使っていたクライアントのフラグを残さない
+			memset(c, 0, sizeof(*c));
+			c->fd = fd;
+			c->id = nextid++;
+			if (opt_v) {
+				lpd_log("client %d: connected", c->id);
+			}
+			return;
+		}
+	}
+	lpd_send(fd, LPD_ERROR, EBUSY, -1);
+	close(fd);
+}
+
+// クライアントからのメッセージを処理する
+static
+void
+client_recv(struct client *c)
+{
+	struct lpd_msg msg;
+
+	ssize_t r = recv(c->fd, &msg, sizeof(msg), 0);
+	if (r != sizeof(msg)) {
+		if (c->ring == NULL) {
+			// HELLO の前に閉じた (lpd_listen の確認など)
+			client_free(c);
+			return;
+		}
+		// 閉じた (か壊れた)。リングの残りは鳴らす
+		close(c->fd);
+		c->fd = -1;
+		c->closing = true;
+		return;
+	}
+	switch (msg.cmd) {
+	 case LPD_HELLO:
+		if (msg.arg != LPD_VERSION || c->ring != NULL) {
+			lpd_send(c->fd, LPD_ERROR, EPROTO, -1);
+			break;
+		}
+		int rfd = client_ring(c);
+		if (rfd == -1) {
+			lpd_send(c->fd, LPD_ERROR, errno, -1);
+			break;
+		}
+		lpd_send(c->fd, LPD_WELCOME, c->ring->rate, rfd);
+		close(rfd);
+		break;
+	 case LPD_DRAIN:
+		c->draining = true;
+		break;
+	 default:
+		lpd_send(c->fd, LPD_ERROR, EINVAL, -1);
+		break;
+	}
+}
+
+/* ***** mixer ***** */
+
+/*
+ すべてのクライアントから n サンプルずつ混ぜて、u8 で dst に書きます。
+ */
+static
+void
+mix(uint8_t *dst, int n)
+{
+	int32_t acc[LPD_MIXFRAMES];
+
+	memset(acc, 0, sizeof(acc[0]) * n);
+	for (int i = 0; i < LPD_MAXCLIENTS; i++) {
+		struct client *c = &clients[i];
+		if (c->ring == NULL) {
+			continue;
+		}
+		// リングはクライアントも書けるので、size と rpos は信用しない
+		struct lpd_ring *ring = c->ring;
+		uint32_t w = atomic_load_explicit(&ring->wpos, memory_order_acquire);
+		uint32_t r = c->rpos;
+		uint32_t avail = w - r;
+		if (avail > LPD_RINGSIZE) {
+			// クライアントが壊した
+			avail = 0;
+			c->closing = true;
+		}
+		int k = avail < n ? avail : n;
+		if (k < n && w > 0 && !c->closing && !c->draining) {
+			c->underrun++;
+		}
+		for (int j = 0; j < k; j++) {
+			acc[j] += ring->data[(r + j) & (LPD_RINGSIZE - 1)];
+		}
+		c->rpos = r + k;
+		atomic_store_explicit(&ring->rpos, c->rpos, memory_order_release);
+		c->mixed += k;
+	}
+	for (int j = 0; j < n; j++) {
+		// 飽和させる
+		int32_t v = acc[j];
+		if (v > 32767) {
+			v = 32767;
+		} else if (v < -32768) {
+			v = -32768;
+		}
+		dst[j] = (uint8_t)((v >> 8) + 128);
+	}
+}
+
+/*
+ 空になったリングの LPD_DRAINED を返し、閉じたクライアントを捨てます。
+ まだ鳴らすクライアントの数を返します。
+ */
+static
+int
+client_check()
+{
+	int n = 0;
+
+	for (int i = 0; i < LPD_MAXCLIENTS; i++) {
+		struct client *c = &clients[i];
+		if (c->fd == -1 && c->ring == NULL) {
+			continue;
+		}
+		bool empty = true;
+		if (c->ring != NULL) {
+			uint32_t avail = atomic_load_explicit(&c->ring->wpos,
+				memory_order_acquire) - c->rpos;
+			// 壊れた wpos (mix で捨てる) も空とみなす
+			empty = avail == 0 || avail > LPD_RINGSIZE;
+		}
+		if (c->draining && empty && c->fd != -1) {
+			c->draining = false;
+			lpd_send(c->fd, LPD_DRAINED, 0, -1);
+		}
+		if (c->closing && empty) {
+			client_free(c);
+			continue;
+		}
+		if (c->ring != NULL) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* ***** daemon ***** */
+
+static
+int
+lpd_listen(const char *path)
+{
+	struct sockaddr_un sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errx(1, "%s: path too long", path);
+	}
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		err(1, "socket");
+	}
+	// 前の lunaplayd が残したソケットなら消す
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+		errx(1, "%s: lunaplayd already running", path);
+	}
+	close(fd);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		err(1, "socket");
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		err(1, "bind %s", path);
+	}
+	// ローカルの誰でも鳴らせる
+	chmod(path, 0666);
+	if (listen(fd, LPD_MAXCLIENTS) == -1) {
+		err(1, "listen");
+	}
+	return fd;
+}
+
+static
+int
+lpd_run(const char *path)
+{
+	struct pollfd pfd[2 + LPD_MAXCLIENTS];
+	struct client *pcl[2 + LPD_MAXCLIENTS];
+	uint8_t buf[LPD_MIXFRAMES];
+	size_t pending = 0;		// buf の残り
+	size_t pos = 0;
+
+	int lfd = lpd_listen(path);
+	for (int i = 0; i < LPD_MAXCLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+	lpd_log("lunaplayd: %s %s, %.1f Hz",
+		out.lp != NULL ? "XP" : "stand-in", path, out.rate);
+
+	while (!terminated) {
+		int nplay = client_check();
+		if (nplay > 0) {
+			// デバイスが受け取るだけ混ぜて渡す
+			for (;;) {
+				if (pending == 0) {
+					mix(buf, LPD_MIXFRAMES);
+					pending = LPD_MIXFRAMES;
+					pos = 0;
+				}
+				size_t r = output_write(buf + pos, pending);
+				pos += r;
+				pending -= r;
+				if (pending > 0) {
+					break;
+				}
+			}
+		} else {
+			// 最後のクライアントの分を鳴らし終えて無音にする
+			while (pending > 0 && !terminated) {
+				size_t r = output_write(buf + pos, pending);
+				pos += r;
+				pending -= r;
+				if (pending > 0) {
+					lpd_sleep(LPD_POLL_MSEC / 1000.0);
+				}
+			}
+			output_drain();
+		}
+
+		int n = 0;
+		pfd[n].fd = sigpipe[0];
+		pfd[n].events = POLLIN;
+		pcl[n++] = NULL;
+		pfd[n].fd = lfd;
+		pfd[n].events = POLLIN;
+		pcl[n++] = NULL;
+		for (int i = 0; i < LPD_MAXCLIENTS; i++) {
+			if (clients[i].fd != -1) {
+				pfd[n].fd = clients[i].fd;
+				pfd[n].events = POLLIN;
+				pcl[n++] = &clients[i];
+			}
+		}
+		int r = poll(pfd, n, nplay > 0 ? LPD_POLL_MSEC : -1);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "poll");
+		}
+		for (int i = 0; i < n; i++) {
+			if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+				continue;
+			}
+			if (pfd[i].fd == sigpipe[0]) {
+				// terminated を見て抜ける
+			} else if (pcl[i] == NULL) {
+				client_accept(lfd);
+			} else {
+				client_recv(pcl[i]);
+			}
+		}
+	}
+
+	for (int i = 0; i < LPD_MAXCLIENTS; i++) {
+		if (clients[i].fd != -1 || clients[i].ring != NULL) {
+			client_free(&clients[i]);
+		}
+	}
+	close(lfd);
+	unlink(path);
+	output_close();
+	return failed ? -1 : 0;
+}
+
+/* ***** client (-c) ***** */
+
+static
+int
+lpd_client(const char *path)
+{
+	struct sockaddr_un sun;
+	struct lpd_msg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	int16_t tmp[LPD_MIXFRAMES];
+	size_t tmplen = 0;		// tmp の中のバイト数
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		err(1, "socket");
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		err(1, "connect %s", path);
+	}
+
+	msg.cmd = LPD_HELLO;
+	msg.arg = LPD_VERSION;
+	if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+		err(1, "send");
+	}
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cm.buf;
+	mh.msg_controllen = sizeof(cm.buf);
+	if (recvmsg(fd, &mh, 0) != sizeof(msg)) {
+		errx(1, "lunaplayd closed");
+	}
+	if (msg.cmd == LPD_ERROR) {
+		errno = msg.arg;
+		err(1, "lunaplayd");
+	}
+	struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+	if (msg.cmd != LPD_WELCOME || c == NULL || c->cmsg_type != SCM_RIGHTS) {
+		errx(1, "lunaplayd: protocol error");
+	}
+	int rfd;
+	memcpy(&rfd, CMSG_DATA(c), sizeof(int));
+	struct stat st;
+	if (fstat(rfd, &st) == -1) {
+		err(1, "fstat");
+	}
+	struct lpd_ring *ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, rfd, 0);
+	if (ring == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	close(rfd);
+	if (ring->magic != LPD_RING_MAGIC) {
+		errx(1, "lunaplayd: bad ring");
+	}
+	if (opt_v) {
+		fprintf(stderr, "rate %u Hz, ring %u samples\n",
+			ring->rate, ring->size);
+	}
+
+	// 標準入力の s16 をリングに書く
+	for (;;) {
+		ssize_t r = read(STDIN_FILENO, (uint8_t *)tmp + tmplen,
+			sizeof(tmp) - tmplen);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "read");
+		}
+		if (r == 0) {
+			break;
+		}
+		tmplen += r;
+		size_t n = tmplen / sizeof(int16_t);
+		size_t done = 0;
+		while (done < n) {
+			uint32_t w = atomic_load_explicit(&ring->wpos,
+				memory_order_relaxed);
+			uint32_t rp = atomic_load_explicit(&ring->rpos,
+				memory_order_acquire);
+			size_t space = ring->size - (w - rp);
+			if (space == 0) {
+				lpd_sleep(LPD_POLL_MSEC / 1000.0);
+				continue;
+			}
+			if (space > n - done) {
+				space = n - done;
+			}
+			for (size_t i = 0; i < space; i++) {
+				ring->data[(w + i) & (ring->size - 1)] = tmp[done + i];
+			}
+			atomic_store_explicit(&ring->wpos, w + space,
+				memory_order_release);
+			done += space;
+		}
+		// 半端なバイトは次に回す
+		memmove(tmp, (uint8_t *)tmp + n * sizeof(int16_t),
+			tmplen - n * sizeof(int16_t));
+		tmplen -= n * sizeof(int16_t);
+	}
+
+	msg.cmd = LPD_DRAIN;
+	msg.arg = 0;
+	if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+		err(1, "send");
+	}
+	do {
+		if (recv(fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+			errx(1, "lunaplayd closed");
+		}
+	} while (msg.cmd != LPD_DRAINED);
+	close(fd);
+	return 0;
+}
+
+_Noreturn
+static
+void
+usage()
+{
+	fprintf(stderr,
+"LUNA XP playback daemon version %s\n"
+"%s [-dv] [-D file] [-f freq] [-o enc] [-s socket]\n"
+"%s -c [-v] [-s socket] < raw\n"
+"\n"
+"options\n"
+"  -c    client; play signed 16bit native endian mono samples from\n"
+"        stdin at the daemon rate\n"
+"  -D<file>\n"
+"        stand-in device; take pages at the XP rate and write them to\n"
+"        file (\"-\" to discard) instead of /dev/xp\n"
+"  -d    detach and log to syslog\n"
+"  -f<freq>\n"
+"        device frequency(Hz), postfix 'k' = kHz (default 22050)\n"
+"  -o<enc>\n"
+"        device encoding PCM1, PCM2, PCM3, PAM2, PAM3 (default PAM3)\n"
+"  -s<socket>\n"
+"        socket path (default %s)\n"
+"  -v    verbose\n"
+		,
+		VERSION,
+		getprogname(),
+		getprogname(),
+		LPD_SOCKET
+	);
+	exit(1);
+}
+
+int
+main(int ac, char *av[])
+{
+	int c;
+	char *endp;
+	double dfreq;
+	int format;
+	const char *path = LPD_SOCKET;
+	const char *standin = NULL;
+	bool client = false;
+	bool detach = false;
+	int enc = ENC_PAM3;
+	int freq = 22050;
+
+	while ((c = getopt(ac, av, "cD:df:o:s:vh")) != -1) {
+		switch (c) {
+		 case 'c':
+			client = true;
+			break;
+		 case 'D':
+			standin = optarg;
+			break;
+		 case 'd':
+			detach = true;
+			break;
+		 case 'f':
+			dfreq = strtod(optarg, &endp);
+			if (*endp == 'k') {
+				dfreq *= 1000;
+			}
+			if (dfreq <= 0) {
+				errx(1, "Invalid frequency: %s", optarg);
+			}
+			freq = (int)dfreq;
+			break;
+		 case 'o':
+			if (parse_arg_format_enc(optarg, &format, &enc) < 0 ||
+			    enc < ENC_PCM1 || enc > ENC_PAM3) {
+				errx(1, "Invalid encoding: %s", optarg);
+			}
+			break;
+		 case 's':
+			path = optarg;
+			break;
+		 case 'v':
+			opt_v++;
+			break;
+		 case 'h':
+		 default:
+			usage();
+		}
+	}
+
+	if (client) {
+		return lpd_client(path);
+	}
+
+	if (output_open(enc, freq, standin) < 0) {
+		return EXIT_FAILURE;
+	}
+	if (detach) {
+		if (daemon(0, 0) == -1) {
+			err(1, "daemon");
+		}
+		openlog("lunaplayd", LOG_PID, LOG_DAEMON);
+		detached = true;
+	}
+	if (pipe(sigpipe) == -1) {
+		err(1, "pipe");
+	}
+	fcntl(sigpipe[1], F_SETFL, O_NONBLOCK);
+	// poll を止めたいので SA_RESTART にしない
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = lpd_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	return lpd_run(path) < 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,53 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* lunaplayd protocol */
+
+/*
+ * クライアントは UNIX ドメインソケット (SOCK_STREAM) で lunaplayd に
+ * つなぎ、LPD_HELLO を送る。lunaplayd は共有メモリのリングを作り、
+ * その fd を SCM_RIGHTS で付けて LPD_WELCOME を返す。
+ *
+ * リングには符号付き 16bit モノラルのサンプルを、デバイスの周波数
+ * (lpd_ring.rate) で書く。wpos と rpos は書いた/読んだサンプルの通算で、
+ * 位置は (pos & (size - 1))。wpos はクライアントだけが、rpos は
+ * lunaplayd だけが進める。lunaplayd は自分の持つ size と rpos を使い、
+ * リングの size と rpos はクライアントに見せるだけ。
+ *
+ * 書き終えたら LPD_DRAIN を送ると、リングが空になって (ミキサに
+ * 入って) から LPD_DRAINED が返る。ソケットを閉じると残りを鳴らして
+ * リングを捨てる。
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define LPD_SOCKET		"/var/run/lunaplayd.sock"
+#define LPD_VERSION		(1)
+
+/* commands (struct lpd_msg.cmd) */
+#define LPD_HELLO		(1)		// client: arg = LPD_VERSION
+#define LPD_WELCOME		(2)		// daemon: arg = rate (Hz), ring fd attached
+#define LPD_DRAIN		(3)		// client: reply when the ring is empty
+#define LPD_DRAINED		(4)		// daemon
+#define LPD_ERROR		(5)		// daemon: arg = errno
+
+struct lpd_msg {
+	uint32_t cmd;
+	uint32_t arg;
+};
+
+#define LPD_RING_MAGIC	(0x4c504452)	// "LPDR"
+#define LPD_RINGSIZE	(32768)			// samples, power of 2
+
+struct lpd_ring {
+	uint32_t magic;
+	uint32_t size;			// samples, power of 2
+	uint32_t rate;			// device rate (Hz)
+	uint32_t pad;
+	atomic_uint wpos;		// samples written (client)
+	atomic_uint rpos;		// samples mixed (daemon)
+	int16_t data[];
+};
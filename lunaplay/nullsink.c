@@ -0,0 +1,310 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* null sink and per-stage timing (benchmark output) */
+
+/*
+ * XP デバイスの代わりに、データを捨てる出力 (-n) と、XP と同じ速さで
+ * 受け取って捨てる出力 (-p) を作る。捨てる前に XP の writer と同じく
+ * ページにコピーだけはする。XP デバイス宛と同じエンコーディング、
+ * フィル、prefill で動くので、入力形式とエンコーディングの組み合わせごとに
+ * XP の前に置いたときの余裕を Linux 上でも LUNA 上でも計れる。
+ *
+ * reader、変換、writer の時間は、それぞれを包んで計る。
+ * パイプラインではスレッドが別なので、合計が経過時間を越えることがある。
+ * CONVERTER は状態を持てないので、包んだ変換は 1 プロセスに 1 つだけ
+ * (-B とは一緒に使えない)。
+ *
+ * -p は XP のダブルバッファを真似る。ページ k は、ページ k-2 の再生が
+ * 終わるまで受け取らない。ページ k-1 の再生が終わっても来なければ
+ * アンダーランとして数える。
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lunaplay.h"
+#include "filehelper.h"
+#include "psgconv.h"
+
+struct nullsink {
+	bool paced;
+	bool started;
+	double t0;			// 再生開始の時刻
+	int64_t frames;		// 受け取ったフレーム数
+	int64_t prevframes;	// ひとつ前のページまでのフレーム数
+	int64_t late;		// アンダーランの回数
+	double maxlag;		// 最大の遅れ (秒)
+	double sleep;		// -p で待った時間
+	uint8_t page[XP_BUFSIZE];	// XP の共有メモリの代わり
+};
+
+// 計測の状態 (1 プロセスに 1 つ)
+static struct {
+	double t0;
+	double rtime;		// reader
+	double ctime;		// 変換
+	double wtime;		// writer (ADPT のページ化を含む)
+	unsigned int nread0;
+	unsigned int nwrite0;
+	DESC *rinner;
+	DESC *winner;
+	CONVERTER conv;
+	struct nullsink *sink;
+} bench;
+
+static int null_write(DESC *desc, BUFFER *buf);
+static int null_close(DESC *desc);
+
+static
+double
+bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static
+void
+bench_sleep(double sec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)sec;
+	ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ データを捨てる writer を desc に作ります。desc の enc と freq は
+ 設定済みであること。paced なら XP と同じ速さで受け取ります。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+null_write_init(DESC *desc, bool paced)
+{
+	struct nullsink *ns = calloc(1, sizeof(struct nullsink));
+	if (ns == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	ns->paced = paced;
+	rt_prefault(ns->page, sizeof(ns->page));
+
+	desc->fd = -1;
+	desc->priv = ns;
+	desc->writer = null_write;
+	desc->closer = null_close;
+	bench.sink = ns;
+	bench.t0 = bench_now();
+	io_counts(&bench.nread0, &bench.nwrite0);
+	return 0;
+}
+
+// buf に入っているフレーム数
+static
+int64_t
+null_frames(DESC *desc, BUFFER *buf)
+{
+	if (desc->enc == ENC_ADPT) {
+		// ページの先頭のフォーマットで決まる
+		return adpt_frames(buf);
+	}
+	return buf->length / enc_stride(desc->enc);
+}
+
+static
+int
+null_write(DESC *desc, BUFFER *buf)
+{
+	struct nullsink *ns = desc->priv;
+	int n = buf->length;
+	int64_t frames = null_frames(desc, buf);
+
+	if (ns->paced) {
+		double t = bench_now();
+		if (!ns->started) {
+			// XP は最初のページを受け取ったところで再生を始める
+			ns->started = true;
+			ns->t0 = t;
+		} else {
+			// ひとつ前のページの再生が終わっていれば間に合っていない
+			double lag = t - (ns->t0 + (double)ns->frames / desc->freq);
+			if (lag > 0) {
+				trace_mark(TRACE_WAIT, "underrun");
+				ns->late++;
+				if (lag > ns->maxlag) {
+					ns->maxlag = lag;
+				}
+				// XP は止まらないので、ここから再生し直したことにする
+				ns->t0 += lag;
+			}
+			// 2 つ前のページの再生が終わるまで待つ
+			double deadline = ns->t0 + (double)ns->prevframes / desc->freq;
+			double wait = deadline - t;
+			if (wait > 0) {
+				uint64_t tw = trace_begin();
+				bench_sleep(wait);
+				trace_end(TRACE_WAIT, tw);
+				ns->sleep += wait;
+				// 寝過ごした分
+				rt_jitter(bench_now() - deadline);
+			}
+		}
+	}
+	// XP の writer と同じく共有メモリにコピーするだけの手間はかける
+	uint64_t tc = trace_begin();
+	memcpy(ns->page, buf->ptr, n < sizeof(ns->page) ? n : sizeof(ns->page));
+	trace_end(TRACE_COPY, tc);
+	ns->prevframes = ns->frames;
+	ns->frames += frames;
+	buf->length = 0;
+	return n;
+}
+
+static
+int
+null_close(DESC *desc)
+{
+	struct nullsink *ns = desc->priv;
+
+	if (ns->paced && ns->started) {
+		// 最後のページの再生が終わるまで
+		double wait = ns->t0 + (double)ns->frames / desc->freq - bench_now();
+		if (wait > 0) {
+			bench_sleep(wait);
+			ns->sleep += wait;
+		}
+	}
+	return 0;
+}
+
+/* ***** stage timing ***** */
+
+static
+int
+bench_read(DESC *desc, BUFFER *buf)
+{
+	double t = bench_now();
+	int r = bench.rinner->reader(bench.rinner, buf);
+	bench.rtime += bench_now() - t;
+	return r;
+}
+
+static
+int
+bench_rclose(DESC *desc)
+{
+	return bench.rinner->closer(bench.rinner);
+}
+
+static
+void
+bench_conv(BUFFER *dst, BUFFER *src)
+{
+	double t = bench_now();
+	bench.conv(dst, src);
+	bench.ctime += bench_now() - t;
+}
+
+static
+int
+bench_write(DESC *desc, BUFFER *buf)
+{
+	double t = bench_now();
+	int r = bench.winner->writer(bench.winner, buf);
+	bench.wtime += bench_now() - t;
+	return r;
+}
+
+static
+int
+bench_wclose(DESC *desc)
+{
+	// ADPT は閉じるときに残りを書く
+	double t = bench_now();
+	int r = bench.winner->closer(bench.winner);
+	bench.wtime += bench_now() - t;
+	return r;
+}
+
+/*
+ next の writer の時間を計る writer を desc に作ります。
+ */
+void
+bench_wrap_writer(DESC *desc, DESC *next)
+{
+	bench.winner = next;
+	*desc = *next;
+	desc->writer = bench_write;
+	desc->closer = bench_wclose;
+}
+
+/*
+ inner の reader と *conv の時間を計るように、desc と *conv を置き換えます。
+ conv_pass はそのままにします (パイプラインが変換段を省くため)。
+ */
+void
+bench_wrap_reader(DESC *desc, DESC *inner, CONVERTER *conv)
+{
+	bench.rinner = inner;
+	*desc = *inner;
+	desc->reader = bench_read;
+	desc->closer = bench_rclose;
+	desc->seeker = NULL;
+	if (*conv != conv_pass) {
+		bench.conv = *conv;
+		*conv = bench_conv;
+	}
+}
+
+/*
+ null sink の結果を表示します。出力を閉じた後に呼ぶこと。
+ */
+void
+bench_report(const DESC *out)
+{
+	struct nullsink *ns = bench.sink;
+	unsigned int nread, nwrite;
+
+	if (ns == NULL) {
+		return;
+	}
+	double wall = bench_now() - bench.t0;
+	double audio = (double)ns->frames / out->freq;
+	io_counts(&nread, &nwrite);
+	nread -= bench.nread0;
+	nwrite -= bench.nwrite0;
+
+	printf("null sink      :%s, %s %dHz\n",
+		ns->paced ? "paced" : "full speed", enc_tostr(out->enc), out->freq);
+	printf("frames         :%jd (%.2f sec)\n", (intmax_t)ns->frames, audio);
+	printf("elapsed        :%.3f sec\n", wall);
+	if (ns->paced) {
+		// 待った時間を除いたものが余裕
+		double busy = wall - ns->sleep;
+		printf("realtime       :x%.2f (busy %.3f sec)\n",
+			busy > 0 ? audio / busy : 0, busy);
+		printf("underrun       :%jd (max lag %.1f msec)\n",
+			(intmax_t)ns->late, ns->maxlag * 1000);
+	} else {
+		printf("realtime       :x%.2f\n", wall > 0 ? audio / wall : 0);
+	}
+	printf("reader         :%.3f sec (%.1f%%)\n",
+		bench.rtime, wall > 0 ? bench.rtime * 100 / wall : 0);
+	printf("converter      :%.3f sec (%.1f%%)\n",
+		bench.ctime, wall > 0 ? bench.ctime * 100 / wall : 0);
+	printf("writer         :%.3f sec (%.1f%%)\n",
+		bench.wtime - ns->sleep,
+		wall > 0 ? (bench.wtime - ns->sleep) * 100 / wall : 0);
+	printf("syscalls       :read %u, write %u (%.1f/sec of audio)\n",
+		nread, nwrite, audio > 0 ? (nread + nwrite) / audio : 0);
+
+	free(ns);
+	bench.sink = NULL;
+}
@@ -0,0 +1,229 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* intra-file parallel conversion (offline) */
+
+/*
+ * 入力のデータ部分をフレーム単位の大きな範囲 (チャンク) に分け、
+ * 各スレッドが自分の fd で読み、変換し、出力の計算済みの位置に
+ * pwrite で書く。チャンクは共有カウンタから順に取るので、
+ * 速いスレッドが多く処理する。
+ *
+ * 条件
+ * - reader がフレーム単位で状態を持たない (desc->splittable)
+ * - 出力の 1 サンプルのバイト数が固定で、ヘッダの後に続くだけ
+ *   (PSGPCM)
+ *
+ * 状態を持つ段 (ディザ、リサンプラ等) を入れる場合は、
+ * チャンクの前の PARALLEL_WARMUP フレームから処理して、
+ * その分の出力を捨てることで状態を馴染ませる。
+ * 許容誤差はその段で決めること。
+ * 今の変換はサンプルごとのテーブル引きで状態を持たないので、
+ * WARMUP は 0 で、出力は逐次実行とビット単位で一致する。
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lunaplay.h"
+#include "filehelper.h"
+
+// 状態を持つ段のための助走フレーム数
+#define PARALLEL_WARMUP		(0)
+// チャンクの最小フレーム数
+#define PARALLEL_MINCHUNK	(64 * XP_BUFSIZE)
+
+struct parallel {
+	const DESC *in;
+	CONVERTER conv;
+	const char *in_file;
+	int out_fd;
+	int ostride;		// 出力 1 サンプルのバイト数
+	off_t datastart;	// 入力のデータ開始位置
+	off_t outstart;		// 出力のデータ開始位置
+	int64_t frames;		// 入力の総フレーム数
+	int64_t chunkframes;
+	int nchunks;
+	atomic_int next;	// 次のチャンク
+	atomic_bool failed;
+};
+
+// 1 チャンクを変換して書く
+static
+int
+parallel_chunk(struct parallel *p, DESC *c, BUFFER *src, BUFFER *dst, int k)
+{
+	int64_t start = k * p->chunkframes;
+	int64_t count = p->frames - start;
+	if (count > p->chunkframes) {
+		count = p->chunkframes;
+	}
+	int64_t warm = start < PARALLEL_WARMUP ? start : PARALLEL_WARMUP;
+
+	off_t pos = p->datastart + (start - warm) * c->framesize;
+	if (lseek(c->fd, pos, SEEK_SET) != pos) {
+		return -1;
+	}
+	c->remain = (count + warm) * c->framesize;
+
+	off_t outoff = p->outstart + start * p->ostride;
+	size_t discard = warm * p->ostride;
+	for (;;) {
+		if (atomic_load_explicit(&p->failed, memory_order_relaxed)) {
+			return -1;
+		}
+		src->length = 0;
+		dst->length = 0;
+		int r = c->reader(c, src);
+		if (r < 0) {
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		p->conv(dst, src);
+
+		uint8_t *d = dst->ptr;
+		size_t len = dst->length;
+		if (discard > 0) {
+			size_t n = discard < len ? discard : len;
+			d += n;
+			len -= n;
+			discard -= n;
+		}
+		if (len > 0) {
+			if (pwritebuf(p->out_fd, d, len, outoff) < 0) {
+				return -1;
+			}
+			outoff += len;
+		}
+	}
+	return 0;
+}
+
+static
+void *
+parallel_main(void *arg)
+{
+	struct parallel *p = arg;
+	DESC c0, *c = &c0;
+	BUFFER src0, *src = &src0;
+	BUFFER dst0, *dst = &dst0;
+
+	// reader の状態は fd, remain, tmp だけなので、それを差し替える
+	*c = *p->in;
+	c->fd = open(p->in_file, O_RDONLY);
+	c->tmp = malloc(XP_BUFSIZE * c->framesize);
+	memset(dst, 0, sizeof(*dst));
+	dst->bufsize = XP_BUFSIZE;
+	dst->ptr = malloc(dst->bufsize);
+	memset(src, 0, sizeof(*src));
+	src->bufsize = XP_BUFSIZE / p->ostride;
+	src->ptr = malloc(src->bufsize);
+	if (c->fd == -1 || c->tmp == NULL || dst->ptr == NULL || src->ptr == NULL) {
+		fprintf(stderr, "parallel: %s\n", strerror(errno));
+		atomic_store(&p->failed, true);
+		goto done;
+	}
+
+	for (;;) {
+		int k = atomic_fetch_add(&p->next, 1);
+		if (k >= p->nchunks) {
+			break;
+		}
+		if (parallel_chunk(p, c, src, dst, k) < 0) {
+			if (!atomic_exchange(&p->failed, true)) {
+				fprintf(stderr, "parallel: chunk %d: %s\n", k, strerror(errno));
+			}
+			break;
+		}
+	}
+
+ done:
+	if (c->fd != -1) {
+		close(c->fd);
+	}
+	free(c->tmp);
+	free(src->ptr);
+	free(dst->ptr);
+	return NULL;
+}
+
+/*
+ in の残りのデータを nthreads スレッドで変換し、out に書きます。
+ in はヘッダを読み終えた状態、out はヘッダを書き終えた状態であること。
+ in, out の fd の位置は変えません (閉じるのは呼び出し側)。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+parallel_run(DESC *in, DESC *out, CONVERTER conv, const char *in_file,
+	int nthreads)
+{
+	struct parallel p0, *p = &p0;
+	struct stat st;
+
+	memset(p, 0, sizeof(*p));
+	p->in = in;
+	p->conv = conv;
+	p->in_file = in_file;
+	p->out_fd = out->fd;
+	p->ostride = enc_stride(out->enc);
+	atomic_init(&p->next, 0);
+	atomic_init(&p->failed, false);
+
+	p->datastart = lseek(in->fd, 0, SEEK_CUR);
+	p->outstart = lseek(out->fd, 0, SEEK_CUR);
+	if (p->datastart < 0 || p->outstart < 0 || fstat(in->fd, &st) < 0) {
+		fprintf(stderr, "parallel: %s\n", strerror(errno));
+		return -1;
+	}
+	off_t databytes = st.st_size - p->datastart;
+	if (in->remain >= 0 && in->remain < databytes) {
+		databytes = in->remain;
+	}
+	p->frames = databytes / in->framesize;
+
+	// スレッド数の数倍に分けて、速さの差をならす
+	int64_t n = p->frames / (nthreads * 4);
+	n = (n + XP_BUFSIZE - 1) / XP_BUFSIZE * XP_BUFSIZE;
+	if (n < PARALLEL_MINCHUNK) {
+		n = PARALLEL_MINCHUNK;
+	}
+	p->chunkframes = n;
+	p->nchunks = (p->frames + n - 1) / n;
+	if (nthreads > p->nchunks) {
+		nthreads = p->nchunks;
+	}
+	if (opt_v) {
+		printf("parallel: %jd frames, %d chunks of %jd, %d threads\n",
+			(intmax_t)p->frames, p->nchunks, (intmax_t)n, nthreads);
+	}
+
+	pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+	if (th == NULL) {
+		fprintf(stderr, "parallel: %s\n", strerror(errno));
+		return -1;
+	}
+	int nstarted = 0;
+	for (int t = 0; t < nthreads; t++) {
+		if (pthread_create(&th[t], NULL, parallel_main, p) != 0) {
+			break;
+		}
+		nstarted++;
+	}
+	if (nstarted == 0) {
+		parallel_main(p);
+	}
+	for (int t = 0; t < nstarted; t++) {
+		pthread_join(th[t], NULL);
+	}
+	free(th);
+
+	return atomic_load(&p->failed) ? -1 : 0;
+}
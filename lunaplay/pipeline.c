@@ -0,0 +1,340 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* threaded read/convert/write pipeline */
+
+/*
+ * reader -> converter -> writer をそれぞれ別スレッドで動かし、
+ * 間を single-producer/single-consumer のリングでつなぐ。
+ * リングのスロットは BUFFER を事前に確保しておき、使いまわす。
+ *
+ * 終端とエラーはスロットの stat で下流に伝える。
+ * 下流でエラーが起きた場合は abort フラグで上流を止める。
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+
+enum {
+	SLOT_DATA = 0,
+	SLOT_EOS,
+	SLOT_ERROR,
+};
+
+struct slot {
+	BUFFER buf;
+	int stat;
+	int error;			// errno (SLOT_ERROR)
+};
+
+struct ring {
+	int depth;
+	struct slot *slot;
+	atomic_uint head;	// producer が進める
+	atomic_uint tail;	// consumer が進める
+	atomic_bool done;	// producer が EOS/ERROR を置いた
+};
+
+struct pipeline {
+	DESC *in;
+	DESC *out;
+	CONVERTER conv;		// NULL ならコンバータ段を省略
+	int fillstride;		// !=0 なら最後のバッファを埋める
+	struct ring rd;		// reader -> converter
+	struct ring wr;		// converter -> writer
+	atomic_bool abort;
+};
+
+/* ***** ring ***** */
+
+static
+int
+ring_init(struct ring *r, int depth, size_t bufsize)
+{
+	r->depth = depth;
+	r->slot = calloc(depth, sizeof(struct slot));
+	if (r->slot == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < depth; i++) {
+		r->slot[i].buf.bufsize = bufsize;
+		r->slot[i].buf.ptr = malloc(bufsize);
+		r->slot[i].buf.isfree = true;
+		if (r->slot[i].buf.ptr == NULL) {
+			return -1;
+		}
+		rt_prefault(r->slot[i].buf.ptr, bufsize);
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->done, false);
+	return 0;
+}
+
+static
+void
+ring_free(struct ring *r)
+{
+	if (r->slot == NULL) {
+		return;
+	}
+	for (int i = 0; i < r->depth; i++) {
+		buffer_free(&r->slot[i].buf);
+	}
+	free(r->slot);
+}
+
+static
+unsigned int
+ring_count(struct ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire)
+		- atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+// 待ち。最初は譲るだけで、長引いたら寝る。
+static
+bool
+ring_wait(struct pipeline *p, int *spin)
+{
+	if (atomic_load_explicit(&p->abort, memory_order_relaxed)) {
+		return false;
+	}
+	if ((*spin)++ < 64) {
+		sched_yield();
+	} else {
+		struct timespec ts = { 0, 1000 * 1000 };
+		nanosleep(&ts, NULL);
+	}
+	return true;
+}
+
+// producer: 空きスロットを得る。abort なら NULL。
+static
+struct slot *
+ring_put_slot(struct pipeline *p, struct ring *r)
+{
+	int spin = 0;
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+	    == r->depth) {
+		if (!ring_wait(p, &spin)) {
+			return NULL;
+		}
+	}
+	return &r->slot[head % r->depth];
+}
+
+// producer: スロットを公開する。
+static
+void
+ring_put(struct ring *r, int stat)
+{
+	if (stat != SLOT_DATA) {
+		atomic_store_explicit(&r->done, true, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&r->head, 1, memory_order_release);
+}
+
+// consumer: 先頭のスロットを得る。abort なら NULL。
+static
+struct slot *
+ring_get_slot(struct pipeline *p, struct ring *r)
+{
+	int spin = 0;
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	while (atomic_load_explicit(&r->head, memory_order_acquire) == tail) {
+		if (!ring_wait(p, &spin)) {
+			return NULL;
+		}
+	}
+	return &r->slot[tail % r->depth];
+}
+
+// consumer: スロットを返却する。
+static
+void
+ring_get_done(struct ring *r)
+{
+	atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
+}
+
+/* ***** stage ***** */
+
+static
+void *
+reader_main(void *arg)
+{
+	struct pipeline *p = arg;
+
+	rt_worker();
+	for (;;) {
+		struct slot *s = ring_put_slot(p, &p->rd);
+		if (s == NULL) {
+			break;
+		}
+		s->buf.length = 0;
+		uint64_t t = trace_begin();
+		int r = p->in->reader(p->in, &s->buf);
+		trace_end(TRACE_READ, t);
+		if (r < 0) {
+			s->stat = SLOT_ERROR;
+			s->error = errno;
+		} else if (r == 0) {
+			s->stat = SLOT_EOS;
+		} else {
+			if (p->fillstride && s->buf.length < s->buf.bufsize) {
+				// XP デバイス宛の書き込みはブロック単位なのでフィル
+				filltail(&s->buf, p->fillstride);
+			}
+			s->stat = SLOT_DATA;
+		}
+		int stat = s->stat;
+		ring_put(&p->rd, stat);
+		if (stat != SLOT_DATA) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static
+void *
+converter_main(void *arg)
+{
+	struct pipeline *p = arg;
+
+	rt_worker();
+	for (;;) {
+		struct slot *s = ring_get_slot(p, &p->rd);
+		if (s == NULL) {
+			break;
+		}
+		struct slot *d = ring_put_slot(p, &p->wr);
+		if (d == NULL) {
+			break;
+		}
+		int stat = s->stat;
+		d->stat = stat;
+		d->error = s->error;
+		if (stat == SLOT_DATA) {
+			d->buf.length = 0;
+			uint64_t t = trace_begin();
+			p->conv(&d->buf, &s->buf);
+			trace_end(TRACE_CONV, t);
+		}
+		ring_get_done(&p->rd);
+		ring_put(&p->wr, stat);
+		if (stat != SLOT_DATA) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* ***** public ***** */
+
+/*
+ * パイプラインを実行する。
+ * depth はリングのスロット数、prefill なら書き込み開始前に
+ * 出力側のリングが満杯 (または終端) になるまで待つ。
+ * 成功すれば 0、エラーなら -1 を返す。
+ */
+int
+pipeline_run(DESC *in, DESC *out, CONVERTER conv,
+	size_t srcsize, size_t dstsize, int depth, int fillstride, bool prefill)
+{
+	struct pipeline p0, *p = &p0;
+	pthread_t rd_thread;
+	pthread_t cv_thread;
+	bool has_cv = false;
+	int rv = -1;
+
+	memset(p, 0, sizeof(*p));
+	p->in = in;
+	p->out = out;
+	p->conv = conv == conv_pass ? NULL : conv;
+	p->fillstride = fillstride;
+	atomic_init(&p->abort, false);
+
+	if (ring_init(&p->rd, depth, srcsize) < 0) {
+		fprintf(stderr, "pipeline: %s\n", strerror(errno));
+		goto done;
+	}
+	if (p->conv) {
+		if (ring_init(&p->wr, depth, dstsize) < 0) {
+			fprintf(stderr, "pipeline: %s\n", strerror(errno));
+			goto done;
+		}
+	}
+	struct ring *w = p->conv ? &p->wr : &p->rd;
+
+	if (pthread_create(&rd_thread, NULL, reader_main, p) != 0) {
+		fprintf(stderr, "pthread_create failed\n");
+		goto done;
+	}
+	if (p->conv) {
+		if (pthread_create(&cv_thread, NULL, converter_main, p) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			atomic_store(&p->abort, true);
+			pthread_join(rd_thread, NULL);
+			goto done;
+		}
+		has_cv = true;
+	}
+
+	if (prefill) {
+		// ディスクが詰まってもアンダーランしないように貯めてから始める
+		int spin = 0;
+		while (ring_count(w) < depth && !atomic_load(&w->done)) {
+			ring_wait(p, &spin);
+		}
+		if (opt_v) {
+			printf("pipeline prefilled %u/%d\n", ring_count(w), depth);
+		}
+	}
+
+	for (;;) {
+		struct slot *s = ring_get_slot(p, w);
+		if (s == NULL) {
+			break;
+		}
+		if (s->stat == SLOT_ERROR) {
+			fprintf(stderr, "read error %s\n", strerror(s->error));
+			break;
+		}
+		if (s->stat == SLOT_EOS) {
+			rv = 0;
+			break;
+		}
+		uint64_t t = trace_begin();
+		int r = out->writer(out, &s->buf);
+		trace_end(TRACE_WRITE, t);
+		ring_get_done(w);
+		if (r < 0) {
+			fprintf(stderr, "write error %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	// 上流が待っていれば起こして終わらせる
+	atomic_store(&p->abort, true);
+	pthread_join(rd_thread, NULL);
+	if (has_cv) {
+		pthread_join(cv_thread, NULL);
+	}
+
+ done:
+	ring_free(&p->rd);
+	ring_free(&p->wr);
+	return rv;
+}
@@ -9,6 +9,53 @@
 #include "pcm1.tbl"
 #include "pcm2.tbl"
 #include "pcm3.tbl"
+#include "pam2.tbl"
+#include "pam3.tbl"
+
+/*
+ enc の変換テーブルとそのパラメータを返します。
+ キャッシュのキーなど、変換結果を識別するのに使います。
+ テーブルを使わないエンコーディングなら -1 を返します。
+ */
+int
+conv_params(int enc, const void **table, size_t *tablesize,
+	double *gain, double *offset)
+{
+	switch (enc) {
+	 case ENC_PCM1:
+		*table = PCM1_TABLE;
+		*tablesize = sizeof(PCM1_TABLE);
+		*gain = PCM1_TABLE_gain;
+		*offset = PCM1_TABLE_offset;
+		return 0;
+	 case ENC_PAM2:
+		*table = PAM2_TABLE;
+		*tablesize = sizeof(PAM2_TABLE);
+		*gain = PAM2_TABLE_gain;
+		*offset = PAM2_TABLE_offset;
+		return 0;
+	 case ENC_PAM3:
+		*table = PAM3_TABLE;
+		*tablesize = sizeof(PAM3_TABLE);
+		*gain = PAM3_TABLE_gain;
+		*offset = PAM3_TABLE_offset;
+		return 0;
+	 case ENC_PCM2:
+		*table = PCM2_TABLE;
+		*tablesize = sizeof(PCM2_TABLE);
+		*gain = PCM2_TABLE_gain;
+		*offset = PCM2_TABLE_offset;
+		return 0;
+	 case ENC_PCM3:
+	 case ENC_ADPT:		// ADPT は PCM3 の目標電圧に合わせる
+		*table = PCM3_TABLE;
+		*tablesize = sizeof(PCM3_TABLE);
+		*gain = PCM3_TABLE_gain;
+		*offset = PCM3_TABLE_offset;
+		return 0;
+	}
+	return -1;
+}
 
 void
 conv_pass(BUFFER *dst, BUFFER *src)
@@ -18,35 +65,90 @@ conv_pass(BUFFER *dst, BUFFER *src)
 }
 
 /* ----- PAM2 ----- */
-/* PAM2 ではとりあえず PCM2 と同じテーブルを使ってみる。
-やってみないとわからない。*/
+/* PAM は 1 チャンネルの時分割なので、出る電圧は各相の電圧を
+ PAMx_TABLE_duty で重み付けした平均。テーブルは gentbl の PAM モデルで作る。*/
 
 void
 conv_u8_pam2(BUFFER *dst, BUFFER *src)
 {
-	conv_u8_pcm2(dst, src);
+	int count = src->length;
+
+	uint8_t *s = src->ptr;
+	uint16_t *d = (uint16_t*)dst->ptr;
+
+	for (int i = 0; i < count; i++) {
+		*d++ = htobe16(PAM2_TABLE[*s++]);
+	}
+	dst->length = count * 2;
 }
 
 void
 conv_pam2_u8(BUFFER *dst, BUFFER *src)
 {
-	conv_pcm2_u8(dst, src);
+	int count = src->length / 2;
+
+	uint8_t *s = src->ptr;
+	uint8_t *d = dst->ptr;
+
+	for (int i = 0; i < count; i++) {
+		double v;
+		int a;
+		a = (*s++) & 15;
+		v = PSG_VT[a] * PAM2_TABLE_duty[0];
+		a = (*s++) & 15;
+		v += PSG_VT[a] * PAM2_TABLE_duty[1];
+		v -= PAM2_TABLE_offset;
+		v /= PAM2_TABLE_gain;
+		v *= 255;
+		if (v < 0) v = 0;
+		if (v > 255) v = 255;
+		*d++ = (uint8_t)v;
+	}
+	dst->length = count;
 }
 
 /* ----- PAM3 ----- */
-/* PAM3 ではとりあえず PCM3 と同じテーブルを使ってみる。
-やってみないとわからない。*/
 
 void
 conv_u8_pam3(BUFFER *dst, BUFFER *src)
 {
-	conv_u8_pcm3(dst, src);
+	int count = src->length;
+
+	uint8_t *s = src->ptr;
+	uint32_t *d = (uint32_t*)dst->ptr;
+
+	for (int i = 0; i < count; i++) {
+		*d++ = htobe32(PAM3_TABLE[*s++]);
+	}
+	dst->length = count * 4;
 }
 
 void
 conv_pam3_u8(BUFFER *dst, BUFFER *src)
 {
-	conv_pcm3_u8(dst, src);
+	int count = src->length / 4;
+
+	uint8_t *s = src->ptr;
+	uint8_t *d = dst->ptr;
+
+	for (int i = 0; i < count; i++) {
+		double v;
+		int a;
+		s++;
+		a = (*s++) & 15;
+		v = PSG_VT[a] * PAM3_TABLE_duty[0];
+		a = (*s++) & 15;
+		v += PSG_VT[a] * PAM3_TABLE_duty[1];
+		a = (*s++) & 15;
+		v += PSG_VT[a] * PAM3_TABLE_duty[2];
+		v -= PAM3_TABLE_offset;
+		v /= PAM3_TABLE_gain;
+		v *= 255;
+		if (v < 0) v = 0;
+		if (v > 255) v = 255;
+		*d++ = (uint8_t)v;
+	}
+	dst->length = count;
 }
 
 /* ----- PCM1 ----- */
@@ -5,6 +5,13 @@
 
 #include "lunaplay.h"
 
+extern const double PCM3_TABLE_gain;
+extern const double PCM3_TABLE_offset;
+extern const uint32_t PCM3_TABLE[];
+
+extern int conv_params(int enc, const void **table, size_t *tablesize,
+	double *gain, double *offset);
+
 extern void conv_pass(BUFFER *dst, BUFFER *src);
 
 extern void conv_u8_pam2(BUFFER *dst, BUFFER *src);
@@ -17,6 +24,11 @@ extern void conv_u8_pcm2(BUFFER *dst, BUFFER *src);
 extern void conv_pcm2_u8(BUFFER *dst, BUFFER *src);
 extern void conv_u8_pcm3(BUFFER *dst, BUFFER *src);
 extern void conv_pcm3_u8(BUFFER *dst, BUFFER *src);
+extern void conv_adpt_u8(BUFFER *dst, BUFFER *src);
+
+extern void trellis_init(double lambda);
+extern void conv_u8_pcm2_trellis(BUFFER *dst, BUFFER *src);
+extern void conv_u8_pcm3_trellis(BUFFER *dst, BUFFER *src);
 
 /* obsolete */
 extern void conv_s16BE_pam2(BUFFER *dst, BUFFER *src);
@@ -3,100 +3,700 @@
 
 /* PSGPCM format reader writer */
 
+/*
+ * v1 は "PSGP" enc freq だけのヘッダの後にデータが続く。
+ * v2 はヘッダにサンプル数、変換テーブルの識別子を持ち、データの後ろに
+ * ブロック (PSGPCM2_BLOCKSIZE バイト) ごとの索引と CRC32 を置く。
+ * 書式は readme.txt を参照。
+ *
+ * 書き込み時はサンプル数と索引の位置が分からないので、ヘッダには
+ * 未定 (PSGPCM2_UNKNOWN) を書いておき、close で索引を追記してから
+ * ヘッダのその場所だけ書き直す。テンポラリファイルは使わない。
+ * 出力がパイプで書き直せないときは索引を付けず、読む側は EOF まで読む。
+ *
+ * -x align (PSGPCM2_F_ALIGN) ではヘッダを XP の 1 ページ分に広げて
+ * データの開始を XP_BUFSIZE 境界にし、データの後ろも最後のサンプルで
+ * ページ境界まで埋めておく (XP に送るときの filltail と同じ)。
+ * XP に無変換で送るときは、ファイルを mmap して 1 ページずつ
+ * そのまま xp_write に渡すだけになる (psgpcm_xp_run)。
+ *
+ * -x z (PSGPCM2_F_Z) ではデータをブロックごとに psgz.c で圧縮し、
+ *   uint16LE type (0 = 無圧縮, 1 = psgz), uint16LE clen, uint16LE rawlen
+ * のブロックヘッダを付けて並べる。索引の offset がブロックの位置になるので
+ * シークは索引で飛んで 1 ブロック展開するだけ。CRC は展開後のデータのもの。
+ */
+
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "lunaplay.h"
+#include "psgconv.h"
 #include "filehelper.h"
 
 static int psgpcm_read(DESC *desc, BUFFER *buf);
+static int psgpcm_zread(DESC *desc, BUFFER *buf);
 static int psgpcm_write(DESC *desc, BUFFER *buf);
+static int64_t psgpcm_seek(DESC *desc, int64_t frames);
 
 static int psgpcm_close(DESC *desc);
 
 /* ***** initializer ***** */
 #define PSGPCM_TAG "PSGP"
+#define PSGPCM2_TAG "PSG2"
+#define PSGPCM2_IDXTAG "PIDX"
 
-int
-psgpcm_read_init(DESC *desc, int fd)
+#define PSGPCM2_VERSION		(2)
+#define PSGPCM2_HDRSIZE		(48)
+#define PSGPCM2_BLOCKSIZE	(XP_BUFSIZE)
+#define PSGPCM2_IDXENTSIZE	(12)
+// 書き終わっていないときのサンプル数と索引位置
+#define PSGPCM2_UNKNOWN		UINT64_MAX
+
+// ヘッダ中の位置
+#define PSGPCM2_OFF_SAMPLES	(24)
+
+// flags
+#define PSGPCM2_F_CRC		(0x0001)	// 索引にブロックごとの CRC32 がある
+#define PSGPCM2_F_ALIGN		(0x0002)	// データがページ境界から始まり、埋めてある
+#define PSGPCM2_F_Z			(0x0004)	// データはブロックごとに圧縮してある
+#define PSGPCM2_F_KNOWN		(PSGPCM2_F_CRC | PSGPCM2_F_ALIGN | PSGPCM2_F_Z)
+
+// 圧縮ブロックのヘッダ
+#define PSGZ_HDRSIZE		(6)
+#define PSGZ_RAW			(0)
+#define PSGZ_PACKED			(1)
+
+// 索引の 1 エントリ
+struct psgidx {
+	uint64_t offset;	// ブロックのファイル先頭からの位置
+	uint32_t crc;
+};
+
+struct psgpcm {
+	int flags;
+	off_t datastart;	// データの開始位置
+	uint64_t pos;		// データ先頭からのバイト位置
+	int64_t databytes;	// データのバイト数 (-1 = 不明)
+	int stride;
+	int64_t frames;		// ADPT で書いたサンプル数
+	uint8_t last[4];	// 最後に書いたサンプル (ページを埋める用)
+	uint32_t crc;		// 今のブロックの CRC (途中)
+	bool crcvalid;		// ブロックの頭から計算しているか
+	struct psgidx *idx;
+	int nidx;
+	int capidx;
+	bool seekable;		// close でヘッダを書き直せるか
+	// -x z
+	off_t zpos;			// 次のブロックを書くファイル位置
+	int64_t blkno;		// blk のブロック番号
+	uint8_t *blk;		// 展開したブロック、または書きかけのブロック
+	int blklen;
+	int blkpos;			// blk の読み出し位置
+	uint8_t *zbuf;		// 圧縮したブロック
+};
+
+static int psgpcm_zalloc(struct psgpcm *p);
+
+static uint32_t crc32_table[256];
+
+static
+void
+crc32_init_once()
 {
-	int n;
-	int r;
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc32_table[i] = c;
+	}
+}
 
-	uint32_t tag = 0;
-	uint16_t enc = 0;
-	uint32_t freq;
+// 複数スレッドから呼ばれても一度だけ作る
+static
+void
+crc32_init()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
 
-	r =
-	readtag(fd, &tag) &&
-	cmptag(tag, PSGPCM_TAG) &&
-	read16le(fd, &enc) &&
-	read32le(fd, &freq)
-	;
+	pthread_once(&once, crc32_init_once);
+}
 
-	if (!r) {
-		fprintf(stderr, "PSGPCM header read error\n");
-		return -1;
+// CRC-32 (IEEE 802.3)。crc は 0 から始めて続けて呼べる。
+static
+uint32_t
+crc32_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc = crc32_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
 	}
+	return ~crc;
+}
 
-	if (opt_v) {
-		fprintf(stderr, "enc    : %d\n", enc);
-		fprintf(stderr, "freq   : %d\n", freq);
+/*
+ -x の引数 (カンマ区切り) を PSGPCM_OPT_* にして *opts に足します。
+ 成功すれば 0、知らないオプションなら -1 を返します。
+ */
+int
+parse_psgpcm_opts(const char *arg, int *opts)
+{
+	char buf[256];
+	char *last;
+
+	strlcpy(buf, arg, sizeof(buf));
+	for (char *p = strtok_r(buf, ",", &last); p != NULL;
+	     p = strtok_r(NULL, ",", &last)) {
+		if (strcasecmp(p, "v1") == 0) {
+			*opts |= PSGPCM_OPT_V1;
+		} else if (strcasecmp(p, "crc") == 0) {
+			*opts |= PSGPCM_OPT_CRC;
+		} else if (strcasecmp(p, "align") == 0) {
+			*opts |= PSGPCM_OPT_ALIGN;
+		} else if (strcasecmp(p, "z") == 0) {
+			*opts |= PSGPCM_OPT_Z;
+		} else {
+			return -1;
+		}
 	}
+	// 圧縮するとページに並ばない
+	if ((*opts & PSGPCM_OPT_ALIGN) && (*opts & PSGPCM_OPT_Z)) {
+		return -1;
+	}
+	return 0;
+}
 
+static
+bool
+psgpcm_isenc(int enc)
+{
 	switch (enc) {
 	 case ENC_PCM1:
 	 case ENC_PCM2:
 	 case ENC_PCM3:
 	 case ENC_PAM2:
 	 case ENC_PAM3:
-		break;
-	 default:
+	 case ENC_ADPT:
+		return true;
+	}
+	return false;
+}
+
+// fd の offset から索引を読む
+static
+int
+psgpcm_read_index(struct psgpcm *p, int fd, off_t offset)
+{
+	uint8_t hdr[8];
+
+	if (pread(fd, hdr, sizeof(hdr), offset) != sizeof(hdr) ||
+	    memcmp(hdr, PSGPCM2_IDXTAG, 4) != 0) {
+		fprintf(stderr, "PSGPCM index read error\n");
+		return -1;
+	}
+	uint32_t n = le32dec(hdr + 4);
+	uint8_t *b = malloc((size_t)n * PSGPCM2_IDXENTSIZE + 1);
+	p->idx = malloc((size_t)n * sizeof(struct psgidx) + 1);
+	if (b == NULL || p->idx == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		free(b);
+		return -1;
+	}
+	size_t len = (size_t)n * PSGPCM2_IDXENTSIZE;
+	if (pread(fd, b, len, offset + sizeof(hdr)) != len) {
+		fprintf(stderr, "PSGPCM index read error\n");
+		free(b);
+		return -1;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		p->idx[i].offset = le64dec(b + i * PSGPCM2_IDXENTSIZE);
+		p->idx[i].crc = le32dec(b + i * PSGPCM2_IDXENTSIZE + 8);
+	}
+	free(b);
+	p->nidx = n;
+	p->capidx = n;
+	return 0;
+}
+
+// "PSG2" の後ろを読む
+static
+int
+psgpcm2_read_init(DESC *desc, int fd)
+{
+	uint8_t hdr[PSGPCM2_HDRSIZE];
+
+	if (readbuf(fd, hdr + 4, sizeof(hdr) - 4) != sizeof(hdr) - 4) {
+		fprintf(stderr, "PSGPCM header read error\n");
+		return -1;
+	}
+	int version = le16dec(hdr + 4);
+	int hdrsize = le16dec(hdr + 6);
+	int enc = le16dec(hdr + 8);
+	int flags = le16dec(hdr + 10);
+	uint32_t freq = le32dec(hdr + 12);
+	uint32_t blocksize = le32dec(hdr + 16);
+	uint32_t tableid = le32dec(hdr + 20);
+	uint64_t samples = le64dec(hdr + PSGPCM2_OFF_SAMPLES);
+	uint64_t idxoff = le64dec(hdr + PSGPCM2_OFF_SAMPLES + 8);
+	int32_t gain = le32dec(hdr + 40);
+	int32_t offset = le32dec(hdr + 44);
+
+	if (opt_v) {
+		fprintf(stderr, "version: %d\n", version);
+		fprintf(stderr, "enc    : %d\n", enc);
+		fprintf(stderr, "freq   : %d\n", freq);
+		fprintf(stderr, "flags  : 0x%x\n", flags);
+		if (samples != PSGPCM2_UNKNOWN) {
+			fprintf(stderr, "samples: %ju\n", (uintmax_t)samples);
+		}
+		fprintf(stderr, "table  : %08x gain %g offset %g\n",
+			tableid, gain / 65536.0, offset / 65536.0);
+	}
+	if (version != PSGPCM2_VERSION || hdrsize < PSGPCM2_HDRSIZE ||
+	    blocksize != PSGPCM2_BLOCKSIZE) {
+		fprintf(stderr, "PSGPCM version %d is not supported\n", version);
+		return -1;
+	}
+	if ((flags & ~PSGPCM2_F_KNOWN) != 0) {
+		fprintf(stderr, "PSGPCM flags 0x%x is not supported\n", flags);
+		return -1;
+	}
+	if (!psgpcm_isenc(enc)) {
 		fprintf(stderr, "enc %d is not supported\n", enc);
 		return -1;
 	}
+	if (!readskip(fd, hdrsize - PSGPCM2_HDRSIZE)) {
+		fprintf(stderr, "PSGPCM header read error\n");
+		return -1;
+	}
+
+	struct psgpcm *p = calloc(1, sizeof(struct psgpcm));
+	if (p == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	p->datastart = hdrsize;
+	p->crcvalid = true;
+	p->databytes = -1;
+	p->flags = flags & ~PSGPCM2_F_CRC;
+	desc->priv = p;
+	if ((flags & PSGPCM2_F_Z) && psgpcm_zalloc(p) < 0) {
+		free(p);
+		return -1;
+	}
+
 	desc->enc = enc;
+	desc->freq = freq;
+	desc->framesize = enc_stride(enc);
+	desc->remain = -1;
+	if (enc == ENC_ADPT) {
+		// ADPT の sampleCount はバイト数にならないので、索引の手前まで。
+		// z なら索引に着いたところで止まる
+		if (idxoff != PSGPCM2_UNKNOWN && (flags & PSGPCM2_F_Z) == 0) {
+			desc->remain = idxoff - hdrsize;
+			p->databytes = desc->remain;
+		}
+	} else if (samples != PSGPCM2_UNKNOWN) {
+		// 後ろの埋め草と索引は読まない
+		desc->remain = samples * desc->framesize;
+		p->databytes = desc->remain;
+	}
+
+	// 索引は読めるとき (パイプでないとき) だけ使う。
+	// CRC の検査と、圧縮したデータのシークに要る
+	if ((flags & (PSGPCM2_F_CRC | PSGPCM2_F_Z)) &&
+	    idxoff != PSGPCM2_UNKNOWN && lseek(fd, 0, SEEK_CUR) >= 0) {
+		crc32_init();
+		if (psgpcm_read_index(p, fd, idxoff) < 0) {
+			free(p->idx);
+			free(p->blk);
+			free(p->zbuf);
+			free(p);
+			return -1;
+		}
+		p->flags = flags;
+	}
+	return 0;
+}
+
+int
+psgpcm_read_init(DESC *desc, int fd)
+{
+	int r;
+
+	uint32_t tag = 0;
+	uint16_t enc = 0;
+	uint32_t freq;
+
+	if (!readtag(fd, &tag)) {
+		fprintf(stderr, "PSGPCM header read error\n");
+		return -1;
+	}
+
+	desc->priv = NULL;
+	if (cmptag(tag, PSGPCM2_TAG)) {
+		if (psgpcm2_read_init(desc, fd) < 0) {
+			return -1;
+		}
+	} else {
+		r =
+		cmptag(tag, PSGPCM_TAG) &&
+		read16le(fd, &enc) &&
+		read32le(fd, &freq)
+		;
+
+		if (!r) {
+			fprintf(stderr, "PSGPCM header read error\n");
+			return -1;
+		}
+
+		if (opt_v) {
+			fprintf(stderr, "enc    : %d\n", enc);
+			fprintf(stderr, "freq   : %d\n", freq);
+		}
+
+		if (!psgpcm_isenc(enc)) {
+			fprintf(stderr, "enc %d is not supported\n", enc);
+			return -1;
+		}
+		desc->enc = enc;
+		desc->freq = freq;
+		// 1 サンプルが 1 フレームの固定長
+		desc->framesize = enc_stride(enc);
+		desc->remain = -1;
+	}
 
 	if (opt_v) {
-		fprintf(stderr, "PSGPCM encoding: %s\n", enc_tostr(enc));
+		fprintf(stderr, "PSGPCM encoding: %s\n", enc_tostr(desc->enc));
 	}
 
 	desc->reader = psgpcm_read;
+	if (desc->priv != NULL &&
+	    (((struct psgpcm *)desc->priv)->flags & PSGPCM2_F_Z)) {
+		desc->reader = psgpcm_zread;
+	}
 	desc->closer = psgpcm_close;
+	desc->seeker = psgpcm_seek;
 
 	desc->fd = fd;
-	desc->freq = freq;
+	return 0;
 }
 
 int
 psgpcm_write_init(DESC *desc, int fd)
 {
-	writetag(fd, PSGPCM_TAG);
-	write16le(fd, desc->enc);
-	write32le(fd, desc->freq);
+	int r;
+
+	if (desc->opts & PSGPCM_OPT_V1) {
+		r =
+		writetag(fd, PSGPCM_TAG) &&
+		write16le(fd, desc->enc) &&
+		write32le(fd, desc->freq)
+		;
+		if (!r) {
+			fprintf(stderr, "write: %s\n", strerror(errno));
+			return -1;
+		}
+		desc->priv = NULL;
+	} else {
+		struct psgpcm *p = calloc(1, sizeof(struct psgpcm));
+		if (p == NULL) {
+			fprintf(stderr, "malloc: %s\n", strerror(errno));
+			return -1;
+		}
+		if (desc->opts & PSGPCM_OPT_CRC) {
+			p->flags |= PSGPCM2_F_CRC;
+			crc32_init();
+		}
+		p->datastart = PSGPCM2_HDRSIZE;
+		if (desc->opts & PSGPCM_OPT_ALIGN) {
+			p->flags |= PSGPCM2_F_ALIGN;
+			p->datastart = XP_BUFSIZE;
+		}
+		if (desc->opts & PSGPCM_OPT_Z) {
+			p->flags |= PSGPCM2_F_Z;
+			p->zpos = p->datastart;
+			if (psgpcm_zalloc(p) < 0) {
+				free(p);
+				return -1;
+			}
+		}
+		p->stride = enc_stride(desc->enc);
+		p->crcvalid = true;
+		// 後でヘッダを書き直せるか
+		p->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+
+		// 変換テーブルの識別子 (テーブルの CRC) と gain/offset
+		const void *table;
+		size_t tablesize;
+		double gain = 0;
+		double offset = 0;
+		uint32_t tableid = 0;
+		if (conv_params(desc->enc, &table, &tablesize, &gain, &offset) == 0) {
+			crc32_init();
+			tableid = crc32_update(0, table, tablesize);
+		}
+
+		// align のときはヘッダの残りを 0 で埋める
+		uint8_t hdr[XP_BUFSIZE];
+		memset(hdr, 0, p->datastart);
+		memcpy(hdr, PSGPCM2_TAG, 4);
+		le16enc(hdr + 4, PSGPCM2_VERSION);
+		le16enc(hdr + 6, p->datastart);
+		le16enc(hdr + 8, desc->enc);
+		le16enc(hdr + 10, p->flags);
+		le32enc(hdr + 12, desc->freq);
+		le32enc(hdr + 16, PSGPCM2_BLOCKSIZE);
+		le32enc(hdr + 20, tableid);
+		le64enc(hdr + PSGPCM2_OFF_SAMPLES, PSGPCM2_UNKNOWN);
+		le64enc(hdr + PSGPCM2_OFF_SAMPLES + 8, PSGPCM2_UNKNOWN);
+		le32enc(hdr + 40, (int32_t)(gain * 65536));
+		le32enc(hdr + 44, (int32_t)(offset * 65536));
+		if (writebuf(fd, hdr, p->datastart) != p->datastart) {
+			fprintf(stderr, "write: %s\n", strerror(errno));
+			free(p->blk);
+			free(p->zbuf);
+			free(p);
+			return -1;
+		}
+		desc->priv = p;
+	}
 
 	desc->writer = psgpcm_write;
 	desc->closer = psgpcm_close;
 
 	desc->fd = fd;
+	return 0;
+}
+
+/* ***** block index ***** */
+
+// data (データ先頭から p->pos の位置) の len バイトを索引と CRC に数える
+static
+int
+psgpcm_account(struct psgpcm *p, const uint8_t *data, size_t len)
+{
+	if (len >= p->stride) {
+		memcpy(p->last, data + len - p->stride, p->stride);
+	}
+	while (len > 0) {
+		size_t inblk = p->pos % PSGPCM2_BLOCKSIZE;
+		if (inblk == 0) {
+			// 新しいブロック
+			if (p->nidx == p->capidx) {
+				int n = p->capidx ? p->capidx * 2 : 256;
+				struct psgidx *q = realloc(p->idx, n * sizeof(struct psgidx));
+				if (q == NULL) {
+					return -1;
+				}
+				p->idx = q;
+				p->capidx = n;
+			}
+			// z では 1 ブロックずつ数えてから書くので、次に書く位置
+			p->idx[p->nidx].offset = (p->flags & PSGPCM2_F_Z) ?
+				p->zpos : p->datastart + p->pos;
+			p->idx[p->nidx].crc = 0;
+			p->nidx++;
+			p->crc = 0;
+		}
+		size_t n = PSGPCM2_BLOCKSIZE - inblk;
+		if (n > len) {
+			n = len;
+		}
+		if (p->flags & PSGPCM2_F_CRC) {
+			p->crc = crc32_update(p->crc, data, n);
+			p->idx[p->nidx - 1].crc = p->crc;
+		}
+		p->pos += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ parallel_run のように fd に直接書いたデータを、書き終えてから
+ 索引と CRC に数えます。fd は読めるように開いてあること。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+psgpcm_write_sync(DESC *desc)
+{
+	struct psgpcm *p = desc->priv;
+	struct stat st;
+	uint8_t buf[65536];
+
+	if (p == NULL) {
+		// v1 は数えるものが無い
+		return 0;
+	}
+	if (fstat(desc->fd, &st) < 0) {
+		fprintf(stderr, "fstat: %s\n", strerror(errno));
+		return -1;
+	}
+	p->pos = 0;
+	p->nidx = 0;
+	for (off_t off = p->datastart; off < st.st_size; ) {
+		ssize_t n = sizeof(buf);
+		if (n > st.st_size - off) {
+			n = st.st_size - off;
+		}
+		if ((p->flags & PSGPCM2_F_CRC) &&
+		    (n = pread(desc->fd, buf, n, off)) <= 0) {
+			fprintf(stderr, "read: %s\n", n < 0 ? strerror(errno) : "EOF");
+			return -1;
+		}
+		if (psgpcm_account(p, buf, n) < 0) {
+			fprintf(stderr, "malloc: %s\n", strerror(errno));
+			return -1;
+		}
+		off += n;
+	}
+	// ページを埋める最後のサンプル
+	if ((p->flags & PSGPCM2_F_ALIGN) && p->pos >= p->stride &&
+	    pread(desc->fd, p->last, p->stride,
+	        p->datastart + p->pos - p->stride) != p->stride) {
+		fprintf(stderr, "read: %s\n", strerror(errno));
+		return -1;
+	}
+	if (lseek(desc->fd, st.st_size, SEEK_SET) < 0) {
+		fprintf(stderr, "lseek: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// データの後ろをページ境界まで最後のサンプルで埋める
+static
+int
+psgpcm_write_pad(DESC *desc)
+{
+	struct psgpcm *p = desc->priv;
+	uint8_t tmp[XP_BUFSIZE + 4];
+	BUFFER buf;
+
+	size_t pad = (XP_BUFSIZE - p->pos % XP_BUFSIZE) % XP_BUFSIZE;
+	if (pad == 0) {
+		return 0;
+	}
+	// XP に送るときと同じ埋め方にする
+	memset(&buf, 0, sizeof(buf));
+	buf.ptr = tmp;
+	buf.bufsize = p->stride + pad;
+	if (p->pos >= p->stride) {
+		memcpy(tmp, p->last, p->stride);
+		buf.length = p->stride;
+	}
+	filltail(&buf, p->stride);
+	if (writebuf(desc->fd, tmp + p->stride, pad) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// 索引を追記し、ヘッダのサンプル数と索引位置を書き直す
+static
+int
+psgpcm_write_index(DESC *desc)
+{
+	struct psgpcm *p = desc->priv;
+
+	off_t idxoff = p->datastart + p->pos;
+	if (p->flags & PSGPCM2_F_Z) {
+		idxoff = p->zpos;
+	} else if (p->flags & PSGPCM2_F_ALIGN) {
+		idxoff = p->datastart + (p->pos + XP_BUFSIZE - 1) / XP_BUFSIZE * XP_BUFSIZE;
+	}
+	size_t len = 8 + (size_t)p->nidx * PSGPCM2_IDXENTSIZE;
+	uint8_t *b = malloc(len);
+	if (b == NULL) {
+		return -1;
+	}
+	memcpy(b, PSGPCM2_IDXTAG, 4);
+	le32enc(b + 4, p->nidx);
+	for (int i = 0; i < p->nidx; i++) {
+		le64enc(b + 8 + i * PSGPCM2_IDXENTSIZE, p->idx[i].offset);
+		le32enc(b + 8 + i * PSGPCM2_IDXENTSIZE + 8, p->idx[i].crc);
+	}
+	int rv = 0;
+	if (pwritebuf(desc->fd, b, len, idxoff) < 0) {
+		rv = -1;
+	}
+	free(b);
+	if (rv < 0) {
+		return -1;
+	}
+
+	uint8_t hdr[16];
+	le64enc(hdr, desc->enc == ENC_ADPT ? p->frames : p->pos / p->stride);
+	le64enc(hdr + 8, idxoff);
+	if (pwritebuf(desc->fd, hdr, sizeof(hdr), PSGPCM2_OFF_SAMPLES) < 0) {
+		return -1;
+	}
+	return 0;
 }
 
 /* ***** reader ***** */
 
+// 読んだ len バイトの CRC を検査する
+static
+int
+psgpcm_verify(struct psgpcm *p, const uint8_t *data, size_t len, bool eof)
+{
+	while (len > 0) {
+		size_t inblk = p->pos % PSGPCM2_BLOCKSIZE;
+		if (inblk == 0) {
+			p->crc = 0;
+			p->crcvalid = true;
+		}
+		size_t n = PSGPCM2_BLOCKSIZE - inblk;
+		if (n > len) {
+			n = len;
+		}
+		p->crc = crc32_update(p->crc, data, n);
+		p->pos += n;
+		data += n;
+		len -= n;
+
+		int64_t blk = (p->pos - 1) / PSGPCM2_BLOCKSIZE;
+		bool blkend = p->pos % PSGPCM2_BLOCKSIZE == 0 || (eof && len == 0);
+		if (blkend && p->crcvalid) {
+			if (blk >= p->nidx || p->idx[blk].crc != p->crc) {
+				fprintf(stderr, "PSGPCM block %jd CRC error\n", (intmax_t)blk);
+				errno = EIO;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
 static
 int
 psgpcm_read(DESC *desc, BUFFER *buf)
 {
-	int n = readbuf(desc->fd, buf->ptr + buf->length, buf->bufsize - buf->length);
+	struct psgpcm *p = desc->priv;
+	uint8_t *d = buf->ptr + buf->length;
+	int n = desc_readdata(desc, d, buf->bufsize - buf->length);
 	if (n < 0) {
 		return n;
 	}
+	if (p != NULL && (p->flags & PSGPCM2_F_CRC)) {
+		// 最後のブロックは終わりまで読んだときに検査する
+		bool eof = desc->remain == 0 || n < buf->bufsize - buf->length;
+		if (psgpcm_verify(p, d, n, eof) < 0) {
+			return -1;
+		}
+	}
 	if (n == 0) {
 		return buf->length;
 	}
@@ -104,12 +704,316 @@ psgpcm_read(DESC *desc, BUFFER *buf)
 	return buf->length;
 }
 
+/* ***** compressed block ***** */
+
+static
+int
+psgpcm_zalloc(struct psgpcm *p)
+{
+	p->blk = malloc(PSGPCM2_BLOCKSIZE);
+	p->zbuf = malloc(PSGPCM2_BLOCKSIZE);
+	if (p->blk == NULL || p->zbuf == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		free(p->blk);
+		free(p->zbuf);
+		return -1;
+	}
+	psgz_init();
+	return 0;
+}
+
+// 次のブロックを読んで blk に展開する。EOF なら 0 を返す
+static
+int
+psgpcm_zfill(DESC *desc)
+{
+	struct psgpcm *p = desc->priv;
+	uint8_t hdr[PSGZ_HDRSIZE];
+
+	ssize_t n = readbuf(desc->fd, hdr, sizeof(hdr));
+	if (n == 0) {
+		return 0;
+	}
+	if (n == sizeof(hdr) && memcmp(hdr, PSGPCM2_IDXTAG, 4) == 0) {
+		// 索引に着いた (ADPT は長さを数えずにここまで読む)
+		return 0;
+	}
+	if (n != sizeof(hdr)) {
+		goto broken;
+	}
+	int type = le16dec(hdr);
+	int clen = le16dec(hdr + 2);
+	int rawlen = le16dec(hdr + 4);
+	if (rawlen == 0 || rawlen > PSGPCM2_BLOCKSIZE || clen > PSGPCM2_BLOCKSIZE ||
+	    rawlen % desc->framesize != 0) {
+		goto broken;
+	}
+	if (type == PSGZ_RAW) {
+		if (clen != rawlen || readbuf(desc->fd, p->blk, clen) != clen) {
+			goto broken;
+		}
+	} else if (type == PSGZ_PACKED) {
+		if (readbuf(desc->fd, p->zbuf, clen) != clen ||
+		    psgz_decode(p->blk, rawlen, p->zbuf, clen, desc->framesize) < 0) {
+			goto broken;
+		}
+	} else {
+		goto broken;
+	}
+	if (p->flags & PSGPCM2_F_CRC) {
+		if (p->blkno >= p->nidx ||
+		    p->idx[p->blkno].crc != crc32_update(0, p->blk, rawlen)) {
+			fprintf(stderr, "PSGPCM block %jd CRC error\n", (intmax_t)p->blkno);
+			errno = EIO;
+			return -1;
+		}
+	}
+	p->blkno++;
+	p->blklen = rawlen;
+	p->blkpos = 0;
+	return 1;
+
+ broken:
+	fprintf(stderr, "PSGPCM block %jd broken\n", (intmax_t)p->blkno);
+	errno = EIO;
+	return -1;
+}
+
+static
+int
+psgpcm_zread(DESC *desc, BUFFER *buf)
+{
+	struct psgpcm *p = desc->priv;
+
+	while (buf->length < buf->bufsize && desc->remain != 0) {
+		if (p->blkpos == p->blklen) {
+			int r = psgpcm_zfill(desc);
+			if (r < 0) {
+				return -1;
+			}
+			if (r == 0) {
+				break;
+			}
+		}
+		size_t n = p->blklen - p->blkpos;
+		if (n > buf->bufsize - buf->length) {
+			n = buf->bufsize - buf->length;
+		}
+		if (desc->remain >= 0 && n > desc->remain) {
+			n = desc->remain;
+		}
+		memcpy(buf->ptr + buf->length, p->blk + p->blkpos, n);
+		buf->length += n;
+		p->blkpos += n;
+		p->pos += n;
+		if (desc->remain >= 0) {
+			desc->remain -= n;
+		}
+	}
+	return buf->length;
+}
+
+// 索引で目的のブロックに飛び、その中の位置まで進める
+static
+int64_t
+psgpcm_zseek(DESC *desc, int64_t frames)
+{
+	struct psgpcm *p = desc->priv;
+
+	if (p->idx == NULL || p->databytes < 0) {
+		// パイプなどで索引が無ければ展開して捨てる
+		return 0;
+	}
+	uint64_t target = p->pos + frames * desc->framesize;
+	if (target > p->databytes) {
+		target = p->databytes;
+	}
+	int64_t blk = target / PSGPCM2_BLOCKSIZE;
+	int inblk = target % PSGPCM2_BLOCKSIZE;
+	if (blk < p->nidx) {
+		if (lseek(desc->fd, p->idx[blk].offset, SEEK_SET) < 0) {
+			return -1;
+		}
+		p->blkno = blk;
+		p->blklen = 0;
+		p->blkpos = 0;
+		if (inblk > 0) {
+			if (psgpcm_zfill(desc) <= 0 || inblk > p->blklen) {
+				return -1;
+			}
+			p->blkpos = inblk;
+		}
+	}
+	int64_t done = (target - p->pos) / desc->framesize;
+	p->pos = target;
+	desc->remain = p->databytes - target;
+	return done;
+}
+
+static
+int64_t
+psgpcm_seek(DESC *desc, int64_t frames)
+{
+	struct psgpcm *p = desc->priv;
+	if (p != NULL && (p->flags & PSGPCM2_F_Z)) {
+		return psgpcm_zseek(desc, frames);
+	}
+	int64_t done = desc_seekframes(desc, frames);
+	if (done > 0 && p != NULL) {
+		p->pos += done * desc->framesize;
+		// ブロックの途中からは検査できないので次のブロックから
+		p->crcvalid = p->pos % PSGPCM2_BLOCKSIZE == 0;
+	}
+	return done;
+}
+
+/*
+ -x align で書いた PSGPCM の in を、mmap して 1 ページずつ out に渡します。
+ 変換も filltail もコピーも無い。in の enc は out と同じであること。
+ in がこの形でない (v1、align 無し、シーク済み、範囲指定) ときや
+ mmap できないときは何もせずに 1 を返すので、普通に読むこと。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+psgpcm_xp_run(DESC *in, DESC *out)
+{
+	struct psgpcm *p = in->priv;
+	BUFFER buf;
+
+	if (in->reader != psgpcm_read || p == NULL ||
+	    (p->flags & PSGPCM2_F_ALIGN) == 0 ||
+	    p->databytes < 0 || p->pos != 0 || in->remain != p->databytes) {
+		return 1;
+	}
+	size_t len = (p->databytes + XP_BUFSIZE - 1) / XP_BUFSIZE * XP_BUFSIZE;
+	if (len == 0) {
+		return 0;
+	}
+	// 切り詰められたファイルを map すると、終わりの先で SIGBUS になる
+	struct stat st;
+	if (fstat(in->fd, &st) < 0 || st.st_size < p->datastart + (off_t)len) {
+		if (opt_v) {
+			printf("PSGPCM shorter than its header says, reading instead\n");
+		}
+		return 1;
+	}
+	uint8_t *map = mmap(NULL, len, PROT_READ, MAP_SHARED, in->fd, p->datastart);
+	if (map == MAP_FAILED) {
+		if (opt_v) {
+			printf("mmap: %s, reading instead\n", strerror(errno));
+		}
+		return 1;
+	}
+	madvise(map, len, MADV_SEQUENTIAL);
+	if (opt_v) {
+		printf("PSGPCM mapped %zu bytes\n", len);
+	}
+
+	int rv = 0;
+	memset(&buf, 0, sizeof(buf));
+	buf.bufsize = XP_BUFSIZE;
+	for (size_t off = 0; off < len; off += XP_BUFSIZE) {
+		buf.ptr = map + off;
+		buf.length = XP_BUFSIZE;
+		if (p->flags & PSGPCM2_F_CRC) {
+			// 埋め草は CRC に入っていない
+			size_t n = XP_BUFSIZE;
+			if (off + n > p->databytes) {
+				n = p->databytes - off;
+			}
+			if (psgpcm_verify(p, buf.ptr, n, off + n == p->databytes) < 0) {
+				rv = -1;
+				break;
+			}
+		}
+		uint64_t t = trace_begin();
+		int r = out->writer(out, &buf);
+		trace_end(TRACE_WRITE, t);
+		if (r < 0) {
+			fprintf(stderr, "write error %s\n", strerror(errno));
+			rv = -1;
+			break;
+		}
+	}
+	munmap(map, len);
+	return rv;
+}
+
 /* ***** writer ***** */
 
+// 溜まった blk を圧縮して書く
+static
+int
+psgpcm_write_zblock(DESC *desc)
+{
+	struct psgpcm *p = desc->priv;
+	uint8_t hdr[PSGZ_HDRSIZE];
+
+	if (psgpcm_account(p, p->blk, p->blklen) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	const uint8_t *data = p->zbuf;
+	int type = PSGZ_PACKED;
+	int clen = psgz_encode(p->zbuf, p->blklen - 1, p->blk, p->blklen,
+		p->stride);
+	if (clen < 0) {
+		// 詰められないか、縮まない
+		data = p->blk;
+		type = PSGZ_RAW;
+		clen = p->blklen;
+	}
+	le16enc(hdr, type);
+	le16enc(hdr + 2, clen);
+	le16enc(hdr + 4, p->blklen);
+	if (writebuf(desc->fd, hdr, sizeof(hdr)) < 0 ||
+	    writebuf(desc->fd, (uint8_t *)data, clen) < 0) {
+		return -1;
+	}
+	p->zpos += sizeof(hdr) + clen;
+	p->blklen = 0;
+	return 0;
+}
+
+static
+int
+psgpcm_zwrite(DESC *desc, BUFFER *buf)
+{
+	struct psgpcm *p = desc->priv;
+
+	for (size_t off = 0; off < buf->length; ) {
+		size_t n = PSGPCM2_BLOCKSIZE - p->blklen;
+		if (n > buf->length - off) {
+			n = buf->length - off;
+		}
+		memcpy(p->blk + p->blklen, buf->ptr + off, n);
+		p->blklen += n;
+		off += n;
+		if (p->blklen == PSGPCM2_BLOCKSIZE && psgpcm_write_zblock(desc) < 0) {
+			return -1;
+		}
+	}
+	int rv = buf->length;
+	buf->length = 0;
+	return rv;
+}
+
 static
 int
 psgpcm_write(DESC *desc, BUFFER *buf)
 {
+	struct psgpcm *p = desc->priv;
+	if (p != NULL && desc->enc == ENC_ADPT) {
+		// 最後のページの埋め草はサンプル数に入れない
+		p->frames += adpt_frames(buf);
+	}
+	if (p != NULL && (p->flags & PSGPCM2_F_Z)) {
+		return psgpcm_zwrite(desc, buf);
+	}
+	if (p != NULL && psgpcm_account(p, buf->ptr, buf->length) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
 	int rv = writebuf(desc->fd, buf->ptr, buf->length);
 	buf->length = 0;
 	return rv;
@@ -121,6 +1025,33 @@ static
 int
 psgpcm_close(DESC *desc)
 {
-	close(desc->fd);
-}
+	struct psgpcm *p = desc->priv;
+	int rv = 0;
 
+	if (p != NULL && desc->writer == psgpcm_write) {
+		if ((p->flags & PSGPCM2_F_Z) && p->blklen > 0 &&
+		    psgpcm_write_zblock(desc) < 0) {
+			fprintf(stderr, "PSGPCM write error: %s\n", strerror(errno));
+			rv = -1;
+		}
+		if ((p->flags & PSGPCM2_F_ALIGN) && psgpcm_write_pad(desc) < 0) {
+			fprintf(stderr, "PSGPCM write error: %s\n", strerror(errno));
+			rv = -1;
+		}
+		if (rv == 0 && p->seekable && psgpcm_write_index(desc) < 0) {
+			fprintf(stderr, "PSGPCM index write error: %s\n", strerror(errno));
+			rv = -1;
+		}
+	}
+	if (p != NULL) {
+		free(p->idx);
+		free(p->blk);
+		free(p->zbuf);
+		free(p);
+		desc->priv = NULL;
+	}
+	if (close(desc->fd) < 0) {
+		rv = -1;
+	}
+	return rv;
+}
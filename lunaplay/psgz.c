@@ -0,0 +1,233 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* PSGPCM block compression (nibble packing + run length) */
+
+/*
+ * PSGPCM のサンプルは 1 チャンネル 4 bit (0000SSSS) なので、
+ * 1 サンプルの有効なニブルは PCM1 で 1 個、PCM2/PAM2 で 2 個、
+ * PCM3/PAM3 で 3 個 (先頭の 1 バイトは常に 0)。
+ * ブロック (16KiB) ごとに独立に、次の符号の並びにする。
+ *
+ *   0x00..0x7f  リテラル。c+1 サンプルのニブルを上位から詰めて続ける
+ *               (ニブル数が奇数なら最後のバイトの下位は 0)
+ *   0x80..0xff  ラン。直前のサンプルを (c & 0x7f)+1 回繰り返す
+ *
+ * ブロックの頭はリテラルで始まる。無音など同じ値が続くところがランになる。
+ * 展開はバイト単位の表引きと、ランは 1/2/4 バイトの繰り返し書き込みだけで、
+ * 68030 でも XP に送るのに十分間に合う。
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "lunaplay.h"
+
+// パックした 1 バイトを 2 バイト (0000SSSS 0000SSSS) にする表
+static uint8_t psgz_unpack[256][2];
+
+static
+void
+psgz_init_once()
+{
+	for (int i = 0; i < 256; i++) {
+		psgz_unpack[i][0] = i >> 4;
+		psgz_unpack[i][1] = i & 15;
+	}
+}
+
+// 複数スレッドから呼ばれても一度だけ作る
+void
+psgz_init()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, psgz_init_once);
+}
+
+// 1 サンプルのニブル数
+static
+int
+psgz_nibbles(int stride)
+{
+	return stride == 4 ? 3 : stride;
+}
+
+// 詰められるか (上位ニブルと PCM3 の先頭バイトが 0)
+static
+bool
+psgz_packable(const uint8_t *raw, int len, int stride)
+{
+	for (int i = 0; i < len; i++) {
+		int lim = (stride == 4 && i % 4 == 0) ? 1 : 16;
+		if (raw[i] >= lim) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// i 番目から直前のサンプルと同じものが何個続くか (max まで)
+static
+int
+psgz_runlen(const uint8_t *raw, int i, int ns, int stride, int max)
+{
+	const uint8_t *prev = raw + (i - 1) * stride;
+	int r = 0;
+	while (i + r < ns && r < max &&
+	       memcmp(raw + (i + r) * stride, prev, stride) == 0) {
+		r++;
+	}
+	return r;
+}
+
+/*
+ raw の len バイト (stride バイト/サンプル) を out に圧縮します。
+ out は outsize バイトまで書きます。
+ 圧縮後の長さを返します。詰められないか、outsize に収まらなければ
+ -1 を返すので、呼び出し側は raw のまま格納すること。
+ */
+int
+psgz_encode(uint8_t *out, int outsize, const uint8_t *raw, int len, int stride)
+{
+	int ch = psgz_nibbles(stride);
+	int skip = stride - ch;
+	int ns = len / stride;
+	// これより短いランはリテラルに含めた方が短い
+	int minrun = 4 / ch + 1;
+	int o = 0;
+
+	if (len % stride != 0 || !psgz_packable(raw, len, stride)) {
+		return -1;
+	}
+
+	for (int i = 0; i < ns; ) {
+		if (i > 0) {
+			int r = psgz_runlen(raw, i, ns, stride, 128);
+			if (r >= minrun) {
+				if (o + 1 > outsize) {
+					return -1;
+				}
+				out[o++] = 0x80 | (r - 1);
+				i += r;
+				continue;
+			}
+		}
+
+		// 次のランの手前まで (128 サンプルまで) をリテラルにする
+		int start = i;
+		i++;
+		while (i < ns && i - start < 128 &&
+		       psgz_runlen(raw, i, ns, stride, minrun) < minrun) {
+			i++;
+		}
+		int n = i - start;
+		int bytes = (n * ch + 1) / 2;
+		if (o + 1 + bytes > outsize) {
+			return -1;
+		}
+		out[o++] = n - 1;
+
+		int half = 0;
+		uint8_t v = 0;
+		for (int k = start; k < i; k++) {
+			const uint8_t *s = raw + k * stride + skip;
+			for (int c = 0; c < ch; c++) {
+				if (half) {
+					out[o++] = v | s[c];
+				} else {
+					v = s[c] << 4;
+				}
+				half ^= 1;
+			}
+		}
+		if (half) {
+			out[o++] = v;
+		}
+	}
+	return o;
+}
+
+/*
+ in の clen バイトを raw に rawlen バイト (stride バイト/サンプル) に
+ 展開します。psgz_init() を呼んでおくこと。
+ 成功すれば 0、データが壊れていれば -1 を返します。
+ */
+int
+psgz_decode(uint8_t *raw, int rawlen, const uint8_t *in, int clen, int stride)
+{
+	int ch = psgz_nibbles(stride);
+	const uint8_t *s = in;
+	const uint8_t *se = in + clen;
+	uint8_t *d = raw;
+	uint8_t *de = raw + rawlen;
+
+	while (s < se) {
+		int c = *s++;
+		if (c & 0x80) {
+			int r = (c & 0x7f) + 1;
+			if (d == raw || d + r * stride > de) {
+				return -1;
+			}
+			// 直前のサンプルを繰り返す
+			switch (stride) {
+			 case 1:
+				memset(d, d[-1], r);
+				d += r;
+				break;
+			 case 2:
+			 {
+				uint16_t v;
+				memcpy(&v, d - 2, 2);
+				for (int k = 0; k < r; k++, d += 2) {
+					memcpy(d, &v, 2);
+				}
+				break;
+			 }
+			 default:
+			 {
+				uint32_t v;
+				memcpy(&v, d - 4, 4);
+				for (int k = 0; k < r; k++, d += 4) {
+					memcpy(d, &v, 4);
+				}
+				break;
+			 }
+			}
+			continue;
+		}
+
+		int n = c + 1;
+		int nib = n * ch;
+		if (s + (nib + 1) / 2 > se || d + n * stride > de) {
+			return -1;
+		}
+		if (stride != 4) {
+			// ニブルの並びがそのまま出力になる
+			for (int k = 0; k < nib / 2; k++, d += 2) {
+				memcpy(d, psgz_unpack[*s++], 2);
+			}
+			if (nib & 1) {
+				*d++ = *s++ >> 4;
+			}
+		} else {
+			// 2 サンプル (6 ニブル) が 3 バイト
+			for (int k = 0; k < n / 2; k++, s += 3, d += 8) {
+				d[0] = 0;
+				memcpy(d + 1, psgz_unpack[s[0]], 2);
+				d[3] = s[1] >> 4;
+				d[4] = 0;
+				d[5] = s[1] & 15;
+				memcpy(d + 6, psgz_unpack[s[2]], 2);
+			}
+			if (n & 1) {
+				d[0] = 0;
+				memcpy(d + 1, psgz_unpack[s[0]], 2);
+				d[3] = s[1] >> 4;
+				s += 2;
+				d += 4;
+			}
+		}
+	}
+	return d == de ? 0 : -1;
+}
@@ -0,0 +1,160 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* start offset and duration of input */
+
+/*
+ * 開始位置へは reader の seeker で飛ぶ。
+ * フレームが固定長の形式 (PCM WAV, AU, PSGPCM) ならバイト位置を
+ * 計算して lseek するので、オフセットが大きくても時間はかからない。
+ * パイプならまとめて読み捨てる。
+ * IMA ADPCM はブロック単位で飛び、端数はデコードして捨てる。
+ * seeker の無い形式 (FLAC) は全部デコードして捨てる。
+ *
+ * 長さはフレーム固定長なら desc->remain を縮めるだけ、
+ * そうでなければ reader を包んで出力を打ち切る。
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lunaplay.h"
+
+struct range {
+	DESC *inner;
+	int64_t remain;		// 残りフレーム数
+	int stride;
+};
+
+static int range_read(DESC *desc, BUFFER *buf);
+static int range_close(DESC *desc);
+
+/*
+ in を frames フレーム先へ進めます。
+ ループポイントも開始位置からの相対にします。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+range_seek(DESC *in, int64_t frames)
+{
+	int64_t done = 0;
+
+	if (in->seeker != NULL) {
+		done = in->seeker(in, frames);
+		if (done < 0) {
+			fprintf(stderr, "seek error %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	int64_t seeked = done;
+
+	// 残りはデコードして捨てる
+	int stride = enc_stride(in->enc);
+	uint8_t tmp[XP_BUFSIZE];
+	BUFFER buf;
+	memset(&buf, 0, sizeof(buf));
+	buf.ptr = tmp;
+	while (done < frames) {
+		int64_t n = frames - done;
+		if (n > sizeof(tmp) / stride) {
+			n = sizeof(tmp) / stride;
+		}
+		buf.bufsize = n * stride;
+		buf.length = 0;
+		int r = in->reader(in, &buf);
+		if (r < 0) {
+			fprintf(stderr, "read error %s\n", strerror(errno));
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		done += buf.length / stride;
+	}
+	if (opt_v) {
+		printf("seek %jd frames (%jd by seeker, %jd decoded)\n",
+			(intmax_t)frames, (intmax_t)seeked, (intmax_t)(done - seeked));
+	}
+
+	if (in->loopend > 0) {
+		in->loopstart -= frames;
+		in->loopend -= frames;
+		if (in->loopstart < 0) {
+			// ループの途中から始めるなら、ループポイントは使わない
+			in->loopstart = 0;
+			in->loopend = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ inner から frames フレームだけ読む reader を desc に作ります。
+ フレーム固定長の形式なら desc は作らずに inner を縮めて 1 を返します。
+ 作ったら 0、エラーなら -1 を返します。
+ */
+int
+range_init(DESC *desc, DESC *inner, int64_t frames)
+{
+	// reader が remain を見て止まる
+	if (inner->splittable) {
+		off_t bytes = frames * inner->framesize;
+		if (inner->remain < 0 || bytes < inner->remain) {
+			inner->remain = bytes;
+		}
+		return 1;
+	}
+
+	struct range *rg = malloc(sizeof(*rg));
+	if (rg == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	rg->inner = inner;
+	rg->remain = frames;
+	rg->stride = enc_stride(inner->enc);
+
+	*desc = *inner;
+	desc->priv = rg;
+	desc->reader = range_read;
+	desc->closer = range_close;
+	desc->seeker = NULL;
+	desc->splittable = false;
+	return 0;
+}
+
+static
+int
+range_read(DESC *desc, BUFFER *buf)
+{
+	struct range *rg = desc->priv;
+
+	if (rg->remain <= 0) {
+		return buf->length;
+	}
+	// 残りより多くは読ませない
+	size_t bufsize = buf->bufsize;
+	size_t limit = buf->length + rg->remain * rg->stride;
+	if (limit < bufsize) {
+		buf->bufsize = limit;
+	}
+	size_t before = buf->length;
+	int r = rg->inner->reader(rg->inner, buf);
+	buf->bufsize = bufsize;
+	if (r < 0) {
+		return r;
+	}
+	rg->remain -= (buf->length - before) / rg->stride;
+	return buf->length;
+}
+
+static
+int
+range_close(DESC *desc)
+{
+	struct range *rg = desc->priv;
+	int rv = rg->inner->closer(rg->inner);
+	free(rg);
+	return rv;
+}
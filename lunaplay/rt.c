@@ -0,0 +1,225 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* realtime playback mode (-R) */
+
+/*
+ * 忙しい LUNA でページの書き込みが遅れる原因のうち、
+ * - malloc したばかりのバッファのページフォルト
+ * - 普通のスケジューリングで writer が待たされること
+ * を減らす。
+ *
+ * メモリは mlockall(MCL_CURRENT) で今あるものを固定し、後から確保する
+ * バッファ (変換、パイプラインのリング、ADPT のページ、XP の窓) は
+ * rt_prefault() で全ページに触ってから mlock する。MCL_FUTURE は
+ * スレッドのスタックや -L のバッファまで固定してしまうので使わない。
+ *
+ * writer (メインスレッド) は SCHED_FIFO にし、パイプラインの reader と
+ * 変換のスレッドはそれより 1 つ低くする。同じ優先度だと 1 CPU の LUNA では
+ * 変換中のスレッドが writer を待たせるため。権限が無ければ nice を
+ * 下げ、それも駄目なら普通の優先度のまま続ける。
+ *
+ * SCHED_FIFO で空回りすると他のスレッドが動けないので、XP の writer は
+ * ページの切り替えを RT_POLL_USEC ごとに寝て待つ。その起きた時刻の
+ * ページの期限からの遅れ (ジッタ) を数えて最後に表示する。
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "lunaplay.h"
+
+// SCHED_FIFO が使えないときの nice
+#define RT_NICE			(-20)
+
+static struct {
+	bool fifo;			// SCHED_FIFO になった
+	bool niced;			// 代わりに nice を下げた
+	int prio;			// writer の優先度
+	int nlocked;		// mlock したバッファ
+	int nfailed;		// mlock できなかったバッファ
+	int64_t count;		// ジッタの数
+	double sum;
+	double sumsq;
+	double max;
+	int64_t over1ms;
+	int64_t over10ms;
+} rt;
+
+/*
+ realtime mode にします。できないことは警告を出して飛ばします。
+ pthread_create より前に、メインスレッドから呼ぶこと。
+ */
+void
+rt_init()
+{
+	if (mlockall(MCL_CURRENT) < 0) {
+		fprintf(stderr, "mlockall: %s (memory not locked)\n",
+			strerror(errno));
+	}
+
+	struct sched_param sp;
+	memset(&sp, 0, sizeof(sp));
+	int pmin = sched_get_priority_min(SCHED_FIFO);
+	int pmax = sched_get_priority_max(SCHED_FIFO);
+	// 他の realtime なものの邪魔はしないように真ん中あたり
+	sp.sched_priority = pmin + (pmax - pmin) / 2;
+	if (pmin >= 0 && pmax > pmin) {
+		int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (r == 0) {
+			rt.fifo = true;
+			rt.prio = sp.sched_priority;
+		} else if (opt_v) {
+			printf("SCHED_FIFO: %s\n", strerror(r));
+		}
+	}
+	if (!rt.fifo) {
+		if (setpriority(PRIO_PROCESS, 0, RT_NICE) < 0) {
+			fprintf(stderr, "setpriority: %s (normal priority)\n",
+				strerror(errno));
+		} else {
+			rt.niced = true;
+			fprintf(stderr, "SCHED_FIFO not permitted, using nice %d\n",
+				RT_NICE);
+		}
+	}
+	if (opt_v) {
+		printf("realtime       :%s\n",
+			rt.fifo ? "SCHED_FIFO" : "no SCHED_FIFO");
+	}
+}
+
+/*
+ パイプラインの reader/変換スレッドの始めに呼び、writer より
+ 優先度を 1 つ下げます。
+ */
+void
+rt_worker()
+{
+	if (!opt_rt || !rt.fifo) {
+		return;
+	}
+	struct sched_param sp;
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = rt.prio - 1;
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+}
+
+/*
+ -R なら ptr から len バイトの全ページに書いてページフォルトを済ませ、
+ mlock します。中身は壊すので、確保した直後に呼ぶこと。
+ */
+void
+rt_prefault(void *ptr, size_t len)
+{
+	if (!opt_rt || ptr == NULL) {
+		return;
+	}
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uint8_t *p = ptr;
+	for (size_t off = 0; off < len; off += pagesize) {
+		p[off] = 0;
+	}
+	if (len > 0) {
+		p[len - 1] = 0;
+	}
+	if (mlock(ptr, len) == 0) {
+		rt.nlocked++;
+	} else {
+		rt.nfailed++;
+	}
+}
+
+/*
+ -R なら ptr から len バイトの全ページを読んでページフォルトを済ませます。
+ XP の窓のように書いてはいけないところ用。
+ */
+void
+rt_prefault_ro(volatile const void *ptr, size_t len)
+{
+	if (!opt_rt || ptr == NULL) {
+		return;
+	}
+	long pagesize = sysconf(_SC_PAGESIZE);
+	volatile const uint8_t *p = ptr;
+	for (size_t off = 0; off < len; off += pagesize) {
+		(void)p[off];
+	}
+	if (mlock((const void *)ptr, len) == 0) {
+		rt.nlocked++;
+	} else {
+		rt.nfailed++;
+	}
+}
+
+/*
+ 単調増加の時刻を秒で返します。
+ */
+double
+rt_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ ページの期限から late 秒遅れて起きたことを記録します。
+ */
+void
+rt_jitter(double late)
+{
+	if (!opt_rt) {
+		return;
+	}
+	rt.count++;
+	rt.sum += late;
+	rt.sumsq += late * late;
+	if (late > rt.max) {
+		rt.max = late;
+	}
+	if (late > 0.001) {
+		rt.over1ms++;
+	}
+	if (late > 0.010) {
+		rt.over10ms++;
+	}
+}
+
+/*
+ realtime mode の結果を表示します。
+ */
+void
+rt_report()
+{
+	if (!opt_rt) {
+		return;
+	}
+	printf("realtime       :%s, %d buffers locked",
+		rt.fifo ? "SCHED_FIFO" : rt.niced ? "nice" : "normal priority",
+		rt.nlocked);
+	if (rt.nfailed > 0) {
+		printf(", %d not locked", rt.nfailed);
+	}
+	printf("\n");
+	if (rt.count == 0) {
+		printf("wakeup jitter  :no wakeups measured\n");
+		return;
+	}
+	double mean = rt.sum / rt.count;
+	double var = rt.sumsq / rt.count - mean * mean;
+	printf("wakeup jitter  :%jd wakeups, mean %.3f ms, sd %.3f ms, "
+		"max %.3f ms\n",
+		(intmax_t)rt.count, mean * 1000, sqrt(var > 0 ? var : 0) * 1000,
+		rt.max * 1000);
+	printf("               :%jd over 1 ms, %jd over 10 ms\n",
+		(intmax_t)rt.over1ms, (intmax_t)rt.over10ms);
+}
@@ -0,0 +1,286 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* per-stage timing histograms and trace export */
+
+/*
+ * read, 変換, write と、XP の writer の中の待ち (XP_PAGEENDH) と
+ * コピーの時間を計って、段ごとにヒストグラムと最悪値を取る (-S)。
+ * -J なら全イベントを Chrome trace の JSON (chrome://tracing, Perfetto)
+ * に書き出す。段ごとにレーン (tid) を分けるので、どの段のせいで
+ * ページに間に合わなかったかが見える。
+ *
+ * 無効のときは trace_begin() がフラグを見て 0 を返し、trace_end() が
+ * 0 を見て戻るだけ。
+ *
+ * 各段は 1 つのスレッドからしか呼ばれない (パイプラインでも段ごとに
+ * スレッドが 1 つ) ので、段ごとの集計はロックしない。
+ * 同時に複数のファイルを変換する -B とは一緒に使えない。
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lunaplay.h"
+
+// ヒストグラムの区間数。区間 b は [2^(b-1), 2^b) usec、0 は 1usec 未満
+#define TRACE_NBUCKET	(24)
+// 段ごとに残すイベント数の上限 (越えたら数だけ数える)
+#define TRACE_MAXEVENTS	(1024 * 1024)
+// 印の数の上限
+#define TRACE_MAXMARKS	(64 * 1024)
+
+struct trace_ev {
+	uint64_t ts;		// trace_init からの nsec
+	uint64_t dur;		// nsec
+};
+
+struct trace_stage {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t maxts;		// 最悪値の起きた時刻
+	uint64_t bucket[TRACE_NBUCKET];
+	struct trace_ev *ev;
+	size_t nev;
+	size_t evcap;
+	uint64_t dropped;
+};
+
+struct trace_mark {
+	uint64_t ts;
+	int stage;
+	const char *name;
+};
+
+static const char *trace_names[TRACE_MAX] = {
+	"read", "convert", "write", "xp wait", "xp copy",
+};
+
+static bool trace_enabled;
+static bool trace_hist;
+static const char *trace_json;
+static uint64_t trace_base;
+static struct trace_stage trace_stages[TRACE_MAX];
+static struct trace_mark *trace_marks;
+static size_t trace_nmarks;
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static
+uint64_t
+trace_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ 計測を始めます。hist ならヒストグラムを表示し、json が NULL でなければ
+ そのファイルにイベントを書きます。
+ 成功すれば 0、エラーなら -1 を返します。
+ */
+int
+trace_init(bool hist, const char *json)
+{
+	trace_hist = hist;
+	trace_json = json;
+	if (json != NULL) {
+		trace_marks = malloc(TRACE_MAXMARKS * sizeof(*trace_marks));
+		if (trace_marks == NULL) {
+			fprintf(stderr, "malloc: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	trace_base = trace_now();
+	trace_enabled = hist || json != NULL;
+	return 0;
+}
+
+/*
+ 段の始まりの時刻を返します。無効なら 0 を返します。
+ */
+uint64_t
+trace_begin()
+{
+	if (!trace_enabled) {
+		return 0;
+	}
+	return trace_now();
+}
+
+/*
+ t0 (trace_begin の値) から今までを stage の 1 回として数えます。
+ */
+void
+trace_end(int stage, uint64_t t0)
+{
+	if (t0 == 0) {
+		return;
+	}
+	uint64_t t1 = trace_now();
+	uint64_t dur = t1 - t0;
+	struct trace_stage *s = &trace_stages[stage];
+
+	s->count++;
+	s->sum += dur;
+	if (dur > s->max) {
+		s->max = dur;
+		s->maxts = t0 - trace_base;
+	}
+	int b = 0;
+	for (uint64_t us = dur / 1000; us > 0 && b < TRACE_NBUCKET - 1; us >>= 1) {
+		b++;
+	}
+	s->bucket[b]++;
+
+	if (trace_json == NULL) {
+		return;
+	}
+	if (s->nev == s->evcap) {
+		size_t n = s->evcap ? s->evcap * 2 : 1024;
+		struct trace_ev *p = NULL;
+		if (n <= TRACE_MAXEVENTS) {
+			p = realloc(s->ev, n * sizeof(*p));
+		}
+		if (p == NULL) {
+			s->dropped++;
+			return;
+		}
+		s->ev = p;
+		s->evcap = n;
+	}
+	s->ev[s->nev].ts = t0 - trace_base;
+	s->ev[s->nev].dur = dur;
+	s->nev++;
+}
+
+/*
+ stage のレーンに name の印を付けます (アンダーランなど)。
+ */
+void
+trace_mark(int stage, const char *name)
+{
+	if (!trace_enabled || trace_marks == NULL) {
+		return;
+	}
+	uint64_t ts = trace_now() - trace_base;
+	pthread_mutex_lock(&trace_mtx);
+	if (trace_nmarks < TRACE_MAXMARKS) {
+		trace_marks[trace_nmarks].ts = ts;
+		trace_marks[trace_nmarks].stage = stage;
+		trace_marks[trace_nmarks].name = name;
+		trace_nmarks++;
+	}
+	pthread_mutex_unlock(&trace_mtx);
+}
+
+static
+void
+trace_print_hist()
+{
+	printf("stage        count    mean(us)     max(us)  at(s)\n");
+	for (int i = 0; i < TRACE_MAX; i++) {
+		struct trace_stage *s = &trace_stages[i];
+		if (s->count == 0) {
+			continue;
+		}
+		printf("%-8s %9ju %11.1f %11.1f  %.3f\n",
+			trace_names[i], (uintmax_t)s->count,
+			(double)s->sum / s->count / 1000,
+			(double)s->max / 1000,
+			(double)s->maxts / 1e9);
+		for (int b = 0; b < TRACE_NBUCKET; b++) {
+			if (s->bucket[b] == 0) {
+				continue;
+			}
+			// 区間と、件数の割合を # の数で
+			int bar = (int)(s->bucket[b] * 40 / s->count);
+			char lo[16];
+			snprintf(lo, sizeof(lo), "%ju", b == 0 ? 0 : (uintmax_t)1 << (b - 1));
+			printf("  %8s-%-8ju %9ju %.*s\n",
+				lo, (uintmax_t)1 << b, (uintmax_t)s->bucket[b],
+				bar, "########################################");
+		}
+	}
+}
+
+static
+int
+trace_write_json(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	// レーンの名前
+	for (int i = 0; i < TRACE_MAX; i++) {
+		fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+			"\"tid\": %d, \"args\": {\"name\": \"%s\"}},\n",
+			i, trace_names[i]);
+	}
+	for (int i = 0; i < TRACE_MAX; i++) {
+		struct trace_stage *s = &trace_stages[i];
+		for (size_t k = 0; k < s->nev; k++) {
+			// Chrome trace の時刻は usec
+			fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+				"\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+				trace_names[i], i,
+				s->ev[k].ts / 1000.0, s->ev[k].dur / 1000.0);
+		}
+	}
+	for (size_t k = 0; k < trace_nmarks; k++) {
+		struct trace_mark *m = &trace_marks[k];
+		fprintf(fp, "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", "
+			"\"pid\": 1, \"tid\": %d, \"ts\": %.3f},\n",
+			m->name, m->stage, m->ts / 1000.0);
+	}
+	// 最後の要素の後ろに , を置かないための終端
+	fprintf(fp, "{\"name\": \"end\", \"ph\": \"i\", \"s\": \"g\", "
+		"\"pid\": 1, \"tid\": 0, \"ts\": %.3f}\n",
+		(trace_now() - trace_base) / 1000.0);
+	fprintf(fp, "]}\n");
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ ヒストグラムを表示し、イベントを書き出して、計測を終えます。
+ 成功すれば 0、書き出しに失敗すれば -1 を返します。
+ */
+int
+trace_report()
+{
+	int rv = 0;
+
+	if (!trace_enabled) {
+		return 0;
+	}
+	trace_enabled = false;
+	if (trace_hist) {
+		trace_print_hist();
+	}
+	for (int i = 0; i < TRACE_MAX; i++) {
+		if (trace_stages[i].dropped > 0) {
+			fprintf(stderr, "trace: %s: %ju events dropped\n",
+				trace_names[i], (uintmax_t)trace_stages[i].dropped);
+		}
+	}
+	if (trace_json != NULL && trace_write_json(trace_json) < 0) {
+		rv = -1;
+	}
+	for (int i = 0; i < TRACE_MAX; i++) {
+		free(trace_stages[i].ev);
+	}
+	free(trace_marks);
+	return rv;
+}
@@ -0,0 +1,256 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* trellis (Viterbi) quantizer for PCM2/PCM3 */
+
+/*
+ * PCM3_TABLE は u8 の値ごとに (a,b,c) を 1 つに決めているが、
+ * ほぼ同じ電圧になる組み合わせはたくさんある (並べ替えだけでも 6 通り)。
+ * ここではバッファ (XP の 1 ページ分) ごとに、前後のサンプルを見て
+ * 組み合わせを選ぶ。
+ *
+ * コスト (u8 の 1 LSB を 1 とする)
+ *   量子化誤差^2 + lambda * 書き換え途中の誤差^2
+ * XP は 1 サンプルをチャンネル A, B, C の順に書くので、
+ * A を書いてから B を書くまでと、B から C までの間は
+ * 前のサンプルと混ざった電圧が出る。その誤差は
+ *   A を書いた後  (B+C の前の値) - (B+C の新しい値)
+ *   B を書いた後  (C の前の値) - (C の新しい値)
+ * lambda はサンプル周期に対するその時間の比くらいが目安。
+ *
+ * u8 の値ごとに電圧の近い組み合わせを TRELLIS_K 個だけ候補にして、
+ * 候補間の遷移を Viterbi で解く。内側のループは候補について
+ * 分岐のない float の配列演算にしてあるので、コンパイラがベクトル化する。
+ * バッファごとに独立に解くので、変換は状態を持たず、-P で並列にしても
+ * 逐次と一致する。
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+#include "lunaplay.h"
+#include "psgconv.h"
+
+// u8 の値ごとの候補数
+#define TRELLIS_K	(16)
+
+struct trellis_cand {
+	uint32_t code[256][TRELLIS_K];	// PCM2/PCM3 の出力 (テーブルと同じ並び)
+	float err2[256][TRELLIS_K];		// 量子化誤差^2
+	float g1[256][TRELLIS_K];		// 最初のチャンネルの後に残る電圧
+	float g2[256][TRELLIS_K];		// 2 番目のチャンネルの後に残る電圧
+};
+
+static struct trellis_cand trellis_pcm2;
+static struct trellis_cand trellis_pcm3;
+static float trellis_lambda;
+
+// 候補の並べ替え用
+struct trellis_sort {
+	double err;
+	int idx;
+};
+
+static
+int
+trellis_cmp(const void *a, const void *b)
+{
+	const struct trellis_sort *x = a;
+	const struct trellis_sort *y = b;
+
+	if (x->err != y->err) {
+		return x->err < y->err ? -1 : 1;
+	}
+	return x->idx - y->idx;
+}
+
+// nch チャンネルの組み合わせから候補を作る
+static
+void
+trellis_make(struct trellis_cand *tc, int nch, double gain, double offset)
+{
+	static struct trellis_sort s[4096];
+	int ncomb = 1 << (4 * nch);
+	double lsb = gain / 255;
+
+	for (int x = 0; x < 256; x++) {
+		double t = x * lsb + offset;
+		for (int i = 0; i < ncomb; i++) {
+			double v = 0;
+			for (int k = 0; k < nch; k++) {
+				v += PSG_VT[(i >> (4 * k)) & 15];
+			}
+			s[i].err = fabs(v - t);
+			s[i].idx = i;
+		}
+		qsort(s, ncomb, sizeof(*s), trellis_cmp);
+
+		for (int j = 0; j < TRELLIS_K; j++) {
+			int i = s[j].idx;
+			// 上位のニブルから先に書かれる
+			int ch[3];
+			for (int k = 0; k < nch; k++) {
+				ch[k] = (i >> (4 * (nch - 1 - k))) & 15;
+			}
+			if (nch == 2) {
+				tc->code[x][j] = (ch[0] << 8) | ch[1];
+				tc->g1[x][j] = PSG_VT[ch[1]] / lsb;
+				tc->g2[x][j] = 0;
+			} else {
+				tc->code[x][j] = (ch[0] << 16) | (ch[1] << 8) | ch[2];
+				tc->g1[x][j] = (PSG_VT[ch[1]] + PSG_VT[ch[2]]) / lsb;
+				tc->g2[x][j] = PSG_VT[ch[2]] / lsb;
+			}
+			double e = s[j].err / lsb;
+			tc->err2[x][j] = e * e;
+		}
+	}
+}
+
+static
+void
+trellis_init_once()
+{
+	const void *table;
+	size_t tablesize;
+	double gain;
+	double offset;
+
+	conv_params(ENC_PCM2, &table, &tablesize, &gain, &offset);
+	trellis_make(&trellis_pcm2, 2, gain, offset);
+	conv_params(ENC_PCM3, &table, &tablesize, &gain, &offset);
+	trellis_make(&trellis_pcm3, 3, gain, offset);
+}
+
+/*
+ trellis の変換を使えるようにします。lambda は書き換え途中の誤差の重み。
+ 変換を始める前に一度だけ呼ぶこと。
+ */
+void
+trellis_init(double lambda)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, trellis_init_once);
+	trellis_lambda = lambda;
+}
+
+/*
+ src の count サンプルの候補の番号を path に返します。
+ 成功すれば 0、メモリが足りなければ -1 を返します。
+ */
+static
+int
+trellis_search(const struct trellis_cand *tc, const uint8_t *src, int count,
+	uint8_t *path)
+{
+	float acc[TRELLIS_K];
+	uint32_t nacc[TRELLIS_K];
+	float lambda = trellis_lambda;
+
+	if (count == 0) {
+		return 0;
+	}
+	uint8_t (*bp)[TRELLIS_K] = malloc(count * sizeof(*bp));
+	if (bp == NULL) {
+		return -1;
+	}
+
+	for (int q = 0; q < TRELLIS_K; q++) {
+		acc[q] = tc->err2[src[0]][q];
+	}
+	for (int i = 1; i < count; i++) {
+		const float *pg1 = tc->g1[src[i - 1]];
+		const float *pg2 = tc->g2[src[i - 1]];
+		const float *qg1 = tc->g1[src[i]];
+		const float *qg2 = tc->g2[src[i]];
+		const float *qe = tc->err2[src[i]];
+
+		// コストは負にならないので、float のビット列を整数として比べても
+		// 大小は同じ。下位 4 bit を前の候補の番号に置き換えて、
+		// 最小と一緒に取り出す (整数の min だけになってベクトル化できる)
+		for (int q = 0; q < TRELLIS_K; q++) {
+			nacc[q] = UINT32_MAX;
+		}
+		for (int p = 0; p < TRELLIS_K; p++) {
+			float a = acc[p];
+			float h1 = pg1[p];
+			float h2 = pg2[p];
+			for (int q = 0; q < TRELLIS_K; q++) {
+				float d1 = h1 - qg1[q];
+				float d2 = h2 - qg2[q];
+				float c = a + lambda * (d1 * d1 + d2 * d2);
+				uint32_t u;
+				memcpy(&u, &c, sizeof(u));
+				u = (u & ~(uint32_t)(TRELLIS_K - 1)) | p;
+				nacc[q] = u < nacc[q] ? u : nacc[q];
+			}
+		}
+		// 桁落ちしないように最小を 0 にする
+		float min = HUGE_VALF;
+		for (int q = 0; q < TRELLIS_K; q++) {
+			uint32_t u = nacc[q] & ~(uint32_t)(TRELLIS_K - 1);
+			memcpy(&acc[q], &u, sizeof(u));
+			acc[q] += qe[q];
+			min = acc[q] < min ? acc[q] : min;
+			bp[i][q] = nacc[q] & (TRELLIS_K - 1);
+		}
+		for (int q = 0; q < TRELLIS_K; q++) {
+			acc[q] -= min;
+		}
+	}
+
+	int best = 0;
+	for (int q = 1; q < TRELLIS_K; q++) {
+		if (acc[q] < acc[best]) {
+			best = q;
+		}
+	}
+	for (int i = count - 1; i > 0; i--) {
+		path[i] = best;
+		best = bp[i][best];
+	}
+	path[0] = best;
+	free(bp);
+	return 0;
+}
+
+void
+conv_u8_pcm2_trellis(BUFFER *dst, BUFFER *src)
+{
+	int count = src->length;
+	uint8_t *s = src->ptr;
+	uint16_t *d = (uint16_t*)dst->ptr;
+	// 経路は出力の後半に置いて、前から詰めながら読む
+	uint8_t *path = dst->ptr + count;
+
+	if (trellis_search(&trellis_pcm2, s, count, path) < 0) {
+		// メモリが無ければテーブルで変換する
+		conv_u8_pcm2(dst, src);
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		*d++ = htobe16(trellis_pcm2.code[s[i]][path[i]]);
+	}
+	dst->length = count * 2;
+}
+
+void
+conv_u8_pcm3_trellis(BUFFER *dst, BUFFER *src)
+{
+	int count = src->length;
+	uint8_t *s = src->ptr;
+	uint32_t *d = (uint32_t*)dst->ptr;
+	uint8_t *path = dst->ptr + count * 3;
+
+	if (trellis_search(&trellis_pcm3, s, count, path) < 0) {
+		conv_u8_pcm3(dst, src);
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		*d++ = htobe32(trellis_pcm3.code[s[i]][path[i]]);
+	}
+	dst->length = count * 4;
+}
@@ -6,26 +6,370 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/endian.h>
 #include "lunaplay.h"
 #include "filehelper.h"
 
+#define WAVE_FORMAT_PCM			0x0001
+#define WAVE_FORMAT_IEEE_FLOAT	0x0003
+#define WAVE_FORMAT_IMA_ADPCM	0x0011
+#define WAVE_FORMAT_EXTENSIBLE	0xfffe
+
+// N ch ダウンミックスの上限 (7.1ch)
+#define WAV_MAXCHANNEL	8
+
 static int wav_read_1u8(DESC *desc, BUFFER *buf);
 static int wav_read_2u8(DESC *desc, BUFFER *buf);
+static int wav_read_Nu8(DESC *desc, BUFFER *buf);
 static int wav_read_1s16le(DESC *desc, BUFFER *buf);
 static int wav_read_2s16le(DESC *desc, BUFFER *buf);
+static int wav_read_1s24le(DESC *desc, BUFFER *buf);
+static int wav_read_2s24le(DESC *desc, BUFFER *buf);
+static int wav_read_1s32le(DESC *desc, BUFFER *buf);
+static int wav_read_2s32le(DESC *desc, BUFFER *buf);
+static int wav_read_Nsle(DESC *desc, BUFFER *buf);
+static int wav_read_1f32le(DESC *desc, BUFFER *buf);
+static int wav_read_2f32le(DESC *desc, BUFFER *buf);
+static int wav_read_Nf32le(DESC *desc, BUFFER *buf);
+
+static int wav_read_ima(DESC *desc, BUFFER *buf);
+static int64_t wav_seek_ima(DESC *desc, int64_t frames);
 
 static int wav_write_1u8(DESC *desc, BUFFER *buf);
 
 static int wav_read_close(DESC *desc);
 static int wav_write_close(DESC *desc);
 
+/* ***** IMA ADPCM ***** */
+
+struct ima {
+	int blockalign;		// block bytes
+	int spb;			// samples per block
+	int pos;			// next frame in pcm
+	int count;			// valid frames in pcm
+	int64_t frames;		// remaining frames (fact chunk, -1 = unknown)
+	int16_t *pcm;		// decoded block (interleaved)
+};
+
+#define IMA_NINDEX	89
+
+static const int16_t ima_steptab[IMA_NINDEX] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_indextab[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+/*
+ * (index, nibble) から差分と次の index を引くテーブル。
+ * ニブルごとの条件分岐を無くしてデコードを軽くする。
+ */
+static int32_t ima_difftab[IMA_NINDEX][16];
+static uint8_t ima_nexttab[IMA_NINDEX][16];
+
+static
+void
+ima_init_table_once()
+{
+	for (int i = 0; i < IMA_NINDEX; i++) {
+		int step = ima_steptab[i];
+		for (int n = 0; n < 16; n++) {
+			int diff = step >> 3;
+			if (n & 4) diff += step;
+			if (n & 2) diff += step >> 1;
+			if (n & 1) diff += step >> 2;
+			ima_difftab[i][n] = (n & 8) ? -diff : diff;
+
+			int next = i + ima_indextab[n];
+			if (next < 0) next = 0;
+			if (next > IMA_NINDEX - 1) next = IMA_NINDEX - 1;
+			ima_nexttab[i][n] = next;
+		}
+	}
+}
+
+// 複数スレッドから呼ばれても一度だけ作る
+static
+void
+ima_init_table()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, ima_init_table_once);
+}
+
+// 1 ブロック (len バイト) をデコードして、フレーム数を返す。
+static
+int
+ima_decode_block(struct ima *ima, const uint8_t *src, int len, int ch)
+{
+	if (len < 4 * ch) {
+		return 0;
+	}
+	// 最後のブロックは短いことがある
+	int count = (len - 4 * ch) * 2 / ch + 1;
+	if (count > ima->spb) {
+		count = ima->spb;
+	}
+
+	for (int c = 0; c < ch; c++) {
+		const uint8_t *h = src + 4 * c;
+		int32_t pred = (int16_t)(h[0] | h[1] << 8);
+		int idx = h[2];
+		if (idx > IMA_NINDEX - 1) idx = IMA_NINDEX - 1;
+
+		int16_t *d = ima->pcm + c;
+		*d = pred;
+		d += ch;
+
+		// データは 4 バイト (8 サンプル) 単位で ch ごとにインタリーブ
+		const uint8_t *s = src + 4 * ch + 4 * c;
+		for (int i = 1; i < count; ) {
+			for (int k = 0; k < 4 && i < count; k++) {
+				int b = s[k];
+				pred += ima_difftab[idx][b & 15];
+				idx = ima_nexttab[idx][b & 15];
+				pred = pred < -32768 ? -32768 : pred;
+				pred = pred > 32767 ? 32767 : pred;
+				*d = pred;
+				d += ch;
+				i++;
+				if (i >= count) break;
+				pred += ima_difftab[idx][b >> 4];
+				idx = ima_nexttab[idx][b >> 4];
+				pred = pred < -32768 ? -32768 : pred;
+				pred = pred > 32767 ? 32767 : pred;
+				*d = pred;
+				d += ch;
+				i++;
+			}
+			s += 4 * ch;
+		}
+	}
+	return count;
+}
+
 /* ***** initializer ***** */
 
+// リニア PCM/float のカーネルを選択する。
+static
+int
+wav_pcm_init(DESC *desc, int fmtid, int channelcount, int bitpersample,
+	int blockalign)
+{
+	// サンプル形式とチャンネル数からカーネルを決める。
+	// 1ch, 2ch, Nch の順。
+	READER readers[] = {
+		wav_read_1u8,    wav_read_2u8,    wav_read_Nu8,
+		wav_read_1s16le, wav_read_2s16le, wav_read_Nsle,
+		wav_read_1s24le, wav_read_2s24le, wav_read_Nsle,
+		wav_read_1s32le, wav_read_2s32le, wav_read_Nsle,
+		wav_read_1f32le, wav_read_2f32le, wav_read_Nf32le,
+	};
+	const char *readers_name[] = {
+		"1u8",    "2u8",    "Nu8",
+		"1s16le", "2s16le", "Ns16le",
+		"1s24le", "2s24le", "Ns24le",
+		"1s32le", "2s32le", "Ns32le",
+		"1f32le", "2f32le", "Nf32le",
+	};
+
+	int rdid = 0;
+	if (channelcount == 1) {
+	} else if (channelcount == 2) {
+		rdid += 1;
+	} else if (channelcount > 2 && channelcount <= WAV_MAXCHANNEL) {
+		rdid += 2;
+	} else {
+		fprintf(stderr, "WAV unsupported channel count %d\n", channelcount);
+		return -1;
+	}
+	if (fmtid == WAVE_FORMAT_IEEE_FLOAT) {
+		if (bitpersample == 32) {
+			rdid += 3 * 4;
+		} else {
+			fprintf(stderr, "WAV unsupported float bitpersample %d\n",
+				bitpersample);
+			return -1;
+		}
+	} else if (bitpersample == 8) {
+	} else if (bitpersample == 16) {
+		rdid += 3 * 1;
+	} else if (bitpersample == 24) {
+		rdid += 3 * 2;
+	} else if (bitpersample == 32) {
+		rdid += 3 * 3;
+	} else {
+		fprintf(stderr, "WAV unsupported bitpersample %d\n", bitpersample);
+		return -1;
+	}
+	desc->reader = readers[rdid];
+
+	if (opt_v) {
+		fprintf(stderr, "WAV format: %s\n", readers_name[rdid]);
+	}
+
+	desc->channels = channelcount;
+	desc->samplesize = bitpersample / 8;
+	desc->framesize = desc->samplesize * channelcount;
+	if (blockalign != 0 && blockalign != desc->framesize) {
+		fprintf(stderr, "WAV blockalign mismatch %d\n", blockalign);
+		return -1;
+	}
+	desc->mixmul = (65536 + channelcount - 1) / channelcount;
+	desc->tmp = malloc(XP_BUFSIZE * desc->framesize);
+	if (desc->tmp == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	// フレーム単位でどこからでも読める
+	desc->splittable = true;
+	desc->seeker = desc_seekframes;
+	return 0;
+}
+
+// IMA ADPCM の初期化。
+static
+int
+wav_ima_init(DESC *desc, int channelcount, int bitpersample, int blockalign,
+	const uint8_t *fmtext, int extlen, int64_t factsamples)
+{
+	if (bitpersample != 4) {
+		fprintf(stderr, "IMA ADPCM unsupported bitpersample %d\n",
+			bitpersample);
+		return -1;
+	}
+	if (channelcount < 1 || channelcount > WAV_MAXCHANNEL) {
+		fprintf(stderr, "IMA ADPCM unsupported channel count %d\n",
+			channelcount);
+		return -1;
+	}
+	// ヘッダ 4 バイト/ch の後に 4 バイト/ch 単位のデータが続く
+	if (blockalign <= 4 * channelcount || blockalign % (4 * channelcount)) {
+		fprintf(stderr, "IMA ADPCM invalid blockalign %d\n", blockalign);
+		return -1;
+	}
+	int spb = (blockalign - 4 * channelcount) * 2 / channelcount + 1;
+	if (extlen >= 4) {
+		int v = fmtext[2] | fmtext[3] << 8;
+		if (v != spb) {
+			fprintf(stderr, "IMA ADPCM samples per block mismatch %d\n", v);
+			return -1;
+		}
+	}
+
+	ima_init_table();
+
+	struct ima *ima = malloc(sizeof(*ima) + spb * channelcount * sizeof(int16_t));
+	if (ima == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		return -1;
+	}
+	ima->blockalign = blockalign;
+	ima->spb = spb;
+	ima->pos = 0;
+	ima->count = 0;
+	ima->frames = factsamples;
+	ima->pcm = (int16_t *)(ima + 1);
+
+	desc->channels = channelcount;
+	desc->mixmul = (65536 + channelcount - 1) / channelcount;
+	desc->tmp = malloc(blockalign);
+	if (desc->tmp == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		free(ima);
+		return -1;
+	}
+	desc->priv = ima;
+	desc->reader = wav_read_ima;
+	desc->seeker = wav_seek_ima;
+
+	if (opt_v) {
+		fprintf(stderr, "WAV format: ima%d (%d samples/block)\n",
+			channelcount, spb);
+	}
+	return 0;
+}
+
+// smpl チャンクの最初のループを読む。chunklen の後から呼ぶ。
+static
+int
+wav_read_smpl(DESC *desc, int fd, uint32_t chunklen)
+{
+	uint8_t hdr[36];
+	uint8_t loop[24];
+	uint32_t len = chunklen;
+
+	if (len < sizeof(hdr) || readbuf(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+		return 0;
+	}
+	len -= sizeof(hdr);
+	uint32_t numloops = le32dec(hdr + 28);
+	if (numloops > 0 && len >= sizeof(loop)) {
+		if (readbuf(fd, loop, sizeof(loop)) != sizeof(loop)) {
+			return 0;
+		}
+		len -= sizeof(loop);
+		// end はループに含まれるサンプル
+		uint32_t start = le32dec(loop + 8);
+		uint32_t end = le32dec(loop + 12);
+		if (start <= end) {
+			desc->loopstart = start;
+			desc->loopend = (int64_t)end + 1;
+		}
+		if (opt_v) {
+			printf("smpl loop    :%u-%u\n", start, end);
+		}
+	}
+	return readskip(fd, (off_t)len + (chunklen & 1));
+}
+
+// data チャンクの後ろにある smpl チャンクを探す。
+// シークできなければ何もしない。fd の位置は元に戻す。
+static
+void
+wav_scan_smpl(DESC *desc, int fd)
+{
+	if (desc->remain < 0) {
+		return;
+	}
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		return;
+	}
+	off_t next = pos + desc->remain + (desc->remain & 1);
+	if (lseek(fd, next, SEEK_SET) == next) {
+		uint32_t tag;
+		uint32_t chunklen;
+		while (readtag(fd, &tag) && read32le(fd, &chunklen)) {
+			if (cmptag(tag, "smpl")) {
+				wav_read_smpl(desc, fd, chunklen);
+				break;
+			}
+			if (!readskip(fd, (off_t)chunklen + (chunklen & 1))) {
+				break;
+			}
+		}
+	}
+	lseek(fd, pos, SEEK_SET);
+}
+
 int
 wav_read_init(DESC *desc, int fd)
 {
@@ -38,14 +382,29 @@ wav_read_init(DESC *desc, int fd)
 	uint16_t fmtid = 0;
 	uint16_t channelcount = 0;
 	uint32_t freq;
-	uint32_t dummy32;
-	uint16_t dummy16;
+	uint32_t byterate;
+	uint16_t blockalign = 0;
 	uint16_t bitpersample;
-	int32_t datalen;
+	uint16_t validbits = 0;
+	uint8_t fmtext[2+2+4+16];	// cbSize 以降 (EXTENSIBLE)
+	int extlen = 0;
+	int64_t factsamples = -1;
+	uint32_t datalen;
+	int64_t ds64_riff = 0;
+	int64_t ds64_data = -1;
+	int64_t ds64_sample;
+	uint32_t ds64_tablelen;
+	bool isrf64;
 
 	r =
 	readtag(fd, &tag) &&
-	cmptag(tag, "RIFF") &&
+	(cmptag(tag, "RIFF") || cmptag(tag, "RF64") || cmptag(tag, "BW64"));
+	if (!r) {
+		fprintf(stderr, "WAVE header read error\n");
+		return -1;
+	}
+	isrf64 = !cmptag(tag, "RIFF");
+	r =
 	read32le(fd, &rifflen) &&
 	readtag(fd, &tag) &&
 	cmptag(tag, "WAVE");
@@ -60,14 +419,38 @@ wav_read_init(DESC *desc, int fd)
 			return -1;
 		}
 
-		if (cmptag(tag, "fmt ")) {
+		if (cmptag(tag, "ds64")) {
+			// RF64/BW64 の 64bit 長。data チャンク長はこちらが正。
+			int32_t chunklen;
+			r =
+			read32le(fd, &chunklen) &&
+			read64le(fd, &ds64_riff) &&
+			read64le(fd, &ds64_data) &&
+			read64le(fd, &ds64_sample) &&
+			read32le(fd, &ds64_tablelen)
+			;
+			if (!r || (uint32_t)chunklen < 8+8+8+4) {
+				fprintf(stderr, "ds64 header read error\n");
+				return -1;
+			}
+			if (opt_v) {
+				printf("ds64 riff    :%jd\n", (intmax_t)ds64_riff);
+				printf("ds64 data    :%jd\n", (intmax_t)ds64_data);
+				printf("ds64 sample  :%jd\n", (intmax_t)ds64_sample);
+			}
+			// table は data 以外の巨大チャンク用なので読み飛ばす
+			if (!readskip(fd, (uint32_t)chunklen - (8+8+8+4))) {
+				fprintf(stderr, "ds64 header skip error\n");
+				return -1;
+			}
+		} else if (cmptag(tag, "fmt ")) {
 			r = 
 			read32le(fd, &fmtlen) &&
 			read16le(fd, &fmtid) &&
 			read16le(fd, &channelcount) &&
 			read32le(fd, &freq) &&
-			read32le(fd, &dummy32) &&
-			read16le(fd, &dummy16) &&
+			read32le(fd, &byterate) &&
+			read16le(fd, &blockalign) &&
 			read16le(fd, &bitpersample)
 			;
 			if (opt_v) {
@@ -86,13 +469,64 @@ wav_read_init(DESC *desc, int fd)
 			if (skip < 0) {
 				fprintf(stderr, "fmt length error\n");
 				return -1;
-			} else if (skip > 0) {
-				r = readskip(fd, fmtlen - (2+2+4+4+2+2));
+			}
+			// 拡張部分は WAVE_FORMAT_EXTENSIBLE の分だけ読む
+			extlen = skip;
+			if (extlen > sizeof(fmtext)) {
+				extlen = sizeof(fmtext);
+			}
+			memset(fmtext, 0, sizeof(fmtext));
+			if (readbuf(fd, fmtext, extlen) != extlen) {
+				fprintf(stderr, "fmt header read error\n");
+				return -1;
+			}
+			skip -= extlen;
+			// fmt チャンクも 2 バイト境界に整列
+			skip += fmtlen & 1;
+			if (skip > 0) {
+				r = readskip(fd, skip);
 				if (!r) {
 					fprintf(stderr, "fmt header skip error\n");
 					return -1;
 				}
 			}
+			if (fmtid == WAVE_FORMAT_EXTENSIBLE) {
+				uint16_t cbsize = fmtext[0] | fmtext[1] << 8;
+				if (extlen < sizeof(fmtext) || cbsize < 22) {
+					fprintf(stderr, "fmt extensible length error\n");
+					return -1;
+				}
+				validbits = fmtext[2] | fmtext[3] << 8;
+				// SubFormat GUID の先頭 2 バイトが実際の fmtid
+				fmtid = fmtext[8] | fmtext[9] << 8;
+				if (opt_v) {
+					printf("validbits    :%d\n", validbits);
+					printf("subformat    :%d\n", fmtid);
+				}
+			}
+		} else if (cmptag(tag, "fact")) {
+			// 圧縮形式の総サンプル数
+			uint32_t chunklen;
+			uint32_t samples;
+			r =
+			read32le(fd, &chunklen) &&
+			chunklen >= 4 &&
+			read32le(fd, &samples) &&
+			readskip(fd, (off_t)chunklen - 4 + (chunklen & 1))
+			;
+			if (!r) {
+				fprintf(stderr, "fact chunk read error\n");
+				return -1;
+			}
+			factsamples = samples;
+		} else if (cmptag(tag, "smpl")) {
+			// ループポイント
+			uint32_t chunklen;
+			if (!read32le(fd, &chunklen) ||
+			    !wav_read_smpl(desc, fd, chunklen)) {
+				fprintf(stderr, "smpl chunk read error\n");
+				return -1;
+			}
 		} else if (cmptag(tag, "data")) {
 			if (!read32le(fd, &datalen)) {
 				fprintf(stderr, "data len error\n");
@@ -100,17 +534,38 @@ wav_read_init(DESC *desc, int fd)
 			}
 			break;
 		} else {
-			int32_t chunklen;
+			uint32_t chunklen;
 			if (!read32le(fd, &chunklen)) {
 				fprintf(stderr, "unknown chunk error\n");
 				return -1;
 			}
-			if (!readskip(fd, chunklen)) {
+			// チャンクは 2 バイト境界に整列
+			if (!readskip(fd, (off_t)chunklen + (chunklen & 1))) {
 				fprintf(stderr, "unknown chunk read error\n");
 				return -1;
 			}
 		}
 	}
+
+	if (isrf64 && datalen == 0xffffffff) {
+		if (ds64_data < 0) {
+			fprintf(stderr, "RF64 without ds64 chunk\n");
+			return -1;
+		}
+		desc->remain = ds64_data;
+	} else if (datalen == 0xffffffff) {
+		// ストリーミング出力などで長さ不明
+		desc->remain = -1;
+	} else {
+		desc->remain = datalen;
+	}
+	if (opt_v) {
+		printf("datalen      :%jd\n", (intmax_t)desc->remain);
+	}
+	if (desc->loopend == 0) {
+		wav_scan_smpl(desc, fd);
+	}
+
 	if (opt_v) {
 		fprintf(stderr, "fmtid  : %d\n", fmtid);
 		fprintf(stderr, "channel: %d\n", channelcount);
@@ -118,38 +573,18 @@ wav_read_init(DESC *desc, int fd)
 		fprintf(stderr, "bit    : %d\n", bitpersample);
 	}
 
-	if (fmtid != 1) {
-		fprintf(stderr, "fmtid %d is not supported\n", fmtid);
-		return -1;
-	}
-
-	READER readers[] = {
-		wav_read_1u8, wav_read_2u8, wav_read_1s16le, wav_read_2s16le,
-	};
-	const char *readers_name[] = {
-		"1u8", "2u8", "1s16le", "2s16le",
-	};
-
-	int rdid = 0;
-	if (channelcount == 1) {
-	} else if (channelcount == 2) {
-		rdid += 1;
+	if (fmtid == WAVE_FORMAT_PCM || fmtid == WAVE_FORMAT_IEEE_FLOAT) {
+		r = wav_pcm_init(desc, fmtid, channelcount, bitpersample, blockalign);
+	} else if (fmtid == WAVE_FORMAT_IMA_ADPCM) {
+		r = wav_ima_init(desc, channelcount, bitpersample, blockalign,
+			fmtext, extlen, factsamples);
 	} else {
-		fprintf(stderr, "WAV unsupported channel count %d\n", channelcount);
+		fprintf(stderr, "fmtid %d is not supported\n", fmtid);
 		return -1;
 	}
-	if (bitpersample == 8) {
-	} else if (bitpersample == 16) {
-		rdid += 2;
-	} else {
-		fprintf(stderr, "WAV unsupported bitpersample %d\n", bitpersample);
+	if (r < 0) {
 		return -1;
 	}
-	desc->reader = readers[rdid];
-
-	if (opt_v) {
-		fprintf(stderr, "WAV format: %s\n", readers_name[rdid]);
-	}
 
 	desc->closer = wav_read_close;
 
@@ -172,7 +607,8 @@ wav_write_init(DESC *desc, int fd)
 
 	tmpfd = mkstemp(template);
 	if (tmpfd == -1) {
-		err(1, "mkstemp");
+		fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+		return -1;
 	}
 	unlink(template);
 
@@ -181,15 +617,48 @@ wav_write_init(DESC *desc, int fd)
 
 	desc->fd = tmpfd;
 	desc->originalfd = fd;
+	return 0;
 }
 
 /* ***** reader ***** */
 
+/*
+ * カーネルはフォーマットごとに分けてあり、ループ内でフォーマットを
+ * 判定しない。多ビットの整数は最上位バイトのみを使う。
+ */
+
+// float を u8 に丸める。比較は条件転送になるので分岐しない。
+// int にする前に float のまま [-1, 1] に収める (NaN は無音)。
+// 範囲外の float を int にするのは未定義動作
+static inline
+uint8_t
+f32_u8(float f)
+{
+	f = f == f ? f : 0.0f;
+	f = f < -1.0f ? -1.0f : f;
+	f = f > 1.0f ? 1.0f : f;
+	int v = (int)(f * 128.0f + 128.5f);
+	v = v > 255 ? 255 : v;
+	return v;
+}
+
+static inline
+float
+f32le(const uint8_t *s)
+{
+	uint32_t u;
+	float f;
+	memcpy(&u, s, 4);
+	u = le32toh(u);
+	memcpy(&f, &u, 4);
+	return f;
+}
+
 static
 int
 wav_read_1u8(DESC *desc, BUFFER *buf)
 {
-	int n = readbuf(desc->fd, buf->ptr + buf->length, buf->bufsize - buf->length);
+	ssize_t n = desc_readdata(desc, buf->ptr + buf->length, buf->bufsize - buf->length);
 	if (n < 0) {
 		return n;
 	}
@@ -204,18 +673,15 @@ static
 int
 wav_read_2u8(DESC *desc, BUFFER *buf)
 {
-	uint8_t tmp[XP_BUFSIZE * 2];
-
-	int n = readbuf(desc->fd, tmp, (buf->bufsize - buf->length) * 2);
-	if (n < 0) {
-		return n;
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
 	}
-	if (n == 0) {
+	if (count == 0) {
 		return buf->length;
 	}
 
-	int count = n / 2;
-	uint8_t *s = tmp;
+	uint8_t *s = desc->tmp;
 	uint8_t *d = buf->ptr + buf->length;
 	for (int i = 0; i < count; i++) {
 		uint16_t a, b;
@@ -223,25 +689,49 @@ wav_read_2u8(DESC *desc, BUFFER *buf)
 		b = *s++;
 		*d++ = (a + b) >> 1;
 	}
-	buf->length += n;
+	buf->length += count;
 	return buf->length;
 }
 
 static
 int
-wav_read_1s16le(DESC *desc, BUFFER *buf)
+wav_read_Nu8(DESC *desc, BUFFER *buf)
 {
-	uint8_t tmp[XP_BUFSIZE * 2];
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
 
-	int n = readbuf(desc->fd, tmp, (buf->bufsize - buf->length) * 2);
-	if (n < 0) {
-		return n;
+	int ch = desc->channels;
+	uint32_t mixmul = desc->mixmul;
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint32_t sum = 0;
+		for (int c = 0; c < ch; c++) {
+			sum += *s++;
+		}
+		*d++ = (sum * mixmul) >> 16;
 	}
-	if (n == 0) {
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_1s16le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
 		return buf->length;
 	}
-	int count = n / 2;
-	uint8_t *s = tmp + 1;
+	uint8_t *s = desc->tmp + 1;
 	uint8_t *d = buf->ptr + buf->length;
 	for (int i = 0; i < count; i++) {
 		*d++ = (*s) ^ 0x80;
@@ -255,17 +745,14 @@ static
 int
 wav_read_2s16le(DESC *desc, BUFFER *buf)
 {
-	uint8_t tmp[XP_BUFSIZE * 4];
-
-	int n = readbuf(desc->fd, tmp, (buf->bufsize - buf->length) * 4);
-	if (n < 0) {
-		return n;
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
 	}
-	if (n == 0) {
+	if (count == 0) {
 		return buf->length;
 	}
-	int count = n / 4;
-	uint8_t *s = tmp + 1;
+	uint8_t *s = desc->tmp + 1;
 	uint8_t *d = buf->ptr + buf->length;
 	for (int i = 0; i < count; i++) {
 		uint16_t a, b;
@@ -279,6 +766,300 @@ wav_read_2s16le(DESC *desc, BUFFER *buf)
 	return buf->length;
 }
 
+static
+int
+wav_read_1s24le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp + 2;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		*d++ = (*s) ^ 0x80;
+		s += 3;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_2s24le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp + 2;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint16_t a, b;
+		a = (*s) ^ 0x80;
+		s += 3;
+		b = (*s) ^ 0x80;
+		s += 3;
+		*d++ = (a + b) >> 1;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_1s32le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp + 3;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		*d++ = (*s) ^ 0x80;
+		s += 4;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_2s32le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp + 3;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint16_t a, b;
+		a = (*s) ^ 0x80;
+		s += 4;
+		b = (*s) ^ 0x80;
+		s += 4;
+		*d++ = (a + b) >> 1;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+// 16/24/32bit 共通の N ch ダウンミックス
+static
+int
+wav_read_Nsle(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+
+	int ch = desc->channels;
+	int size = desc->samplesize;
+	uint32_t mixmul = desc->mixmul;
+	uint8_t *s = desc->tmp + size - 1;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		uint32_t sum = 0;
+		for (int c = 0; c < ch; c++) {
+			sum += (*s) ^ 0x80;
+			s += size;
+		}
+		*d++ = (sum * mixmul) >> 16;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_1f32le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		*d++ = f32_u8(f32le(s));
+		s += 4;
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_2f32le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		float a, b;
+		a = f32le(s);
+		s += 4;
+		b = f32le(s);
+		s += 4;
+		*d++ = f32_u8((a + b) * 0.5f);
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+static
+int
+wav_read_Nf32le(DESC *desc, BUFFER *buf)
+{
+	ssize_t count = desc_readframes(desc, buf);
+	if (count < 0) {
+		return count;
+	}
+	if (count == 0) {
+		return buf->length;
+	}
+
+	int ch = desc->channels;
+	float mix = 1.0f / ch;
+	uint8_t *s = desc->tmp;
+	uint8_t *d = buf->ptr + buf->length;
+	for (int i = 0; i < count; i++) {
+		float sum = 0;
+		for (int c = 0; c < ch; c++) {
+			sum += f32le(s);
+			s += 4;
+		}
+		*d++ = f32_u8(sum * mix);
+	}
+	buf->length += count;
+	return buf->length;
+}
+
+// IMA ADPCM をブロック単位でデコードして u8 に変換する。
+// デコード済みで未出力のフレームは次回の呼び出しに持ち越す。
+static
+int
+wav_read_ima(DESC *desc, BUFFER *buf)
+{
+	struct ima *ima = desc->priv;
+	int ch = desc->channels;
+	uint32_t mixmul = desc->mixmul;
+
+	while (buf->length < buf->bufsize) {
+		if (ima->pos >= ima->count) {
+			ssize_t n = desc_readdata(desc, desc->tmp, ima->blockalign);
+			if (n < 0) {
+				return n;
+			}
+			ima->count = ima_decode_block(ima, desc->tmp, n, ch);
+			ima->pos = 0;
+			// 最終ブロックのパディングを出力しない
+			if (ima->frames >= 0 && ima->count > ima->frames) {
+				ima->count = ima->frames;
+			}
+			if (ima->frames >= 0) {
+				ima->frames -= ima->count;
+			}
+			if (ima->count == 0) {
+				break;
+			}
+		}
+
+		int count = ima->count - ima->pos;
+		if (count > buf->bufsize - buf->length) {
+			count = buf->bufsize - buf->length;
+		}
+		const int16_t *s = ima->pcm + ima->pos * ch;
+		uint8_t *d = buf->ptr + buf->length;
+		if (ch == 1) {
+			for (int i = 0; i < count; i++) {
+				*d++ = ((uint16_t)*s++ >> 8) ^ 0x80;
+			}
+		} else if (ch == 2) {
+			for (int i = 0; i < count; i++) {
+				int32_t a = *s++;
+				int32_t b = *s++;
+				*d++ = ((a + b) >> 9) + 128;
+			}
+		} else {
+			for (int i = 0; i < count; i++) {
+				uint32_t sum = 0;
+				for (int c = 0; c < ch; c++) {
+					sum += ((uint16_t)*s++ >> 8) ^ 0x80;
+				}
+				*d++ = (sum * mixmul) >> 16;
+			}
+		}
+		ima->pos += count;
+		buf->length += count;
+	}
+	return buf->length;
+}
+
+/* ***** seeker ***** */
+
+/*
+ デコード済みの残りを捨て、あとはブロック単位でシークする。
+ ブロック未満の端数はデコードして捨ててもらう。
+ */
+static
+int64_t
+wav_seek_ima(DESC *desc, int64_t frames)
+{
+	struct ima *ima = desc->priv;
+	int64_t done = ima->count - ima->pos;
+	if (done > frames) {
+		done = frames;
+	}
+	ima->pos += done;
+
+	int64_t blocks = (frames - done) / ima->spb;
+	if (ima->frames >= 0 && blocks > ima->frames / ima->spb) {
+		blocks = ima->frames / ima->spb;
+	}
+	if (desc->remain >= 0 && blocks > desc->remain / ima->blockalign) {
+		blocks = desc->remain / ima->blockalign;
+	}
+	off_t bytes = blocks * ima->blockalign;
+	if (!readskip(desc->fd, bytes)) {
+		return -1;
+	}
+	if (desc->remain >= 0) {
+		desc->remain -= bytes;
+	}
+	if (ima->frames >= 0) {
+		ima->frames -= blocks * ima->spb;
+	}
+	return done + blocks * ima->spb;
+}
+
 /* ***** writer ***** */
 /* support only 1u8 */
 
@@ -297,6 +1078,8 @@ static
 int
 wav_read_close(DESC *desc)
 {
+	free(desc->priv);
+	free(desc->tmp);
 	close(desc->fd);
 	return 0;
 }
@@ -314,19 +1097,47 @@ wav_write_close(DESC *desc)
 	int r;
 	int rv = -1;
 
-	int32_t datalen = (int32_t)lseek(desc->fd, 0, SEEK_CUR);
-
-	r = 
-	writetag(fd, "RIFF") &&
-	write32le(fd,
+	off_t datalen = lseek(desc->fd, 0, SEEK_CUR);
+	int64_t rifflen =
 		4	// WAVE
 		+4	// fmt 
 		+4	// fmt chunk length
 		+16	// fmt chunk
 		+4	// data
 		+4	// data chunk length
-		+ datalen) &&
-	writetag(fd, "WAVE") && 
+		+ datalen;
+
+	if (datalen < 0) {
+		fprintf(stderr, "lseek: %s\n", strerror(errno));
+		goto done;
+	}
+
+	if (rifflen > 0xffffffffLL) {
+		// 4GiB を越えるので RF64 で出力する
+		rifflen += 4 + 4 + 28;	// ds64 chunk
+		if (opt_v) {
+			fprintf(stderr, "WAV data exceeds 4GiB, writing RF64\n");
+		}
+		r =
+		writetag(fd, "RF64") &&
+		write32le(fd, 0xffffffff) &&
+		writetag(fd, "WAVE") &&
+		writetag(fd, "ds64") &&
+		write32le(fd, 28) &&	// ds64 chunk length
+		write64le(fd, rifflen) &&
+		write64le(fd, datalen) &&
+		write64le(fd, datalen) &&	// sample count (1ch 1byte)
+		write32le(fd, 0)		// table length
+		;
+		datalen = 0xffffffff;
+	} else {
+		r =
+		writetag(fd, "RIFF") &&
+		write32le(fd, rifflen) &&
+		writetag(fd, "WAVE");
+	}
+
+	r = r &&
 	writetag(fd, "fmt ") &&
 	write32le(fd, 16) &&	// fmt chunk length
 	write16le(fd, 1) &&		// PCM FORMAT
@@ -345,8 +1156,8 @@ wav_write_close(DESC *desc)
 
 	lseek(tmpfd, 0, SEEK_SET);
 	for (;;) {
-		char buf[4096];
-		int n = readbuf(tmpfd, buf, sizeof(buf));
+		uint8_t buf[65536];
+		ssize_t n = readbuf(tmpfd, buf, sizeof(buf));
 		if (n == 0) break;
 		if (n < 0) {
 			fprintf(stderr, "read: %s\n", strerror(errno));
@@ -0,0 +1,469 @@
+/* vi: set ts=4: */
+/* see LICENSE */
+
+/* XP device (firmware download, double-buffered pages) */
+
+/*
+ * XP の共有メモリの 2 つのページ (4000H, 8000H) に交互に書く。
+ * XP は再生中のページを PAGEENDH (ページ 0 = 80H, ページ 1 = C0H) で
+ * 知らせるので、次に書くページを XP が再生している間は待つ。
+ * 最初のページを渡したところで再生を始める。
+ *
+ * 状態はすべて struct xp にあり、大域変数は持たない。
+ * lunaplay の writer (devxp.c) と liblunaplay の両方から使う。
+ * エラーは errno を設定して返し、表示はしない。
+ *
+ * ファームウェアがエラー (XP_STAT_ERROR) を出したら、待ちをやめて
+ * EIO を返す。ホストとフォーマットコードの約束が変わったので、
+ * MAGIC の 8 バイト目 (版) が XP_FIRM_VERSION でないファームウェアは
+ * 入れない (ENOEXEC)。
+ *
+ * XP には停止のコマンドが無い (ファームウェアは割り込みかリセットで
+ * 止める) ので、最後のページの後は両方のページを最後のサンプルで
+ * 埋めて無音にする (xp_drain)。
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// XXX: local test now
+// TODO: "" to <>
+#include "machine/xpio.h"
+
+#include "lunaplay.h"
+
+#define XP_DEV	"/dev/xp"
+
+#define XP_VAR_BASE		0x0100
+#define XP_MAGIC		(XP_VAR_BASE + 0)
+#define XP_CMD_START	(XP_VAR_BASE + 8)
+#define XP_TIMER		(XP_VAR_BASE + 9)
+#define XP_ENC			(XP_VAR_BASE + 10)
+#define XP_STAT_READY	(XP_VAR_BASE + 11)
+#define XP_STAT_ERROR	(XP_VAR_BASE + 12)
+#define XP_PAGEENDL		(XP_VAR_BASE + 13)
+#define XP_PAGEENDH		(XP_VAR_BASE + 14)
+
+// MAGIC は "LUNAPSG" と版
+#define XP_FIRM_MAGIC	"LUNAPSG"
+#define XP_FIRM_VERSION	(2)
+
+// ファームウェアが準備できるまで待つ時間 (秒)
+#define XP_READY_TIMEOUT	(1.0)
+
+#define XP_FIRMSIZE_MIN	0x0200
+#define XP_FIRMSIZE_MAX	0x0fe00
+
+#define XP_MAX_SIZE 0xfe00
+
+// freq to timer
+#define XP_CPU_FREQ 6144000
+#define XP_TIMER_DIV 20
+#define XP_TIMER_BASEFREQ (XP_CPU_FREQ / XP_TIMER_DIV)
+
+static const uint8_t xp_builtin_firmware[] = {
+#include "firmware.inc"
+};
+
+struct xp {
+	int fd;
+	volatile uint8_t *ptr;
+	int enc;
+	int stride;
+	int pollusec;		// 待ちの間隔 (0 なら空回り)
+	double rate;		// XP の実際の再生周波数
+	int curpage;		// 次に書くページ
+	bool started;
+	bool drained;		// xp_drain の後、何も渡していない
+	double t0;			// 再生を始めた時刻
+	int64_t committed;	// 渡したフレーム数
+	int64_t pagestart[2];	// ページの先頭のフレーム位置
+	int64_t pageframes[2];	// ページのフレーム数
+	uint8_t lasthdr;	// ADPT の最後のページのフォーマット
+	uint8_t last[4];	// 最後に渡したサンプル
+	int laststride;
+};
+
+static
+int
+xp_readmem8(struct xp *xp, int offset)
+{
+	return xp->ptr[offset];
+}
+
+static
+void
+xp_writemem8(struct xp *xp, int offset, int v)
+{
+	xp->ptr[offset] = v;
+}
+
+static
+double
+xp_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static
+void
+xp_sleep(struct xp *xp)
+{
+	if (xp->pollusec > 0) {
+		struct timespec ts = { 0, xp->pollusec * 1000L };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// ファームウェアのファイルを読む。成功すれば長さを返す。
+static
+ssize_t
+xp_load_firmware(const char *fname, uint8_t **firmware)
+{
+	struct stat sb;
+	uint8_t *buf = NULL;
+
+	int fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1) {
+		goto error;
+	}
+	if (sb.st_size < XP_FIRMSIZE_MIN || sb.st_size > XP_FIRMSIZE_MAX) {
+		errno = EINVAL;
+		goto error;
+	}
+	buf = malloc(sb.st_size);
+	if (buf == NULL) {
+		goto error;
+	}
+	if (read(fd, buf, sb.st_size) != sb.st_size) {
+		errno = EIO;
+		goto error;
+	}
+	close(fd);
+	*firmware = buf;
+	return sb.st_size;
+
+ error:
+	free(buf);
+	close(fd);
+	return -1;
+}
+
+// ファームウェアの MAGIC と版を調べる
+static
+int
+xp_check_firmware(const uint8_t *fw, size_t len)
+{
+	if (len < XP_MAGIC + 8 ||
+	    memcmp(&fw[XP_MAGIC], XP_FIRM_MAGIC, 7) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fw[XP_MAGIC + 7] != XP_FIRM_VERSION) {
+		// フォーマットコードの違う古いファームウェア
+		errno = ENOEXEC;
+		return -1;
+	}
+	return 0;
+}
+
+// XP がエラーを出していれば errno を EIO にして -1 を返す
+static
+int
+xp_error(struct xp *xp)
+{
+	if (xp_readmem8(xp, XP_STAT_ERROR) != 0) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ XP にファームウェア (NULL なら内蔵のもの) を入れて、enc (ENC_PCM1 ..
+ ENC_ADPT) を freq Hz で再生する準備をします。待ちは pollusec ごとに
+ 寝ます (0 なら空回り)。
+ 成功すれば struct xp を、エラーなら errno を設定して NULL を返します。
+ */
+struct xp *
+xp_open(const char *firmware, int enc, int freq, int pollusec)
+{
+	struct xp_download xpdl;
+	uint8_t *fw = NULL;
+	ssize_t fwlen;
+	int e;
+
+	if (enc < ENC_PCM1 || enc > ENC_ADPT || freq <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	int divisor = XP_TIMER_BASEFREQ / freq;
+	if (divisor < 6 || divisor > 256) {
+		// 51.2kHz を越えるか、タイマに入らない
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct xp *xp = calloc(1, sizeof(struct xp));
+	if (xp == NULL) {
+		return NULL;
+	}
+	xp->fd = open(XP_DEV, O_RDWR);
+	if (xp->fd == -1) {
+		goto error;
+	}
+
+	if (firmware != NULL) {
+		fwlen = xp_load_firmware(firmware, &fw);
+		if (fwlen < 0) {
+			goto error;
+		}
+		xpdl.data = fw;
+	} else {
+		fwlen = sizeof(xp_builtin_firmware);
+		xpdl.data = (uint8_t *)xp_builtin_firmware;
+	}
+	if (xp_check_firmware(xpdl.data, fwlen) < 0) {
+		goto error;
+	}
+	xpdl.size = fwlen;
+	if (ioctl(xp->fd, XPIOCDOWNLD, &xpdl) != 0) {
+		goto error;
+	}
+	free(fw);
+	fw = NULL;
+
+	xp->ptr = mmap(NULL, XP_MAX_SIZE, PROT_WRITE | PROT_READ,
+		MAP_SHARED, xp->fd, 0);
+	if (xp->ptr == MAP_FAILED) {
+		xp->ptr = NULL;
+		goto error;
+	}
+
+	xp->enc = enc;
+	xp->stride = enc_stride(enc);
+	xp->pollusec = pollusec;
+	xp->rate = (double)XP_TIMER_BASEFREQ / divisor;
+	xp_writemem8(xp, XP_TIMER, divisor - 1);
+	// XP のフォーマットコードは PCM1 = 1 .. PAM3 = 5, ADPT = 6
+	xp_writemem8(xp, XP_ENC, enc - ENC_PCM1 + 1);
+
+	// ファームウェアが動き出すまで待つ
+	double t0 = xp_now();
+	while (xp_readmem8(xp, XP_STAT_READY) != 1) {
+		if (xp_error(xp) < 0) {
+			goto error;
+		}
+		if (xp_now() - t0 > XP_READY_TIMEOUT) {
+			errno = ETIMEDOUT;
+			goto error;
+		}
+		xp_sleep(xp);
+	}
+	return xp;
+
+ error:
+	e = errno;
+	free(fw);
+	if (xp->ptr != NULL) {
+		munmap((void *)xp->ptr, XP_MAX_SIZE);
+	}
+	if (xp->fd != -1) {
+		close(xp->fd);
+	}
+	free(xp);
+	errno = e;
+	return NULL;
+}
+
+/*
+ XP を閉じます。再生中なら止まらないので、先に xp_drain すること。
+ */
+void
+xp_close(struct xp *xp)
+{
+	if (xp->ptr != NULL) {
+		munmap((void *)xp->ptr, XP_MAX_SIZE);
+	}
+	close(xp->fd);
+	free(xp);
+}
+
+/*
+ XP の共有メモリの先頭を返します (prefault 用)。
+ */
+volatile uint8_t *
+xp_window(struct xp *xp, size_t *len)
+{
+	*len = XP_MAX_SIZE;
+	return xp->ptr;
+}
+
+/*
+ XP の実際の再生周波数を返します。
+ */
+double
+xp_rate(struct xp *xp)
+{
+	return xp->rate;
+}
+
+/*
+ 次に書くページを返します。XP がそのページを再生していれば、
+ block なら再生が次のページに移るまで待ち、そうでなければ NULL を返します。
+ waits には待った回数を返します (0 なら待たずに書けた)。
+ XP がエラーを出していれば errno を EIO にして NULL を返します
+ (待たずに NULL を返すときの errno は EAGAIN)。
+ */
+uint8_t *
+xp_page(struct xp *xp, bool block, int *waits)
+{
+	int pageendH = xp->curpage == 0 ? 0x80 : 0xc0;
+	int n = 0;
+
+	if (xp->started) {
+		for (;;) {
+			if (xp_error(xp) < 0) {
+				*waits = n;
+				return NULL;
+			}
+			if (xp_readmem8(xp, XP_PAGEENDH) != pageendH) {
+				break;
+			}
+			if (!block) {
+				*waits = 0;
+				errno = EAGAIN;
+				return NULL;
+			}
+			xp_sleep(xp);
+			n++;
+		}
+	}
+	*waits = n;
+	return (uint8_t *)xp->ptr + (xp->curpage == 0 ? 0x4000 : 0x8000);
+}
+
+/*
+ xp_page で得たページに frames フレームを書いたとして XP に渡します。
+ ページは XP_BUFSIZE バイトすべて埋まっていること。
+ 最初のページなら再生を始めます。
+ 成功すれば 0、XP がエラーを出していれば errno を EIO にして -1 を返します。
+ */
+int
+xp_commit(struct xp *xp, int64_t frames)
+{
+	uint8_t *page = (uint8_t *)xp->ptr + (xp->curpage == 0 ? 0x4000 : 0x8000);
+
+	// 止めるときに鳴らし続ける最後のサンプル
+	xp->laststride = xp->stride;
+	if (xp->enc == ENC_ADPT) {
+		xp->lasthdr = page[0];
+		xp->laststride = page[0] == 3 ? 4 : page[0] == 2 ? 2 : 1;
+	}
+	memcpy(xp->last, page + XP_BUFSIZE - xp->laststride, xp->laststride);
+	xp->drained = false;
+	xp->pagestart[xp->curpage] = xp->committed;
+	xp->pageframes[xp->curpage] = frames;
+	xp->committed += frames;
+
+	if (!xp->started) {
+		// STAT_READY は xp_open で待った。始めると XP が下ろし、
+		// フォーマットがおかしければ STAT_ERROR を上げる
+		xp_writemem8(xp, XP_CMD_START, 1);
+		double t0 = xp_now();
+		while (xp_readmem8(xp, XP_STAT_READY) != 0) {
+			if (xp_error(xp) < 0) {
+				return -1;
+			}
+			if (xp_now() - t0 > XP_READY_TIMEOUT) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			xp_sleep(xp);
+		}
+		xp->started = true;
+		xp->t0 = xp_now();
+	}
+	xp->curpage ^= 1;
+	return xp_error(xp);
+}
+
+/*
+ 再生したフレーム数の見積もりを返します。XP は再生中のページしか
+ 知らせないので、始めてからの時間で見積もり、再生中のページの範囲に
+ 収めます。
+ */
+int64_t
+xp_position(struct xp *xp)
+{
+	if (!xp->started) {
+		return 0;
+	}
+	int playing = xp_readmem8(xp, XP_PAGEENDH) == 0x80 ? 0 : 1;
+	int64_t lo = xp->pagestart[playing];
+	int64_t hi = lo + xp->pageframes[playing];
+	int64_t pos = (int64_t)((xp_now() - xp->t0) * xp->rate);
+	if (pos < lo) {
+		pos = lo;
+	}
+	if (pos > hi) {
+		pos = hi;
+	}
+	return pos;
+}
+
+/*
+ 渡したページをすべて再生し終えるまで待ち、その後は最後のサンプルを
+ 鳴らし続けるようにします。
+ 成功すれば 0、XP がエラーを出していれば errno を EIO にして -1 を返します。
+ */
+int
+xp_drain(struct xp *xp)
+{
+	int waits;
+
+	if (!xp->started || xp->drained) {
+		return 0;
+	}
+	// 2 ページとも最後のサンプルで埋める。2 つ目を書けるようになったとき
+	// (XP が 1 つ目に移ったとき) に、最後のページは再生し終わっている
+	for (int k = 0; k < 2; k++) {
+		uint8_t *page = xp_page(xp, true, &waits);
+		if (page == NULL) {
+			return -1;
+		}
+		BUFFER buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.ptr = page;
+		buf.bufsize = XP_BUFSIZE;
+		if (xp->enc == ENC_ADPT) {
+			// 最後のページと同じフォーマットのページにする (adpt.c)
+			memset(page, 0, 4);
+			page[0] = xp->lasthdr;
+			buf.ptr += 4;
+			buf.bufsize -= 4;
+		}
+		memcpy(buf.ptr, xp->last, xp->laststride);
+		buf.length = xp->laststride;
+		filltail(&buf, xp->laststride);
+		// 無音は位置に数えない
+		if (xp_commit(xp, 0) < 0) {
+			return -1;
+		}
+	}
+	xp->drained = true;
+	return 0;
+}
@@ -39,8 +39,9 @@ NMI:
 
 ; shared variable area
 	.ORG	0100H
-				; MAGIC 8 byte
-MAGIC:		DB	"LUNAPSG",0
+				; MAGIC 8 byte ("LUNAPSG" + version)
+				; version 2: FORMAT is 1..6 (not the raw encoding)
+MAGIC:		DB	"LUNAPSG",2
 
 				; start command (NZ = start)
 				; Host -> XP
@@ -169,12 +170,12 @@ START_LOOP:
 	LD	DE,INTERNAL_RAM
 	LDIR
 
-			; format 1 to 5
+			; format 1 to 6
 	LD	A,(FORMAT)
 	OR	A
 	JP	Z,ERROR
-	CP	6
-	JP	C,ERROR
+	CP	7
+	JP	NC,ERROR
 
 			; BC = (A - 1) * 8
 	DEC	A
@@ -192,9 +193,10 @@ START_LOOP:
 			; copy interrupt handler
 	POP	HL
 	POP	BC
-			; also, set interrupt vector
-	LD	(VEC_PRT0),HL
 	LDIR
+			; interrupt vector = PRTINT (internal RAM)
+	LD	HL,INTERNAL_RAM
+	LD	(VEC_PRT0),HL
 			; copy main routine
 	POP	HL
 	POP	BC
@@ -276,6 +278,11 @@ MAP_FMT:
 	DW	PAM3INT_END - PAM3INT
 	DW	PAM3
 	DW	PAM3_END - PAM3
+
+	DW	ADPTINT
+	DW	ADPTINT_END - ADPTINT
+	DW	ADPT
+	DW	ADPT_END - ADPT
 	
 
 	; 割り込みエントリ共通条件
@@ -283,6 +290,7 @@ MAP_FMT:
 	; HL   データアドレス
 	; C    PSG_DAT
 	; PSG のアドレスレジスタは 8 を指している
+	; Z    ページの先頭 (PRTINT がセットする)
 
 PRTINT:
 	; HL のラウンディングとホストとのやりとりは
@@ -308,6 +316,13 @@ PRTINT:
 			; level 5 interrupt
 HOSTINTR	.EQU	0A0H
 	OUT	(HOSTINTR),A
+			; page 1 end -> page 0
+	CP	80H
+	JR	NZ,PRTINT_TOP
+	LD	H,40H
+PRTINT_TOP:
+			; Z = page top
+	CP	A
 PRTINT_SKIP:
 	
 PRTINT_END:
@@ -415,6 +430,88 @@ PAM3INT:
 PAM3INT_END:
 
 
+ADPT:
+	; ページヘッダを最初の割り込みで読む。
+	; タイマーは RET の後で動き出すので、最初の割り込みより先にここを通る。
+	LD	IX,ADPT_PAGE + ADPT_RT
+ADPT_LOOP:
+	HALT
+	JR	ADPT_LOOP
+ADPT_END:
+
+	; ADPTINT を内蔵 RAM に置いたときのアドレスへの補正
+ADPT_RT	.EQU	INTERNAL_RAM + (PRTINT_END - PRTINT) - ADPTINT
+
+	; ページのフォーマットごとの再生コード (内蔵 RAM のアドレス)
+ADPT_TBL:
+	DW	ADPT_P1 + ADPT_RT
+	DW	ADPT_P1 + ADPT_RT
+	DW	ADPT_P2 + ADPT_RT
+	DW	ADPT_P3 + ADPT_RT
+
+ADPTINT:
+	; IX   このページの再生コード
+	JR	Z,ADPT_PAGE
+	JP	(IX)
+
+ADPT_PAGE:
+			; page header: format, 0, count (LE16)
+	LD	A,(HL)
+	AND	3
+	ADD	A,A
+	LD	E,A
+	LD	D,0
+	LD	IX,ADPT_TBL
+	ADD	IX,DE
+	LD	E,(IX+0)
+	LD	D,(IX+1)
+	PUSH	DE
+	POP	IX
+	LD	DE,4
+	ADD	HL,DE
+			; PCM1/PCM2 では使わないチャンネルを止める
+	LD	E,0
+	LD	A,9
+	OUT	(PSG_ADR),A
+	OUT	(C),E
+	INC	A
+	OUT	(PSG_ADR),A
+	OUT	(C),E
+	LD	A,8
+	OUT	(PSG_ADR),A
+	JP	(IX)
+
+ADPT_P1:
+	OUTI
+	EI
+	RETI
+
+ADPT_P2:
+	LD	A,8
+	OUT	(PSG_ADR),A
+	OUTI
+	INC	A
+	OUT	(PSG_ADR),A
+	OUTI
+	EI
+	RETI
+
+ADPT_P3:
+	INC	HL
+	LD	A,8
+	OUT	(PSG_ADR),A
+	OUTI
+	INC	A
+	OUT	(PSG_ADR),A
+	OUTI
+	INC	A
+	OUT	(PSG_ADR),A
+	OUTI
+	EI
+	RETI
+ADPTINT_END:
+
+
 			; internal RAM
 	.PHASE	0FE00H
 INTERNAL_RAM: